@@ -5,21 +5,86 @@
 
 #include "utils.h"
 
+typedef enum {
+    ARENA_PAGES_SMALL,   // base pages
+    ARENA_PAGES_THP,     // transparent huge pages: 2 MiB aligned reservation advised with MADV_HUGEPAGE
+    ARENA_PAGES_HUGE_2M, // explicit hugetlbfs pages for the whole reservation, THP when the pool is too small
+    ARENA_PAGES_HUGE_1G, // or the reservation is above ARENA_HUGETLB_MAX_RESERVE
+} ArenaPages;
+
+// hugetlb mappings take their pages from the pool at mmap time, for the whole reservation and not just
+// what gets committed. Larger reservations would pin that much of the pool, they get THP instead.
+#define ARENA_HUGETLB_MAX_RESERVE GiB(1)
+
+typedef enum {
+    ARENA_NUMA_FIRST_TOUCH, // a page lands on the node of the thread touching it first (kernel default)
+    ARENA_NUMA_BIND,        // pages only come from node_mask
+    ARENA_NUMA_INTERLEAVE,  // pages round-robin over node_mask, for data every thread reads (weights)
+} ArenaNuma;
+
+typedef struct {
+    ArenaPages pages;
+    ArenaNuma numa;
+    u64 node_mask; // bit i = node i, 0 = every node the process may use
+} ArenaOptions;
+
 typedef struct {
     usize reserve_size;
     usize commit_size;
     usize alloc_pos;
     usize commit_pos;
     usize alignment;
+    usize page_size;  // of the pages backing the arena, commits are multiples of it
+    ArenaPages pages; // what was actually obtained, explicit huge pages may have fallen back to THP
+    usize peak_pos;
+    usize decommit_slack; // see arena_set_decommit, 0 = never
+    u64 n_allocs;
+    u64 n_commits;
+    u64 n_decommits;
 } arena_allocator;
 
+// bytes exclude the arena's own header
+typedef struct {
+    usize reserved;
+    usize committed;
+    usize used;
+    usize peak; // highest used since creation or arena_reset_peak
+    u64 n_allocs;
+    u64 n_commits;   // times the committed range grew
+    u64 n_decommits; // times it was handed back
+} ArenaStats;
+
+// base pages, first touch placement
 arena_allocator* arena_create(usize reserve_size, usize commit_size, usize alignment);
+// Page size and NUMA policy are set on the whole reservation up front and apply as pages are
+// first touched, committing never touches memory. With ARENA_NUMA_FIRST_TOUCH, filling buffers
+// from the threads that will use them (parallel_first_touch) keeps their pages node local.
+arena_allocator* arena_create_opts(usize reserve_size, usize commit_size, usize alignment, const ArenaOptions* opts);
 bool arena_destroy(arena_allocator* arena);
 
 void* arena_alloc(arena_allocator* arena, usize el_size, usize n_el);
+// alignment (a power of two) may exceed the arena's, the arena base is page aligned
+void* arena_alloc_aligned(arena_allocator* arena, usize el_size, usize n_el, usize alignment);
 void arena_free(arena_allocator* arena);
 void arena_free_size(arena_allocator* arena, usize size);
 void arena_free_to(arena_allocator* arena, usize new_pos);
 
+// Decommit with hysteresis: once a free leaves more than slack bytes committed above alloc_pos, the
+// pages past alloc_pos (rounded up to commit_size) are dropped and protected again, so the memory of
+// a spike goes back to the system. Frees within slack keep their pages, pick slack above the memory
+// a step normally frees to avoid recommitting every step. 0 (the default) never decommits.
+void arena_set_decommit(arena_allocator* arena, usize slack);
+ArenaStats arena_get_stats(const arena_allocator* arena);
+void arena_reset_peak(arena_allocator* arena);
+
+// everything allocated from arena between begin and end is released by end, scopes nest
+typedef struct {
+    arena_allocator* arena;
+    usize pos;
+} arena_scope;
+
+arena_scope arena_scope_begin(arena_allocator* arena);
+void arena_scope_end(arena_scope scope);
+
 
 #endif
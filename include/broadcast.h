@@ -0,0 +1,34 @@
+#ifndef BROADCAST_H
+#define BROADCAST_H
+
+#include "utils.h"
+#include "tensor.h"
+
+#define BROADCAST_OPERANDS 3
+
+// processes one innermost run: result[i * r_stride] = a[i * a_stride] op b[i * b_stride] for i < n
+typedef void(*broadcast_row_fn)(const f32* a, usize a_stride, const f32* b, usize b_stride, f32* result, usize r_stride, usize n);
+
+// Iteration space of a binary elementwise op with the fewest possible loops. Size-1 dims are dropped
+// and neighbouring dims are merged whenever every operand (broadcast ones having stride 0) walks them
+// as a single flat run, so same-shape and scalar-broadcast ops become one loop and bias-style row
+// broadcasts two. dims are outermost first, the last one is handed to the row kernel.
+typedef struct {
+    u32 n_dims;
+    u32 shape[4];
+    usize stride[BROADCAST_OPERANDS][4]; // a, b, result
+} BroadcastIter;
+
+void broadcast_iter_init(BroadcastIter* it, const Tensor* a, const Tensor* b, const Tensor* result);
+// number of innermost runs
+usize broadcast_iter_rows(const BroadcastIter* it);
+// one innermost run of n elements, offsets and strides are in elements of each operand (a, b, result)
+typedef void(*broadcast_visit_fn)(void* ctx, const usize* offsets, const usize* strides, usize n);
+
+// runs rows [row_begin, row_end) through row
+void broadcast_iter_run(const BroadcastIter* it, const f32* a, const f32* b, f32* result,
+                        usize row_begin, usize row_end, broadcast_row_fn row);
+// the same rows as offsets, for operands that aren't all f32
+void broadcast_iter_visit(const BroadcastIter* it, usize row_begin, usize row_end, broadcast_visit_fn fn, void* ctx);
+
+#endif
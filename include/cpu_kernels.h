@@ -0,0 +1,91 @@
+#ifndef CPU_KERNELS_H
+#define CPU_KERNELS_H
+
+#include "utils.h"
+#include "tensor.h"
+#include "broadcast.h"
+
+typedef enum {
+    CPU_ISA_SCALAR,
+    CPU_ISA_AVX2,
+    CPU_ISA_AVX512,
+    CPU_ISA_COUNT
+} CpuIsa;
+
+// element (i, j) lives at data[i * rs + j * cs], so transposed operands are just swapped strides.
+// bf16 operands set data16 instead (data NULL) and are widened to f32 while being packed.
+typedef struct {
+    const f32* data;
+    usize rs;
+    usize cs;
+    const bf16* data16;
+} StridedMat;
+
+// the same operand starting at element i
+static inline StridedMat mat_offset(StridedMat m, usize i) {
+    if (m.data16 != NULL) {
+        m.data16 += i;
+    } else {
+        m.data += i;
+    }
+    return m;
+}
+
+// applied to each output tile of a gemm while it is still in registers:
+// c = max(c + bias[j], 0) when relu, bias (length n, may be NULL) is indexed by output column.
+// accumulate adds the product to what c already holds instead of overwriting it.
+typedef struct {
+    const f32* bias;
+    bool relu;
+    bool accumulate;
+} GemmEpilogue;
+
+// Innermost loops of the _tensor_kernel_* functions. src/cpu_kernels_impl.h is compiled once per
+// ISA into one of these tables, the rest of src/cpu_kernels.c (shape logic, batching, threading)
+// is shared and calls through cpu_kernels().
+typedef struct {
+    CpuIsa isa;
+    u32 gemm_mr;
+    u32 gemm_nr;
+    // c[m x n] = epi(a[m x k] * b[k x n]), c is row-major with leading dimension ldc, epi may be NULL
+    void (*gemm)(StridedMat a, StridedMat b, f32* c, usize ldc, u32 m, u32 k, u32 n, const GemmEpilogue* epi);
+    // innermost runs of the binary elementwise ops, indexed by BinaryOp
+    broadcast_row_fn binary[BINARY_OP_COUNT];
+    // dst[j] = sum of src[r * ld + j] over r < rows
+    void (*reduce_rows)(const f32* src, usize rows, usize cols, usize ld, f32* dst);
+    // the same sums in the same order over bf16 rows
+    void (*reduce_rows_bf16)(const bf16* src, usize rows, usize cols, usize ld, f32* dst);
+    // dst = src converted, bf16 rounded to nearest even
+    void (*cvt_to_f32)(const bf16* src, f32* dst, usize n);
+    void (*cvt_to_bf16)(const f32* src, bf16* dst, usize n);
+    // softmax cross entropy of one row, stats receives {max, 1 / normalizer} for xent_row_bwd
+    f32 (*xent_row)(const f32* x, const f32* truth, usize n, f32* stats);
+    // grad (+)= scale * (softmax(x) - truth)
+    void (*xent_row_bwd)(const f32* x, const f32* truth, const f32* stats, f32 scale, f32* grad, usize n, bool accumulate);
+    void (*relu)(const f32* src, f32* dst, usize n);
+    // backward kernels store when accumulate is false and add to the existing gradient otherwise
+    void (*relu_bwd)(const f32* src, const f32* in_grad, f32* src_grad, usize n, bool accumulate);
+    // result = a - alpha * b
+    void (*sub_scaled)(const f32* a, const f32* b, f32 alpha, f32* result, usize n);
+    // result = a + alpha * b
+    void (*add_scaled)(const f32* a, const f32* b, f32 alpha, f32* result, usize n);
+    // in place single pass optimizer updates, see _tensor_kernel_momentum_step / _tensor_kernel_adam_step,
+    // p16 (may be NULL) receives the updated p rounded to bf16
+    void (*momentum_step)(f32* p, const f32* g, f32* v, f32 lr, f32 mu, bool nesterov, bf16* p16, usize n);
+    void (*adam_step)(f32* p, const f32* g, f32* m, f32* v, const AdamStep* hp, bf16* p16, usize n);
+} CpuKernels;
+
+extern const CpuKernels cpu_kernels_scalar;
+extern const CpuKernels cpu_kernels_avx2;
+extern const CpuKernels cpu_kernels_avx512;
+
+// best ISA of the host, picked once at startup unless GRADINO_ISA=scalar|avx2|avx512 asks for less
+CpuIsa cpu_isa_detect();
+bool cpu_isa_supported(CpuIsa isa);
+const char* cpu_isa_name(CpuIsa isa);
+// forces a variant (e.g. to verify it), returns false and keeps the current one if the host can't run it
+bool cpu_set_isa(CpuIsa isa);
+CpuIsa cpu_get_isa();
+const CpuKernels* cpu_kernels();
+
+#endif
@@ -9,28 +9,117 @@
 typedef struct GradTensor_struct {
     Tensor* tens;
     Tensor* grad;
-    Tensor* prev_grad;
+    Tensor* tens16; // bf16 copy of tens the matmuls read instead (gradt_enable_bf16), usually NULL
     Op op;  // op which generates this tensor (dst = this)
     bool optimize;
+    // optimizer buffers (momentum velocity, Adam moments) that live across steps, allocated by the first step
+    Tensor* optim_state[2];
+    u64 optim_step;
+    u64 visit_gen; // topological sort mark
+    u64 grad_gen;  // backward pass that last wrote grad, older contents are stale
 } GradTensor;
 
 typedef void(*Optimizer)(GradTensor* gt, void* optim_config);
 
+// Everything the gradt_* calls share: the arenas below, the no-grad flag and the backward bookkeeping.
+// Each thread works in its current context, a thread-local default until it sets one, so threads with
+// contexts (or defaults) of their own build and train graphs concurrently without any locking.
+// A GradTensor belongs to the context that created it and must not be mixed with another's.
+typedef struct GradContext_struct GradContext;
+
+typedef struct {
+    u32 node; // index into GradPlan.order
+    bool bwd; // the node's backward, otherwise its forward
+} PlanStep;
+
+// A captured fixed-shape graph: the execution order of everything behind loss, computed once.
+// Replaying reruns the kernels on the same buffers, no nodes are built and no memory is kept per step.
+typedef struct {
+    GradTensor* loss;
+    GradTensor** order; // topological, loss last
+    usize len;
+    // what a step runs: every fwd in order, then every bwd in reverse (checkpointing adds recomputation)
+    PlanStep* steps;
+    usize n_steps;
+    GradContext* ctx; // the context it was captured in, steps run in it
+} GradPlan;
+
+// the context takes ownership of arena (may be NULL, see gradt_set_arena)
+GradContext* gradt_context_create(arena_allocator* arena);
+// destroys its arena too, the calling thread falls back to its default if it was current
+void gradt_context_destroy(GradContext* ctx);
+// makes ctx the calling thread's context (NULL: the thread default), returns the previous one
+GradContext* gradt_context_set(GradContext* ctx);
+GradContext* gradt_context();
+
+// the arena of the current context
 void gradt_set_arena(arena_allocator* arena);
 void gradt_destroy_arena();
 void gradt_detach_arena();
 void gradt_set_and_destroy_arena(arena_allocator* arena);
 arena_allocator* _gradt_get_arena();
 
+// Where memory comes from: the gradt arena holds parameters, leaves created with gradt_create* and
+// optimizer state. Op outputs (value, grad and the node) go to the activation arena, so a training
+// step can be wrapped in an arena_scope on it. Backward kernels take their temporaries from the temp
+// arena inside a scope of their own. Both default to the gradt arena when unset (NULL).
+void gradt_set_activation_arena(arena_allocator* arena);
+void gradt_set_temp_arena(arena_allocator* arena);
+arena_allocator* _gradt_get_activation_arena();
+arena_allocator* _gradt_get_temp_arena();
+
+// Called by a backward op right before it contributes to gt's gradient. Returns false for the first
+// contribution of the current backward pass (store into grad) and true after that (add to it), so
+// grads are never zeroed up front. Grads nobody contributed to keep stale contents, see gradt_grad.
+bool _gradt_grad_accumulate(GradTensor* gt);
+// gt's gradient after a backward pass. A grad the last pass didn't write (nodes only reached through
+// skipped ops, inputs an op has no gradient for) is zeroed here, on its first read, instead of by
+// every pass. The optimizers read grads through it; gt->grad itself may be stale.
+Tensor* gradt_grad(GradTensor* gt);
+
+// No-grad mode (inference): while disabled, gradt_create* skip the gradient buffer and the op
+// builders only compute their output, without grads or a graph to backpropagate through.
+// Returns the previous setting, so a no-grad section nests by restoring it:
+//     bool prev = gradt_set_grad_enabled(false); ...; gradt_set_grad_enabled(prev);
+bool gradt_set_grad_enabled(bool enabled);
+bool gradt_grad_enabled();
+
+// bf16 weights with an f32 master: matmuls (linear, mul) read a bf16 copy of gt's value, halving the
+// bytes they stream for it in both passes, while the optimizer keeps updating gt->tens in f32. The
+// optimizer rounds the copy again: momentum and Adam in the same pass as the update, SGD and custom
+// optimizers with _gradt_sync_bf16 after it. param_slab_create moves the copies into a slab of their own.
+// Activations take the dtype of the input they are computed from, see tensor_to_dtype.
+void gradt_enable_bf16(GradTensor* gt);
+// refreshes gt's bf16 copy from its value, if it has one (for optimizers that don't write it themselves)
+void _gradt_sync_bf16(GradTensor* gt);
+// what a matmul reads for gt
+static inline const Tensor* gradt_value(const GradTensor* gt) {
+    return gt->tens16 != NULL ? gt->tens16 : gt->tens;
+}
+
 GradTensor* gradt_create(u32* shape, usize shape_len);
 GradTensor* gradt_create_from_tens(Tensor* tens);
 GradTensor* gradt_create_from_labels(u32* labels, u32 n_classes, u32 n_labels, bool optimize);
 GradTensor* gradt_create_nograd(u32* shape, usize shape_len);
 
+// The op builders return NULL when the operands don't fit (shapes, dtypes the kernel can't take).
 GradTensor* gradt_relu(GradTensor* gt);
+// the sum takes gt1's dtype
 GradTensor* gradt_add(GradTensor* gt1, GradTensor* gt2);
 GradTensor* gradt_mul(GradTensor* gt1, GradTensor* gt2);
+// relu(x * w + b) (or without the relu) as a single node, b is an f32 {1, 1, 1, n} row or NULL
+GradTensor* gradt_linear(GradTensor* x, GradTensor* w, GradTensor* b, bool relu);
+// bf16 logits go through gradt_cast to f32 first
 GradTensor* gradt_cross_entropy_loss(GradTensor* src, GradTensor* truth);
+// gt rounded to (or widened from) bf16
+GradTensor* gradt_cast(GradTensor* gt, TensorDtype dtype);
+// optim may be NULL, e.g. when the parameters are stepped through a ParamSlab
 void gradt_backward(GradTensor* gt, Optimizer optim, void* optim_config);
 
+// records the graph behind loss, built once with the usual gradt_* calls, for replay
+// (its activations must stay allocated as long as the plan is used)
+GradPlan gradt_plan_capture(GradTensor* loss);
+// forward on the current leaf values (write new inputs into their tensors first), backward and optim
+void gradt_plan_step(GradPlan* plan, Optimizer optim, void* optim_config);
+
 #endif
@@ -0,0 +1,29 @@
+#ifndef MEM_PLAN_H
+#define MEM_PLAN_H
+
+#include "grad.h"
+#include "arena.h"
+
+typedef struct {
+    usize naive_bytes;   // every value and grad in a buffer of its own, as the graph was built
+    usize planned_bytes; // size of the shared pool, i.e. the planned peak
+    usize n_buffers;
+    usize n_inplace;     // buffers that took over the memory of an elementwise op's input
+} MemPlanStats;
+
+// Liveness planning over a captured graph. Each op output's value and grad is live from a step of
+// GradPlan.steps writing it to the last one reading it (a recomputed value twice). Buffers never
+// live at the same time are placed at the same offsets of one pool allocated from arena, and
+// elementwise ops (relu, same-shape add) write straight over an input that dies at them. Leaves
+// (parameters, inputs, labels) and the loss stay where they are. Afterwards only the loss value is
+// meaningful between steps, intermediate values get overwritten.
+MemPlanStats mem_plan_apply(GradPlan* plan, arena_allocator* arena);
+
+// Activation checkpointing: splits plan->order into segments of `every` ops and keeps only the last
+// output of each. The other outputs of a segment are recomputed right before the segment's backward,
+// which costs up to one extra forward pass. An output read outside its own segment (e.g. a residual)
+// is kept too. Memory is only saved once the buffers are placed, so call mem_plan_apply afterwards.
+// Returns the number of recomputed ops.
+usize mem_plan_checkpoint(GradPlan* plan, usize every);
+
+#endif
@@ -1,17 +1,22 @@
 #ifndef OPS_H
 #define OPS_H
 
+#include "tensor.h"
+
 struct GradTensor_struct;
 
 typedef enum {
     Mono,
-    Binary
+    Binary,
+    Ternary
 } OpType;
 
 typedef void(*mono_op_fwd)(const struct GradTensor_struct* src, struct GradTensor_struct* dst);
 typedef void(*mono_op_bwd)(struct GradTensor_struct* src, const struct GradTensor_struct* dst);
 typedef void(*bin_op_fwd)(const struct GradTensor_struct* src1, const struct GradTensor_struct* src2, struct GradTensor_struct* dst);
 typedef void(*bin_op_bwd)(struct GradTensor_struct* src1, struct GradTensor_struct* src2, const struct GradTensor_struct* dst);
+typedef void(*tern_op_fwd)(const struct GradTensor_struct* src1, const struct GradTensor_struct* src2, const struct GradTensor_struct* src3, struct GradTensor_struct* dst);
+typedef void(*tern_op_bwd)(struct GradTensor_struct* src1, struct GradTensor_struct* src2, struct GradTensor_struct* src3, const struct GradTensor_struct* dst);
 
 typedef struct {
     struct GradTensor_struct* src;
@@ -28,21 +33,47 @@ typedef struct {
     bin_op_bwd bwd;
 } BinOp;
 
+typedef struct {
+    struct GradTensor_struct* src1;
+    struct GradTensor_struct* src2;
+    struct GradTensor_struct* src3;
+    struct GradTensor_struct* dst;
+    tern_op_fwd fwd;
+    tern_op_bwd bwd;
+} TernOp;
+
+// values an op's bwd reads besides dst's gradient (a mono op's src counts as src1)
+#define OP_BWD_SRC1 (1u << 0)
+#define OP_BWD_SRC2 (1u << 1)
+#define OP_BWD_SRC3 (1u << 2)
+#define OP_BWD_DST (1u << 3)
+
 typedef struct {
     OpType type;
     union {
         MonoOp mono;
         BinOp bin;
+        TernOp tern;
     } op;
+    Tensor* saved; // computed by fwd for bwd (e.g. softmax statistics), NULL for most ops
+    u32 bwd_reads; // OP_BWD_* flags
+    // elementwise: dst may overwrite a same-shape src in fwd and a src grad may overwrite dst's grad in bwd
+    bool inplace;
 } Op;
 
 void op_fwd(Op* op);
 void op_bwd(Op* op);
+// fills srcs with the op's inputs (src1 first), returns how many there are
+usize op_srcs(const Op* op, struct GradTensor_struct** srcs);
 
 void op_set_nop(Op* op);
 void op_set_relu(Op* op, struct GradTensor_struct* src, struct GradTensor_struct* dst);
 void op_set_add(Op* op, struct GradTensor_struct* src1, struct GradTensor_struct* src2, struct GradTensor_struct* dst);
 void op_set_mul(Op* op, struct GradTensor_struct* src1, struct GradTensor_struct* src2, struct GradTensor_struct* dst);
-void op_set_cse(Op* op, struct GradTensor_struct* src, struct GradTensor_struct* truth, struct GradTensor_struct* dst);
+// dst = src in dst's dtype, the gradient passes through unchanged
+void op_set_cast(Op* op, struct GradTensor_struct* src, struct GradTensor_struct* dst);
+// dst = relu(x * w + b) (or without the relu) as one fused gemm
+void op_set_linear(Op* op, struct GradTensor_struct* x, struct GradTensor_struct* w, struct GradTensor_struct* b, struct GradTensor_struct* dst, bool relu);
+void op_set_cse(Op* op, struct GradTensor_struct* src, struct GradTensor_struct* truth, struct GradTensor_struct* dst, Tensor* stats);
 
 #endif
@@ -3,6 +3,9 @@
 
 #include "grad.h"
 
+// All optimizers update gt->tens in place in a single pass. State that lives across steps is kept in
+// gt->optim_state and allocated from the gradt arena on the first step only.
+
 typedef struct {
     f32 lr;
 } SGDConfig;
@@ -13,9 +16,25 @@ SGDConfig optim_sgd_get_config(f32 lr);
 typedef struct {
     f32 lr;
     f32 mu;
+    bool nesterov;
 } SGDMomentumConfig;
 
+// v = mu * v + g, p -= lr * v, or p -= lr * (g + mu * v) with nesterov
 void optim_sgd_momentum(GradTensor* gt, void* sgd_momentum_config);
 SGDMomentumConfig optim_sgd_momentum_get_config(f32 lr, f32 mu);
+SGDMomentumConfig optim_sgd_nesterov_get_config(f32 lr, f32 mu);
+
+typedef struct {
+    f32 lr;
+    f32 beta1;
+    f32 beta2;
+    f32 eps;
+    f32 weight_decay;
+    bool decoupled; // AdamW: decay the weights directly instead of adding weight_decay * p to the gradient
+} AdamConfig;
+
+void optim_adam(GradTensor* gt, void* adam_config);
+AdamConfig optim_adam_get_config(f32 lr, f32 beta1, f32 beta2, f32 eps, f32 weight_decay);
+AdamConfig optim_adamw_get_config(f32 lr, f32 beta1, f32 beta2, f32 eps, f32 weight_decay);
 
 #endif
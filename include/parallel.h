@@ -0,0 +1,34 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include "utils.h"
+#include "arena.h"
+
+// processes [begin, end) of a parallel_for range
+typedef void(*parallel_for_fn)(void* ctx, usize begin, usize end);
+
+// starts n_threads - 1 persistent workers (the calling thread is the n-th), optionally pinning
+// worker i to the i+1-th allowed core. 1, the default, keeps every kernel on the calling thread.
+// Resizing waits for running parallel_for calls of other threads and blocks new ones until the
+// pool is rebuilt; it must not be called from inside a parallel_for task.
+void parallel_init(u32 n_threads, bool pin_cores);
+// parallel_init keeping the current pinning
+void parallel_set_num_threads(u32 n_threads);
+u32 parallel_get_num_threads();
+void parallel_shutdown();
+
+// runs fn over [begin, end) in chunks of at least grain elements and returns once all of them are done.
+// Ranges are split lazily in halves onto the submitting thread's deque and idle workers steal the
+// other halves, so callers can nest parallel_for inside tasks and submit from any thread.
+void parallel_for(usize begin, usize end, usize grain, parallel_for_fn fn, void* ctx);
+
+// Per thread arena for temporaries of kernels running inside parallel_for tasks, where the caller's
+// arenas can't be shared. Take it in an arena_scope; it lives until its thread exits, the calling
+// thread's until parallel_shutdown.
+arena_allocator* parallel_scratch_arena();
+
+// zero fills fresh memory in parallel_for chunks, so under first touch placement its pages end up
+// spread over the nodes of the threads whose kernels split the same way
+void parallel_first_touch(void* mem, usize bytes);
+
+#endif
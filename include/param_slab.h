@@ -0,0 +1,22 @@
+#ifndef PARAM_SLAB_H
+#define PARAM_SLAB_H
+
+#include "grad.h"
+
+// Trainable parameters packed into contiguous slabs (values, gradients, both optimizer state buffers
+// and bf16 copies), so one optimizer call sweeps all of them. The registered GradTensors stay valid:
+// their tensors become views into the slabs, so e.g. LinearLayer.w / .b keep working unchanged.
+typedef struct {
+    GradTensor** params;
+    usize n_params;
+    GradTensor* flat; // {1, 1, 1, len} over the whole slab, what the optimizer sees
+} ParamSlab;
+
+// moves params (current values, gradients and any existing optimizer state) into slabs allocated from
+// the gradt arena and takes them out of the per-tensor optimizer step of gradt_backward. With grad
+// disabled there is nothing to sweep: the slab comes back empty (flat NULL) and params are unchanged.
+ParamSlab param_slab_create(GradTensor** params, usize n_params);
+// one optimizer call over every parameter, run after gradt_backward
+void param_slab_step(ParamSlab* slab, Optimizer optim, void* optim_config);
+
+#endif
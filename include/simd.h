@@ -0,0 +1,277 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// Width-agnostic f32 vector layer for src/cpu_kernels_impl.h. The backend follows the
+// target flags of the including translation unit, so the same kernel source builds
+// into an AVX-512, an AVX2+FMA and a portable scalar variant.
+
+#include "utils.h"
+
+#include <math.h>
+
+// vec_exp: inputs are clamped so 2^n stays a normal float and results below e^-87 flush to 0
+// (denormal results are very slow to produce), the polynomial is the Cephes expf one
+#define SIMD_EXP_HI 88.0f
+#define SIMD_EXP_LO -87.0f
+#define SIMD_LOG2E 1.44269504088896341f
+#define SIMD_LN2_HI 0.693359375f
+#define SIMD_LN2_LO -2.12194440e-4f
+#define SIMD_EXP_P0 1.9875691500e-4f
+#define SIMD_EXP_P1 1.3981999507e-3f
+#define SIMD_EXP_P2 8.3334519073e-3f
+#define SIMD_EXP_P3 4.1665795894e-2f
+#define SIMD_EXP_P4 1.6666665459e-1f
+#define SIMD_EXP_P5 5.0000001201e-1f
+
+// p can be used with vec_load / vec_store
+#define vec_is_aligned(p) (((uintptr_t)(p) & (VEC_WIDTH * sizeof(f32) - 1)) == 0)
+
+// scalar counterpart of vec_exp for loop tails
+static inline f32 simd_expf(f32 x) { return x >= SIMD_EXP_LO ? expf(x) : 0.0f; }
+
+#if defined(__AVX512F__)
+
+#include <immintrin.h>
+
+#define VEC_WIDTH 16
+
+// 12 x 32 tile: 24 accumulators + 2 B vectors + 1 broadcast out of 32 zmm
+#define GEMM_MR 12
+#define GEMM_NR 32
+#define GEMM_MC 480
+#define GEMM_KC 384
+#define GEMM_NC 3072
+
+typedef __m512 vec;
+typedef __mmask16 vec_mask;
+
+static inline vec vec_zero() { return _mm512_setzero_ps(); }
+static inline vec vec_set1(f32 v) { return _mm512_set1_ps(v); }
+static inline vec vec_load(const f32* p) { return _mm512_load_ps(p); }
+static inline vec vec_loadu(const f32* p) { return _mm512_loadu_ps(p); }
+static inline void vec_store(f32* p, vec v) { _mm512_store_ps(p, v); }
+static inline void vec_storeu(f32* p, vec v) { _mm512_storeu_ps(p, v); }
+static inline vec vec_add(vec a, vec b) { return _mm512_add_ps(a, b); }
+static inline vec vec_sub(vec a, vec b) { return _mm512_sub_ps(a, b); }
+static inline vec vec_mul(vec a, vec b) { return _mm512_mul_ps(a, b); }
+static inline vec vec_div(vec a, vec b) { return _mm512_div_ps(a, b); }
+static inline vec vec_sqrt(vec a) { return _mm512_sqrt_ps(a); }
+static inline vec vec_max(vec a, vec b) { return _mm512_max_ps(a, b); }
+// a * b + c
+static inline vec vec_fmadd(vec a, vec b, vec c) { return _mm512_fmadd_ps(a, b, c); }
+static inline f32 vec_reduce_add(vec v) { return _mm512_reduce_add_ps(v); }
+static inline f32 vec_reduce_max(vec v) { return _mm512_reduce_max_ps(v); }
+// y where x > 0, 0 elsewhere
+static inline vec vec_select_pos(vec x, vec y) {
+    return _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(x, _mm512_setzero_ps(), _CMP_GT_OQ), y);
+}
+
+// e^x, Cephes-style: x = n ln2 + r with |r| <= ln2 / 2, degree 6 polynomial for e^r, scaled by 2^n
+static inline vec vec_exp(vec x) {
+    __mmask16 normal = _mm512_cmp_ps_mask(x, _mm512_set1_ps(SIMD_EXP_LO), _CMP_GE_OQ);
+    x = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(SIMD_EXP_LO)), _mm512_set1_ps(SIMD_EXP_HI));
+    vec n = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(SIMD_LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    vec r = _mm512_fnmadd_ps(n, _mm512_set1_ps(SIMD_LN2_HI), x);
+    r = _mm512_fnmadd_ps(n, _mm512_set1_ps(SIMD_LN2_LO), r);
+    vec p = _mm512_set1_ps(SIMD_EXP_P0);
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(SIMD_EXP_P1));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(SIMD_EXP_P2));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(SIMD_EXP_P3));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(SIMD_EXP_P4));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(SIMD_EXP_P5));
+    p = _mm512_fmadd_ps(p, _mm512_mul_ps(r, r), _mm512_add_ps(r, _mm512_set1_ps(1.0f)));
+    return _mm512_maskz_mov_ps(normal, _mm512_scalef_ps(p, n));
+}
+
+// first n lanes, n <= VEC_WIDTH
+static inline vec_mask vec_tail_mask(u32 n) { return (vec_mask)((1u << n) - 1); }
+static inline vec vec_maskz_loadu(vec_mask m, const f32* p) { return _mm512_maskz_loadu_ps(m, p); }
+static inline void vec_mask_storeu(f32* p, vec_mask m, vec v) { _mm512_mask_storeu_ps(p, m, v); }
+
+// VEC_WIDTH bf16 widened by a shift into the upper halves, no BF16 instructions needed
+static inline vec vec_loadu_bf16(const bf16* p) {
+    return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)p)), 16));
+}
+// rounded like bf16_from_f32
+static inline void vec_storeu_bf16(bf16* p, vec v) {
+    __m512i b = _mm512_castps_si512(v);
+    __m512i hi = _mm512_srli_epi32(b, 16);
+    __m512i bias = _mm512_add_epi32(_mm512_and_si512(hi, _mm512_set1_epi32(1)), _mm512_set1_epi32(0x7FFF));
+    __m512i r = _mm512_srli_epi32(_mm512_add_epi32(b, bias), 16);
+    r = _mm512_mask_mov_epi32(r, _mm512_cmp_ps_mask(v, v, _CMP_UNORD_Q), _mm512_or_si512(hi, _mm512_set1_epi32(0x40)));
+    _mm256_storeu_si256((__m256i*)p, _mm512_cvtepi32_epi16(r));
+}
+
+// in-register transpose, rows[i] becomes column i
+static inline void vec_transpose(vec rows[VEC_WIDTH]) {
+    __m512 t[16];
+    for (int i = 0; i < 8; i++) {
+        t[2 * i] = _mm512_unpacklo_ps(rows[2 * i], rows[2 * i + 1]);
+        t[2 * i + 1] = _mm512_unpackhi_ps(rows[2 * i], rows[2 * i + 1]);
+    }
+    for (int i = 0; i < 4; i++) {
+        rows[4 * i] = _mm512_shuffle_ps(t[4 * i], t[4 * i + 2], 0x44);
+        rows[4 * i + 1] = _mm512_shuffle_ps(t[4 * i], t[4 * i + 2], 0xEE);
+        rows[4 * i + 2] = _mm512_shuffle_ps(t[4 * i + 1], t[4 * i + 3], 0x44);
+        rows[4 * i + 3] = _mm512_shuffle_ps(t[4 * i + 1], t[4 * i + 3], 0xEE);
+    }
+    for (int h = 0; h < 2; h++) {
+        for (int i = 0; i < 4; i++) {
+            t[8 * h + i] = _mm512_shuffle_f32x4(rows[8 * h + i], rows[8 * h + 4 + i], 0x88);
+            t[8 * h + 4 + i] = _mm512_shuffle_f32x4(rows[8 * h + i], rows[8 * h + 4 + i], 0xDD);
+        }
+    }
+    for (int i = 0; i < 8; i++) {
+        rows[i] = _mm512_shuffle_f32x4(t[i], t[8 + i], 0x88);
+        rows[8 + i] = _mm512_shuffle_f32x4(t[i], t[8 + i], 0xDD);
+    }
+}
+
+#elif defined(__AVX2__) && defined(__FMA__)
+
+#include <immintrin.h>
+
+#define VEC_WIDTH 8
+
+// 6 x 16 tile: 12 accumulators + 2 B vectors + 1 broadcast out of 16 ymm
+#define GEMM_MR 6
+#define GEMM_NR 16
+#define GEMM_MC 168
+#define GEMM_KC 256
+#define GEMM_NC 4080
+
+typedef __m256 vec;
+typedef __m256i vec_mask;
+
+static inline vec vec_zero() { return _mm256_setzero_ps(); }
+static inline vec vec_set1(f32 v) { return _mm256_set1_ps(v); }
+static inline vec vec_load(const f32* p) { return _mm256_load_ps(p); }
+static inline vec vec_loadu(const f32* p) { return _mm256_loadu_ps(p); }
+static inline void vec_store(f32* p, vec v) { _mm256_store_ps(p, v); }
+static inline void vec_storeu(f32* p, vec v) { _mm256_storeu_ps(p, v); }
+static inline vec vec_add(vec a, vec b) { return _mm256_add_ps(a, b); }
+static inline vec vec_sub(vec a, vec b) { return _mm256_sub_ps(a, b); }
+static inline vec vec_mul(vec a, vec b) { return _mm256_mul_ps(a, b); }
+static inline vec vec_div(vec a, vec b) { return _mm256_div_ps(a, b); }
+static inline vec vec_sqrt(vec a) { return _mm256_sqrt_ps(a); }
+static inline vec vec_max(vec a, vec b) { return _mm256_max_ps(a, b); }
+static inline vec vec_fmadd(vec a, vec b, vec c) { return _mm256_fmadd_ps(a, b, c); }
+static inline f32 vec_reduce_add(vec v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+static inline f32 vec_reduce_max(vec v) {
+    __m128 s = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_max_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_max_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+static inline vec vec_select_pos(vec x, vec y) {
+    return _mm256_and_ps(_mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_GT_OQ), y);
+}
+
+static inline vec vec_exp(vec x) {
+    vec normal = _mm256_cmp_ps(x, _mm256_set1_ps(SIMD_EXP_LO), _CMP_GE_OQ);
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(SIMD_EXP_LO)), _mm256_set1_ps(SIMD_EXP_HI));
+    vec n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(SIMD_LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    vec r = _mm256_fnmadd_ps(n, _mm256_set1_ps(SIMD_LN2_HI), x);
+    r = _mm256_fnmadd_ps(n, _mm256_set1_ps(SIMD_LN2_LO), r);
+    vec p = _mm256_set1_ps(SIMD_EXP_P0);
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(SIMD_EXP_P1));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(SIMD_EXP_P2));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(SIMD_EXP_P3));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(SIMD_EXP_P4));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(SIMD_EXP_P5));
+    p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+    // 2^n built directly in the exponent bits
+    __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    return _mm256_and_ps(normal, _mm256_mul_ps(p, _mm256_castsi256_ps(e)));
+}
+
+static inline vec_mask vec_tail_mask(u32 n) {
+    return _mm256_cmpgt_epi32(_mm256_set1_epi32((i32)n), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+}
+static inline vec vec_maskz_loadu(vec_mask m, const f32* p) { return _mm256_maskload_ps(p, m); }
+static inline void vec_mask_storeu(f32* p, vec_mask m, vec v) { _mm256_maskstore_ps(p, m, v); }
+
+static inline vec vec_loadu_bf16(const bf16* p) {
+    return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)p)), 16));
+}
+static inline void vec_storeu_bf16(bf16* p, vec v) {
+    __m256i b = _mm256_castps_si256(v);
+    __m256i hi = _mm256_srli_epi32(b, 16);
+    __m256i bias = _mm256_add_epi32(_mm256_and_si256(hi, _mm256_set1_epi32(1)), _mm256_set1_epi32(0x7FFF));
+    __m256i r = _mm256_srli_epi32(_mm256_add_epi32(b, bias), 16);
+    __m256i nan = _mm256_castps_si256(_mm256_cmp_ps(v, v, _CMP_UNORD_Q));
+    r = _mm256_blendv_epi8(r, _mm256_or_si256(hi, _mm256_set1_epi32(0x40)), nan);
+    // every lane is below 2^16, so the saturating pack is exact
+    __m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(r), _mm256_extracti128_si256(r, 1));
+    _mm_storeu_si128((__m128i*)p, packed);
+}
+
+static inline void vec_transpose(vec rows[VEC_WIDTH]) {
+    __m256 t[8];
+    for (int i = 0; i < 4; i++) {
+        t[2 * i] = _mm256_unpacklo_ps(rows[2 * i], rows[2 * i + 1]);
+        t[2 * i + 1] = _mm256_unpackhi_ps(rows[2 * i], rows[2 * i + 1]);
+    }
+    for (int i = 0; i < 2; i++) {
+        rows[4 * i] = _mm256_shuffle_ps(t[4 * i], t[4 * i + 2], 0x44);
+        rows[4 * i + 1] = _mm256_shuffle_ps(t[4 * i], t[4 * i + 2], 0xEE);
+        rows[4 * i + 2] = _mm256_shuffle_ps(t[4 * i + 1], t[4 * i + 3], 0x44);
+        rows[4 * i + 3] = _mm256_shuffle_ps(t[4 * i + 1], t[4 * i + 3], 0xEE);
+    }
+    for (int i = 0; i < 4; i++) {
+        t[i] = _mm256_permute2f128_ps(rows[i], rows[4 + i], 0x20);
+        t[4 + i] = _mm256_permute2f128_ps(rows[i], rows[4 + i], 0x31);
+    }
+    for (int i = 0; i < 8; i++) {
+        rows[i] = t[i];
+    }
+}
+
+#else
+
+#define VEC_WIDTH 1
+
+#define GEMM_MR 4
+#define GEMM_NR 4
+#define GEMM_MC 128
+#define GEMM_KC 256
+#define GEMM_NC 2048
+
+typedef f32 vec;
+typedef u32 vec_mask;
+
+static inline vec vec_zero() { return 0.0f; }
+static inline vec vec_set1(f32 v) { return v; }
+static inline vec vec_load(const f32* p) { return *p; }
+static inline vec vec_loadu(const f32* p) { return *p; }
+static inline void vec_store(f32* p, vec v) { *p = v; }
+static inline void vec_storeu(f32* p, vec v) { *p = v; }
+static inline vec vec_add(vec a, vec b) { return a + b; }
+static inline vec vec_sub(vec a, vec b) { return a - b; }
+static inline vec vec_mul(vec a, vec b) { return a * b; }
+static inline vec vec_div(vec a, vec b) { return a / b; }
+static inline vec vec_sqrt(vec a) { return sqrtf(a); }
+static inline vec vec_max(vec a, vec b) { return a > b ? a : b; }
+static inline vec vec_fmadd(vec a, vec b, vec c) { return a * b + c; }
+static inline f32 vec_reduce_add(vec v) { return v; }
+static inline f32 vec_reduce_max(vec v) { return v; }
+static inline vec vec_exp(vec x) { return simd_expf(x); }
+static inline vec vec_select_pos(vec x, vec y) { return x > 0.0f ? y : 0.0f; }
+
+static inline vec_mask vec_tail_mask(u32 n) { return n > 0; }
+static inline vec vec_maskz_loadu(vec_mask m, const f32* p) { return m ? *p : 0.0f; }
+static inline void vec_mask_storeu(f32* p, vec_mask m, vec v) { if (m) *p = v; }
+
+static inline vec vec_loadu_bf16(const bf16* p) { return bf16_to_f32(*p); }
+static inline void vec_storeu_bf16(bf16* p, vec v) { *p = bf16_from_f32(v); }
+
+static inline void vec_transpose(vec rows[VEC_WIDTH]) {}
+
+#endif
+
+#endif
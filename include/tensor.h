@@ -6,42 +6,144 @@
 
 #include <stdbool.h>
 
+typedef enum {
+    BINARY_ADD,
+    BINARY_SUB,
+    BINARY_MUL,
+    BINARY_OP_COUNT
+} BinaryOp;
+
+// hyperparameters of one Adam / AdamW step. l2 is added to the gradient as l2 * p (Adam weight decay),
+// decay shrinks p by lr * decay before the update (AdamW), m_scale / v_scale are the bias corrections
+// 1 / (1 - beta^t) of the current step
+typedef struct {
+    f32 lr;
+    f32 beta1;
+    f32 beta2;
+    f32 eps;
+    f32 l2;
+    f32 decay;
+    f32 m_scale;
+    f32 v_scale;
+} AdamStep;
+
+typedef enum {
+    TENSOR_F32,
+    TENSOR_BF16,
+} TensorDtype;
+
+// Storage dtype. bf16 tensors keep their elements in data16 (data is NULL) and halve the bytes a
+// kernel streams; kernels widen them to f32 in registers and round on the way back. Matmuls (either
+// operand and the result), linear (x, w and the result, the bias stays f32), the binary elementwise
+// ops (any operand, widened a chunk at a time), relu, relu_bwd's mask, copies between dtypes and
+// reduce_add's source take bf16; cross entropy, the flat kernels, and every gradient and optimizer
+// buffer are f32.
 typedef struct {
     u32 shape[4];
     u32 stride[4];
     usize data_len;
     f32* data;
+    bf16* data16;
+    TensorDtype dtype;
 } Tensor;
 
+// tensor data starts on a cache line
+#define TENSOR_ALIGN 64
+
+// Rows (the last dim) of a tensor start ld floats apart, ld >= shape[3]. tensor_create uses
+// ld = shape[3] (contiguous) unless row padding is enabled, then tensor_padded_ld. Every kernel
+// reads rows through the strides; the padding is zeroed and never read.
 Tensor* tensor_create(const u32* shape, usize shape_len, arena_allocator* arena);
+Tensor* tensor_create_ld(const u32* shape, usize shape_len, u32 ld, arena_allocator* arena);
+// bf16 rows are never padded
+Tensor* tensor_create_dtype(const u32* shape, usize shape_len, TensorDtype dtype, arena_allocator* arena);
+// same shape and row padding as t, always f32 (grads and optimizer state mirror their value's layout)
+Tensor* tensor_create_like(const Tensor* t, arena_allocator* arena);
+// a converted copy of t, rounded to nearest even into bf16
+Tensor* tensor_to_dtype(const Tensor* t, TensorDtype dtype, arena_allocator* arena);
+usize tensor_elem_size(const Tensor* t);
+// cols rounded up to a cache line, plus one more when rows would be a multiple of 4 KiB apart
+// (4K aliasing between the rows of a gemm tile), narrow rows stay as they are
+u32 tensor_padded_ld(u32 cols);
+// returns the previous setting, applies to tensors created afterwards
+bool tensor_set_row_padding(bool enabled);
+// distance between rows when t is evenly spaced unit stride rows (contiguous, padded, column
+// windows), 0 otherwise
+u32 tensor_row_ld(const Tensor* t);
+// floats from the first to the last element
+usize tensor_storage_len(const Tensor* t);
+
+// Views share data with t at an element offset with their own shape and strides, only the header is
+// allocated. Binary / unary elementwise ops, matmuls and cross entropy (rows need a unit inner
+// stride) read views directly. The flat kernels (optimizer updates, *_scaled, relu_bwd) walk rows
+// tensor_row_ld apart: tensor_reduce_add and tensor_*_scaled pack views without evenly spaced rows
+// (transposes) with tensor_contiguous first, gradt_create_from_tens rejects them as optimizer
+// updates run in place. Size-1 dims get stride 0.
+Tensor* tensor_view(const Tensor* t, const u32* shape, const u32* stride, usize offset, arena_allocator* arena);
+// indices [begin, end) of dim, e.g. a minibatch window of a {1, 1, samples, features} dataset
+Tensor* tensor_slice(const Tensor* t, usize dim, u32 begin, u32 end, arena_allocator* arena);
+// the same elements in another shape, NULL unless t is contiguous and the element count matches
+Tensor* tensor_reshape(const Tensor* t, const u32* shape, usize shape_len, arena_allocator* arena);
+// swaps the last two dims by swapping strides, a matmul on it runs as the _at / _bt variant
+Tensor* tensor_transpose(const Tensor* t, arena_allocator* arena);
+bool tensor_is_contiguous(const Tensor* t);
+// t itself when contiguous, otherwise a packed copy
+Tensor* tensor_contiguous(const Tensor* t, arena_allocator* arena);
 
 void tensor_print(const Tensor* t, bool print_data);
 void tensor_randomize(Tensor* t, f32 min, f32 max);
 void tensor_set(Tensor* t, f32 v);
 
+// the sum takes a's dtype, b may be either
 Tensor* tensor_add(const Tensor* a, const Tensor* b, arena_allocator* arena);
+// matmul results take the dtype of the left operand (x for linear), the weights may be either
 Tensor* tensor_mul(const Tensor* a, const Tensor* b, arena_allocator* arena);
 Tensor* tensor_mul_tr(const Tensor* a, const Tensor* b, bool at, bool bt, arena_allocator* arena);
+// relu(x * w + bias) (or without the relu) in one pass, bias is an f32 {1, 1, 1, n} row or NULL
+Tensor* tensor_linear(const Tensor* x, const Tensor* w, const Tensor* bias, bool relu, arena_allocator* arena);
 Tensor* tensor_reduce_add(const Tensor* src, usize dim, arena_allocator* arena);
-Tensor* tensor_cross_entropy(const Tensor* src, const Tensor* truth, arena_allocator* arena);
+// mean softmax cross entropy over rows, stats_out (optional) receives the per row softmax statistics.
+// src and truth have to be f32, NULL otherwise.
+Tensor* tensor_cross_entropy(const Tensor* src, const Tensor* truth, Tensor** stats_out, arena_allocator* arena);
 // result = a - alpha * b, no broadcasting
 Tensor* tensor_sub_scaled(const Tensor* a, const Tensor* b, f32 alpha, arena_allocator* arena);
 // result = a + alpha * b, no broadcasting
 Tensor* tensor_add_scaled(const Tensor* a, const Tensor* b, f32 alpha, arena_allocator* arena);
 
-void _tensor_kernel_cross_entropy(const Tensor* src, const Tensor* truth, Tensor* result);
+// per row softmax statistics cached by the cross entropy forward: max, 1 / normalizer, row loss
+#define XENT_STATS 3
+// stats has shape {1, 1, rows, XENT_STATS}
+void _tensor_kernel_cross_entropy(const Tensor* src, const Tensor* truth, Tensor* result, Tensor* stats);
+// result = a op b with numpy-style broadcasting of size-1 dims
+void _tensor_kernel_binary(BinaryOp op, const Tensor* a, const Tensor* b, Tensor* result);
 void _tensor_kernel_add(const Tensor* a, const Tensor* b, Tensor* result);
-void _tensor_kernel_add_bwd(Tensor* a_grad, Tensor* b_grad, const Tensor* in_grad, arena_allocator* arena);
+// dst = src elementwise, either side may be a strided view of either dtype
+void _tensor_kernel_copy(const Tensor* src, Tensor* dst);
+// Backward kernels store into a gradient when its *_acc flag is false and add to it otherwise,
+// so the first contribution during a backward pass needs no zeroed buffer.
+void _tensor_kernel_add_bwd(Tensor* a_grad, bool a_acc, Tensor* b_grad, bool b_acc, const Tensor* in_grad, arena_allocator* arena);
 void _tensor_kernel_mul_at(const Tensor* a, const Tensor* b, Tensor* result);
 void _tensor_kernel_mul_bt(const Tensor* a, const Tensor* b, Tensor* result);
 void _tensor_kernel_mul_atbt(const Tensor* a, const Tensor* b, Tensor* result);
 void _tensor_kernel_mul(const Tensor* a, const Tensor* b, Tensor* result);
-void _tensor_kernel_mul_bwd(const Tensor* a, Tensor* a_grad, const Tensor* b, Tensor* b_grad, const Tensor* result_grad, arena_allocator* arena);
-void _tensor_kernel_reduce_add(const Tensor* src, Tensor* result, usize red_dim);
+void _tensor_kernel_mul_bwd(const Tensor* a, Tensor* a_grad, bool a_acc, const Tensor* b, Tensor* b_grad, bool b_acc,
+                            const Tensor* result_grad, arena_allocator* arena);
+void _tensor_kernel_linear(const Tensor* x, const Tensor* w, const Tensor* bias, bool relu, Tensor* result);
+void _tensor_kernel_linear_bwd(const Tensor* x, Tensor* x_grad, bool x_acc, const Tensor* w, Tensor* w_grad, bool w_acc,
+                               Tensor* bias_grad, bool bias_acc, const Tensor* out, const Tensor* out_grad, bool relu,
+                               arena_allocator* arena);
+// split reductions keep their chunk partials in a scope on temp
+void _tensor_kernel_reduce_add(const Tensor* src, Tensor* result, usize red_dim, arena_allocator* temp);
 void _tensor_kernel_relu(const Tensor* src, Tensor* dst);
-void _tensor_kernel_relu_bwd(const Tensor* src, Tensor* src_grad, const Tensor* in_grad);
-void _tensor_kernel_cross_entropy_bwd(const Tensor* src, const Tensor* truth, Tensor* src_grad);
+void _tensor_kernel_relu_bwd(const Tensor* src, Tensor* src_grad, bool accumulate, const Tensor* in_grad);
+void _tensor_kernel_cross_entropy_bwd(const Tensor* src, const Tensor* truth, const Tensor* stats,
+                                      const Tensor* in_grad, Tensor* src_grad, bool accumulate);
 void _tensor_kernel_sub_scaled(const Tensor* a, const Tensor* b, f32 alpha, Tensor* result);
 void _tensor_kernel_add_scaled(const Tensor* a, const Tensor* b, f32 alpha, Tensor* result);
+// v = mu * v + g, then p -= lr * v (nesterov: p -= lr * (g + mu * v)), in place. The optimizer
+// steps also round the new p into p16 (a bf16 tensor of p's shape, may be NULL) in the same pass.
+void _tensor_kernel_momentum_step(Tensor* p, const Tensor* g, Tensor* v, f32 lr, f32 mu, bool nesterov, Tensor* p16);
+// m, v = first and second moment estimates, updated in place together with p
+void _tensor_kernel_adam_step(Tensor* p, const Tensor* g, Tensor* m, Tensor* v, const AdamStep* hp, Tensor* p16);
 
 #endif
@@ -4,9 +4,33 @@
 #include "utils.h"
 
 void test_add(u32 rows, u32 cols);
+void test_add_broadcast(u32 rows, u32 cols);
+void test_views(u32 samples, u32 features, u32 batch);
 void test_mul(u32 m, u32 k, u32 n);
+void test_mul_parallel(u32 m, u32 k, u32 n, u32 n_threads);
+void bench_parallel_dispatch(u32 n_threads, u32 iters);
+void bench_mul(u32 m, u32 k, u32 n, u32 iters);
+void test_isa_variants();
 void test_reduce_add(u32 rows, u32 cols, u32 dim);
+void test_reduce_add_parallel(u32 n_threads);
+void test_linear(u32 m, u32 k, u32 n);
+void test_shared_grad(u32 m, u32 k, u32 n);
+void test_optimizers(u32 n);
+void test_param_slab();
+void test_grad_plan(u32 batch, u32 in_dim, u32 hidden, u32 classes, u32 steps);
+void test_mem_plan(u32 batch, u32 in_dim, u32 hidden, u32 classes, u32 n_layers, u32 steps);
+void test_row_padding(u32 batch, u32 in_dim, u32 hidden, u32 classes, u32 n_layers, u32 steps);
+void test_checkpoint(u32 batch, u32 width, u32 n_layers, u32 every, u32 steps);
+void test_scoped_arenas(u32 steps);
+void test_no_grad(u32 batch, u32 in_dim, u32 hidden, u32 classes);
+void test_grad_contexts(u32 n_threads, u32 steps);
+void test_bf16_kernels(u32 m, u32 k, u32 n);
+void test_bf16(u32 batch, u32 in_dim, u32 hidden, u32 classes, u32 steps);
+void bench_topo_sort(u32 n_nodes);
+void test_cross_entropy(u32 rows, u32 classes);
 void test_arena(usize reserve, usize commit, usize alloc_size, u32 n_allocs);
+void test_arena_options(usize bytes, u32 n_threads);
+void test_arena_stats(usize small, usize spike, usize slack);
 void test_grad_relu();
 void test_grad_bwd();
 
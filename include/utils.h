@@ -18,6 +18,22 @@ typedef int64_t i64;
 typedef size_t usize;
 typedef float f32;
 typedef double f64;
+// bfloat16: the upper half of an f32 (same exponent range, 8 bit mantissa)
+typedef u16 bf16;
+
+static inline f32 bf16_to_f32(bf16 v) {
+    union { u32 u; f32 f; } c = {.u = (u32)v << 16};
+    return c.f;
+}
+
+// round to nearest even, NaNs stay (quiet) NaNs
+static inline bf16 bf16_from_f32(f32 v) {
+    union { f32 f; u32 u; } c = {.f = v};
+    if ((c.u & 0x7FFFFFFF) > 0x7F800000) {
+        return (bf16)((c.u >> 16) | 0x40);
+    }
+    return (bf16)((c.u + 0x7FFF + ((c.u >> 16) & 1)) >> 16);
+}
 
 #define KiB(n) ((u64)(n) << 10)
 #define MiB(n) ((u64)(n) << 20)
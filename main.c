@@ -5,9 +5,35 @@ int main() {
     init_random();
 
     test_add(1024, 1024);
+    test_add_broadcast(1024, 1024);
+    test_views(4096, 256, 128);
     test_mul(512, 512, 512);
+    test_mul(67, 781, 45);
+    test_isa_variants();
+    test_mul_parallel(301, 257, 519, 4);
+    bench_parallel_dispatch(2, 2000);
+    bench_mul(2048, 2048, 2048, 3);
     test_reduce_add(128, 128, 2);
+    test_reduce_add(4096, 1024, 2);
+    test_reduce_add(1024, 4096, 3);
+    test_reduce_add_parallel(4);
+    test_linear(256, 1024, 1024);
+    test_shared_grad(128, 512, 256);
+    test_cross_entropy(64, 32768);
+    test_optimizers(1 << 20);
+    test_param_slab();
+    test_grad_plan(64, 256, 256, 10, 5);
+    test_mem_plan(256, 256, 512, 10, 6, 3);
+    test_row_padding(256, 250, 1000, 100, 6, 3);
+    test_checkpoint(256, 512, 24, 12, 3);
+    test_scoped_arenas(5);
+    test_no_grad(256, 1024, 1024, 10);
+    test_grad_contexts(4, 20);
+    test_bf16(32, 2048, 2048, 16, 50);
+    bench_topo_sort(200000);
     test_arena(GiB(4), MiB(1), KiB(500), 100);
+    test_arena_options(MiB(512), 4);
+    test_arena_stats(MiB(8), MiB(64), MiB(16));
     test_grad_relu();
     test_grad_bwd();
 }
@@ -4,11 +4,18 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 
 #define ALIGN_UP_POW2(n, p) (((u64)(n) + ((u64)(p) - 1)) & (~((u64)(p) - 1)))
-
-static void* reserve_mem(usize reserve_size) {
-    void* mem = mmap(NULL, reserve_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#define HUGE_2M (2ull << 20)
+#define HUGE_1G (1ull << 30)
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+static void* reserve_mem(usize reserve_size, int flags) {
+    void* mem = mmap(NULL, reserve_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
     if (mem == MAP_FAILED) {
         return NULL;
     }
@@ -19,6 +26,11 @@ static bool commit_mem(void* mem, usize commit_size) {
     return mprotect(mem, commit_size, PROT_READ | PROT_WRITE) == 0;
 }
 
+// drops the pages first, protecting alone would keep them resident
+static bool decommit_mem(void* mem, usize decommit_size) {
+    return madvise(mem, decommit_size, MADV_DONTNEED) == 0 && mprotect(mem, decommit_size, PROT_NONE) == 0;
+}
+
 static bool release_mem(void* mem, usize release_size) {
     return munmap(mem, release_size) == 0;
 }
@@ -27,17 +39,77 @@ static u32 get_page_size() {
     return (u32)sysconf(_SC_PAGESIZE);
 }
 
+// over-reserves by one alignment and unmaps the slack around the aligned part,
+// THP can only back 2 MiB aligned ranges
+static void* reserve_mem_aligned(usize reserve_size, usize alignment) {
+    u8* mem = reserve_mem(reserve_size + alignment, 0);
+    if (mem == NULL) {
+        return NULL;
+    }
+    u8* aligned = (u8*)ALIGN_UP_POW2(mem, alignment);
+    if (aligned > mem) {
+        release_mem(mem, aligned - mem);
+    }
+    release_mem(aligned + reserve_size, mem + alignment - aligned);
+    return aligned;
+}
+
+// mbind / get_mempolicy without linking libnuma
+static bool apply_numa(void* mem, usize size, ArenaNuma numa, u64 node_mask) {
+    if (numa == ARENA_NUMA_FIRST_TOUCH) {
+        return true;
+    }
+    if (node_mask == 0) {
+        int mode;
+        if (syscall(SYS_get_mempolicy, &mode, &node_mask, sizeof(node_mask) * 8, NULL, MPOL_F_MEMS_ALLOWED) != 0) {
+            return false;
+        }
+    }
+    int mode = numa == ARENA_NUMA_BIND ? MPOL_BIND : MPOL_INTERLEAVE;
+    return syscall(SYS_mbind, mem, size, mode, &node_mask, sizeof(node_mask) * 8, 0) == 0;
+}
+
 arena_allocator* arena_create(usize reserve_size, usize commit_size, usize alignment) {
-    u32 page_size = get_page_size();
+    return arena_create_opts(reserve_size, commit_size, alignment, NULL);
+}
 
-    usize reserve_aligned = ALIGN_UP_POW2(reserve_size, page_size);
-    usize commit_aligned = ALIGN_UP_POW2(commit_size, page_size);
-    void* mem = reserve_mem(reserve_aligned);
+arena_allocator* arena_create_opts(usize reserve_size, usize commit_size, usize alignment, const ArenaOptions* opts) {
+    ArenaOptions def = {0};
+    opts = opts != NULL ? opts : &def;
+    ArenaPages pages = opts->pages;
+    usize page_size = get_page_size();
+    void* mem = NULL;
+
+    if (pages == ARENA_PAGES_HUGE_2M || pages == ARENA_PAGES_HUGE_1G) {
+        page_size = pages == ARENA_PAGES_HUGE_2M ? HUGE_2M : HUGE_1G;
+        int size_flag = (pages == ARENA_PAGES_HUGE_2M ? 21 : 30) << MAP_HUGE_SHIFT;
+        // the whole reservation is taken from the hugetlb pool now, so a later touch can't SIGBUS,
+        // which is why it's capped
+        if (ALIGN_UP_POW2(reserve_size, page_size) <= ARENA_HUGETLB_MAX_RESERVE) {
+            mem = reserve_mem(ALIGN_UP_POW2(reserve_size, page_size), MAP_HUGETLB | size_flag);
+        }
+        if (mem == NULL) {
+            pages = ARENA_PAGES_THP;
+        }
+    }
+    if (pages == ARENA_PAGES_THP) {
+        page_size = HUGE_2M;
+        mem = reserve_mem_aligned(ALIGN_UP_POW2(reserve_size, page_size), page_size);
+        if (mem != NULL) {
+            madvise(mem, ALIGN_UP_POW2(reserve_size, page_size), MADV_HUGEPAGE);
+        }
+    }
+    if (pages == ARENA_PAGES_SMALL) {
+        mem = reserve_mem(ALIGN_UP_POW2(reserve_size, page_size), 0);
+    }
     if (mem == NULL) {
         return NULL;
     }
 
-    if (!commit_mem(mem, commit_aligned)) {
+    usize reserve_aligned = ALIGN_UP_POW2(reserve_size, page_size);
+    usize commit_aligned = ALIGN_UP_POW2(commit_size, page_size);
+    if (!apply_numa(mem, reserve_aligned, opts->numa, opts->node_mask) || !commit_mem(mem, commit_aligned)) {
+        release_mem(mem, reserve_aligned);
         return NULL;
     }
 
@@ -47,6 +119,13 @@ arena_allocator* arena_create(usize reserve_size, usize commit_size, usize align
     ret->alloc_pos = ALIGN_UP_POW2(sizeof(arena_allocator), alignment);
     ret->commit_pos = commit_aligned;
     ret->alignment = alignment;
+    ret->page_size = page_size;
+    ret->pages = pages;
+    ret->peak_pos = ret->alloc_pos;
+    ret->decommit_slack = 0;
+    ret->n_allocs = 0;
+    ret->n_commits = 0;
+    ret->n_decommits = 0;
     return ret;
 }
 
@@ -55,38 +134,94 @@ bool arena_destroy(arena_allocator* arena) {
 }
 
 void* arena_alloc(arena_allocator* arena, usize el_size, usize n_el) {
+    return arena_alloc_aligned(arena, el_size, n_el, arena->alignment);
+}
+
+void* arena_alloc_aligned(arena_allocator* arena, usize el_size, usize n_el, usize alignment) {
     usize size = ALIGN_UP_POW2(el_size * n_el, arena->alignment);
+    usize pos = ALIGN_UP_POW2(arena->alloc_pos, alignment);
 
-    if (arena->alloc_pos + size > arena->reserve_size) {
+    if (pos + size > arena->reserve_size) {
         return NULL;
     }
 
     void* base = arena;
 
-    if (arena->alloc_pos + size > arena->commit_pos) {
-        usize to_commit = arena->alloc_pos + size - arena->commit_pos;
+    if (pos + size > arena->commit_pos) {
+        usize to_commit = pos + size - arena->commit_pos;
         to_commit = ALIGN_UP_POW2(to_commit, arena->commit_size);
-        to_commit = to_commit > arena->reserve_size ? arena->reserve_size : to_commit;
+        usize left = arena->reserve_size - arena->commit_pos;
+        to_commit = to_commit > left ? left : to_commit;
         if (!commit_mem(base, arena->commit_pos + to_commit)) return NULL;
         arena->commit_pos += to_commit;
+        arena->n_commits++;
     }
 
-    void* mem = base + arena->alloc_pos;
-    arena->alloc_pos += size;
+    void* mem = base + pos;
+    arena->alloc_pos = pos + size;
+    arena->peak_pos = arena->alloc_pos > arena->peak_pos ? arena->alloc_pos : arena->peak_pos;
+    arena->n_allocs++;
     return mem;
 }
 
+static usize base_pos(const arena_allocator* arena) {
+    return ALIGN_UP_POW2(sizeof(arena_allocator), arena->alignment);
+}
+
+// every free goes through here, the decommit check is a compare unless it triggers
+static void set_pos(arena_allocator* arena, usize new_pos) {
+    arena->alloc_pos = new_pos;
+    if (arena->decommit_slack == 0 || arena->commit_pos - new_pos <= arena->decommit_slack) {
+        return;
+    }
+    // never below the initial commit, which also holds the header
+    usize keep = ALIGN_UP_POW2(new_pos, arena->commit_size);
+    if (keep < arena->commit_pos && decommit_mem((u8*)arena + keep, arena->commit_pos - keep)) {
+        arena->commit_pos = keep;
+        arena->n_decommits++;
+    }
+}
+
 void arena_free(arena_allocator* arena) {
-    arena->alloc_pos = ALIGN_UP_POW2(sizeof(arena_allocator), arena->alignment);    
+    set_pos(arena, base_pos(arena));
 }
 
 void arena_free_size(arena_allocator* arena, usize size) {
-    usize base_pos = ALIGN_UP_POW2(sizeof(arena_allocator), arena->alignment);
-    usize new_pos = size < arena->alloc_pos - base_pos ? arena->alloc_pos - size : base_pos;
-    arena->alloc_pos =new_pos;
+    usize base = base_pos(arena);
+    set_pos(arena, size < arena->alloc_pos - base ? arena->alloc_pos - size : base);
+}
+
+void arena_free_to(arena_allocator* arena, usize new_pos) {
+    usize base = base_pos(arena);
+    set_pos(arena, new_pos > base ? new_pos : base);
+}
+
+void arena_set_decommit(arena_allocator* arena, usize slack) {
+    arena->decommit_slack = slack;
+}
+
+ArenaStats arena_get_stats(const arena_allocator* arena) {
+    usize base = base_pos(arena);
+    return (ArenaStats){
+        .reserved = arena->reserve_size - base,
+        .committed = arena->commit_pos - base,
+        .used = arena->alloc_pos - base,
+        .peak = arena->peak_pos - base,
+        .n_allocs = arena->n_allocs,
+        .n_commits = arena->n_commits,
+        .n_decommits = arena->n_decommits,
+    };
+}
+
+void arena_reset_peak(arena_allocator* arena) {
+    arena->peak_pos = arena->alloc_pos;
+}
+
+arena_scope arena_scope_begin(arena_allocator* arena) {
+    arena_scope scope = {.arena = arena, .pos = arena->alloc_pos};
+    return scope;
 }
 
-void arena_free_to(arena_allocator* arena, usize new_pos) {    
-    usize base_pos = ALIGN_UP_POW2(sizeof(arena_allocator), arena->alignment);
-    arena->alloc_pos = new_pos > base_pos ? new_pos : base_pos;
+void arena_scope_end(arena_scope scope) {
+    arena_free_to(scope.arena, scope.pos);
 }
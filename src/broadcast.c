@@ -0,0 +1,104 @@
+#include "../include/broadcast.h"
+
+void broadcast_iter_init(BroadcastIter* it, const Tensor* a, const Tensor* b, const Tensor* result) {
+    const Tensor* operands[BROADCAST_OPERANDS] = {a, b, result};
+    it->n_dims = 0;
+    for (usize d = 0; d < 4; d++) {
+        if (result->shape[d] == 1) {
+            continue;
+        }
+
+        usize strides[BROADCAST_OPERANDS];
+        for (usize j = 0; j < BROADCAST_OPERANDS; j++) {
+            strides[j] = operands[j]->shape[d] == 1 ? 0 : operands[j]->stride[d];
+        }
+
+        bool mergeable = it->n_dims > 0;
+        for (usize j = 0; j < BROADCAST_OPERANDS && mergeable; j++) {
+            mergeable = it->stride[j][it->n_dims - 1] == strides[j] * result->shape[d];
+        }
+
+        if (mergeable) {
+            u32 k = it->n_dims - 1;
+            it->shape[k] *= result->shape[d];
+            for (usize j = 0; j < BROADCAST_OPERANDS; j++) {
+                it->stride[j][k] = strides[j];
+            }
+        } else {
+            u32 k = it->n_dims++;
+            it->shape[k] = result->shape[d];
+            for (usize j = 0; j < BROADCAST_OPERANDS; j++) {
+                it->stride[j][k] = strides[j];
+            }
+        }
+    }
+
+    if (it->n_dims == 0) {
+        it->n_dims = 1;
+        it->shape[0] = 1;
+        for (usize j = 0; j < BROADCAST_OPERANDS; j++) {
+            it->stride[j][0] = 0;
+        }
+    }
+}
+
+usize broadcast_iter_rows(const BroadcastIter* it) {
+    usize rows = 1;
+    for (u32 k = 0; k + 1 < it->n_dims; k++) {
+        rows *= it->shape[k];
+    }
+    return rows;
+}
+
+void broadcast_iter_visit(const BroadcastIter* it, usize row_begin, usize row_end, broadcast_visit_fn fn, void* ctx) {
+    u32 inner = it->n_dims - 1;
+    u32 index[4] = {0, 0, 0, 0};
+    usize offsets[BROADCAST_OPERANDS] = {0, 0, 0};
+    usize strides[BROADCAST_OPERANDS] = {it->stride[0][inner], it->stride[1][inner], it->stride[2][inner]};
+
+    // position of the first row, later rows advance with carries instead of divisions
+    usize rem = row_begin;
+    for (i32 k = (i32)inner - 1; k >= 0; k--) {
+        index[k] = rem % it->shape[k];
+        rem /= it->shape[k];
+        for (usize j = 0; j < BROADCAST_OPERANDS; j++) {
+            offsets[j] += index[k] * it->stride[j][k];
+        }
+    }
+
+    for (usize r = row_begin; r < row_end; r++) {
+        fn(ctx, offsets, strides, it->shape[inner]);
+
+        for (i32 k = (i32)inner - 1; k >= 0; k--) {
+            index[k]++;
+            for (usize j = 0; j < BROADCAST_OPERANDS; j++) {
+                offsets[j] += it->stride[j][k];
+            }
+            if (index[k] < it->shape[k]) {
+                break;
+            }
+            for (usize j = 0; j < BROADCAST_OPERANDS; j++) {
+                offsets[j] -= index[k] * it->stride[j][k];
+            }
+            index[k] = 0;
+        }
+    }
+}
+
+typedef struct {
+    const f32* a;
+    const f32* b;
+    f32* result;
+    broadcast_row_fn row;
+} RowVisit;
+
+static void row_visit(void* ctx, const usize* offsets, const usize* strides, usize n) {
+    const RowVisit* v = ctx;
+    v->row(&v->a[offsets[0]], strides[0], &v->b[offsets[1]], strides[1], &v->result[offsets[2]], strides[2], n);
+}
+
+void broadcast_iter_run(const BroadcastIter* it, const f32* a, const f32* b, f32* result,
+                        usize row_begin, usize row_end, broadcast_row_fn row) {
+    RowVisit v = {.a = a, .b = b, .result = result, .row = row};
+    broadcast_iter_visit(it, row_begin, row_end, row_visit, &v);
+}
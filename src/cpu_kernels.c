@@ -1,177 +1,507 @@
 #include "../include/tensor.h"
+#include "../include/cpu_kernels.h"
+#include "../include/parallel.h"
 
-#include <immintrin.h>
 #include <math.h>
 #include <stdbool.h>
-#include <x86intrin.h>
+#include <stdlib.h>
 #include <string.h>
 
-void _tensor_kernel_add(const Tensor* a, const Tensor* b, Tensor* result) {
-    u32 index[4] = {0, 0, 0, 0};
-    if (a->shape[3] == b->shape[3] && a->shape[3] >= 16) {
-        usize total_rows = result->shape[0] * result->shape[1] * result->shape[2];
-        usize row_idx = 0;
-        usize vecs = result->shape[3] / 16; 
-        while (row_idx < total_rows) {
-            for (usize k = 0; k < vecs; k++) {
-                u32 a_offset = 0, b_offset = 0, res_offset = 0;
-                for (int i = 0; i < 4; i++) {
-                    a_offset += index[i] * a->stride[i];
-                    b_offset += index[i] * b->stride[i];
-                    res_offset += index[i] * result->stride[i];
-                }
+// elementwise kernels hand out at least this many floats (128 KiB) per parallel task
+#define ELEMWISE_GRAIN 32768
+// elements summed into one partial by _tensor_kernel_reduce_add before partials are combined
+#define REDUCE_CHUNK 16384
+#define ALIGN_UP(n, p) ((((n) + (p) - 1) / (p)) * (p))
+// f32 staging (512 KiB) a bf16 gemm result is computed in before it is rounded
+#define BF16_TILE_FLOATS (1 << 17)
+// floats per operand an elementwise op widens bf16 into at a time (1 KiB)
+#define BF16_CHUNK 256
+
+static const CpuKernels* active_kernels = &cpu_kernels_scalar;
+
+static const CpuKernels* kernels_for(CpuIsa isa) {
+    switch (isa) {
+        case CPU_ISA_AVX512: return &cpu_kernels_avx512;
+        case CPU_ISA_AVX2: return &cpu_kernels_avx2;
+        default: return &cpu_kernels_scalar;
+    }
+}
 
-                __m512 a_vec = _mm512_loadu_ps(&a->data[a_offset]);
-                __m512 b_vec = _mm512_loadu_ps(&b->data[b_offset]);
-                __m512 res_vec = _mm512_add_ps(a_vec, b_vec);
-                _mm512_storeu_ps(&result->data[res_offset], res_vec);
+bool cpu_isa_supported(CpuIsa isa) {
+    __builtin_cpu_init();
+    switch (isa) {
+        case CPU_ISA_AVX512: return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("fma");
+        case CPU_ISA_AVX2: return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+        case CPU_ISA_SCALAR: return true;
+        default: return false;
+    }
+}
 
-                index[3] += 16;
+const char* cpu_isa_name(CpuIsa isa) {
+    switch (isa) {
+        case CPU_ISA_AVX512: return "avx512";
+        case CPU_ISA_AVX2: return "avx2";
+        case CPU_ISA_SCALAR: return "scalar";
+        default: return "unknown";
+    }
+}
+
+CpuIsa cpu_isa_detect() {
+    CpuIsa best = CPU_ISA_SCALAR;
+    for (CpuIsa isa = CPU_ISA_SCALAR; isa < CPU_ISA_COUNT; isa++) {
+        if (cpu_isa_supported(isa)) {
+            best = isa;
+        }
+    }
+
+    const char* forced = getenv("GRADINO_ISA");
+    if (forced != NULL) {
+        for (CpuIsa isa = CPU_ISA_SCALAR; isa < best; isa++) {
+            if (strcmp(forced, cpu_isa_name(isa)) == 0) {
+                return isa;
             }
+        }
+    }
+    return best;
+}
 
-            for (usize k = index[3]; k < result->shape[3]; k++) {
-                u32 a_offset = 0, b_offset = 0, res_offset = 0;
-                for (int i = 0; i < 4; i++) {
-                    a_offset += index[i] * a->stride[i];
-                    b_offset += index[i] * b->stride[i];
-                    res_offset += index[i] * result->stride[i];
-                }
+// resolved once before main, every kernel call then costs a single indirect call
+__attribute__((constructor)) static void cpu_kernels_init() {
+    active_kernels = kernels_for(cpu_isa_detect());
+}
+
+bool cpu_set_isa(CpuIsa isa) {
+    if (!cpu_isa_supported(isa)) {
+        return false;
+    }
+    active_kernels = kernels_for(isa);
+    return true;
+}
+
+CpuIsa cpu_get_isa() {
+    return active_kernels->isa;
+}
+
+const CpuKernels* cpu_kernels() {
+    return active_kernels;
+}
+
+// one run of a same-shape kernel over n elements, p holds each operand's start (f32 or bf16)
+typedef void (*elemwise_fn)(const void* args, void* const* p, usize n);
+
+typedef struct {
+    BroadcastIter it;
+    const Tensor* a;
+    const Tensor* b;
+    Tensor* result;
+    broadcast_row_fn row;
+} BinaryJob;
 
-                result->data[res_offset] = a->data[a_offset] + b->data[b_offset];
+static void binary_rows(void* ctx, usize begin, usize end) {
+    const BinaryJob* job = ctx;
+    broadcast_iter_run(&job->it, job->a->data, job->b->data, job->result->data, begin, end, job->row);
+}
+
+// a single coalesced dim (same shape or scalar broadcast) is split along its elements instead of rows
+static void binary_flat(void* ctx, usize begin, usize end) {
+    const BinaryJob* job = ctx;
+    job->row(&job->a->data[begin * job->it.stride[0][0]], job->it.stride[0][0],
+             &job->b->data[begin * job->it.stride[1][0]], job->it.stride[1][0],
+             &job->result->data[begin * job->it.stride[2][0]], job->it.stride[2][0], end - begin);
+}
+
+// bf16 operands are widened into an f32 chunk that stays in L1, run through the same f32 row kernel
+// and a bf16 result is rounded back from its chunk, so mixed dtypes compute exactly what the f32
+// op computes on the widened values
+static void binary_visit_bf16(void* ctx, const usize* offsets, const usize* strides, usize n) {
+    const BinaryJob* job = ctx;
+    const CpuKernels* kernels = cpu_kernels();
+    const Tensor* ops[BROADCAST_OPERANDS] = {job->a, job->b, job->result};
+    _Alignas(64) f32 chunk[BROADCAST_OPERANDS][BF16_CHUNK];
+
+    for (usize i0 = 0; i0 < n; i0 += BF16_CHUNK) {
+        usize len = n - i0 < BF16_CHUNK ? n - i0 : BF16_CHUNK;
+        f32* p[BROADCAST_OPERANDS];
+        usize ps[BROADCAST_OPERANDS];
+        for (usize j = 0; j < BROADCAST_OPERANDS; j++) {
+            usize at = offsets[j] + i0 * strides[j];
+            if (ops[j]->dtype == TENSOR_F32) {
+                p[j] = &ops[j]->data[at];
+                ps[j] = strides[j];
+                continue;
             }
-            
-            index[3] = 0;
-            for (int i = 2; i >= 0; i--) {
-                index[i]++;
-                if (index[i] < result->shape[i]) {
-                    break;
-                } else {
-                    index[i] = 0;
+            p[j] = chunk[j];
+            ps[j] = strides[j] == 0 ? 0 : 1;
+            if (j == 2) {
+                continue;
+            }
+            const bf16* src = &ops[j]->data16[at];
+            if (strides[j] == 1) {
+                kernels->cvt_to_f32(src, chunk[j], len);
+            } else {
+                for (usize i = 0; i < (strides[j] == 0 ? 1 : len); i++) {
+                    chunk[j][i] = bf16_to_f32(src[i * strides[j]]);
                 }
             }
-            row_idx++;
         }
-    } else {
-        usize total_elems = result->data_len;
-        usize el_idx = 0;
-        while (el_idx < total_elems) {
-            u32 a_offset = 0, b_offset = 0, res_offset = 0;
-            for (int i = 0; i < 4; i++) {
-                a_offset += index[i] * a->stride[i];
-                b_offset += index[i] * b->stride[i];
-                res_offset += index[i] * result->stride[i];
+        job->row(p[0], ps[0], p[1], ps[1], p[2], ps[2], len);
+        if (job->result->dtype == TENSOR_BF16) {
+            bf16* dst = &job->result->data16[offsets[2] + i0 * strides[2]];
+            if (strides[2] == 1) {
+                kernels->cvt_to_bf16(chunk[2], dst, len);
+            } else {
+                for (usize i = 0; i < len; i++) {
+                    dst[i * strides[2]] = bf16_from_f32(chunk[2][i]);
+                }
             }
+        }
+    }
+}
+
+static void binary_rows_bf16(void* ctx, usize begin, usize end) {
+    const BinaryJob* job = ctx;
+    broadcast_iter_visit(&job->it, begin, end, binary_visit_bf16, ctx);
+}
 
-            result->data[res_offset] = a->data[a_offset] + b->data[b_offset];
+static void binary_flat_bf16(void* ctx, usize begin, usize end) {
+    const BinaryJob* job = ctx;
+    usize offsets[BROADCAST_OPERANDS];
+    usize strides[BROADCAST_OPERANDS];
+    for (usize j = 0; j < BROADCAST_OPERANDS; j++) {
+        strides[j] = job->it.stride[j][0];
+        offsets[j] = begin * strides[j];
+    }
+    binary_visit_bf16(ctx, offsets, strides, end - begin);
+}
 
-            for (int i = 3; i >= 0; i--) {
-                index[i]++;
-                if (index[i] < result->shape[i]) {
-                    break;
-                } else {
-                    index[i] = 0;
-                }
-            }
-            el_idx++;
+static void binary_run(BinaryJob job) {
+    broadcast_iter_init(&job.it, job.a, job.b, job.result);
+    bool f32_only = job.a->dtype == TENSOR_F32 && job.b->dtype == TENSOR_F32 && job.result->dtype == TENSOR_F32;
+
+    if (job.it.n_dims == 1) {
+        parallel_for(0, job.it.shape[0], ELEMWISE_GRAIN, f32_only ? binary_flat : binary_flat_bf16, &job);
+    } else {
+        usize row_len = job.it.shape[job.it.n_dims - 1];
+        usize grain = row_len >= ELEMWISE_GRAIN ? 1 : ELEMWISE_GRAIN / row_len;
+        parallel_for(0, broadcast_iter_rows(&job.it), grain, f32_only ? binary_rows : binary_rows_bf16, &job);
+    }
+}
+
+void _tensor_kernel_binary(BinaryOp op, const Tensor* a, const Tensor* b, Tensor* result) {
+    binary_run((BinaryJob){.a = a, .b = b, .result = result, .row = cpu_kernels()->binary[op]});
+}
+
+// unary elementwise ops go through the same iteration with b = a, so they take any strided view and
+// still reach the flat kernels in one run when both sides are contiguous
+static void relu_row(const f32* a, usize a_stride, const f32* b, usize b_stride, f32* result, usize r_stride, usize n) {
+    if (a_stride == 1 && r_stride == 1) {
+        cpu_kernels()->relu(a, result, n);
+        return;
+    }
+    for (usize i = 0; i < n; i++) {
+        f32 v = a[i * a_stride];
+        result[i * r_stride] = v > 0.0f ? v : 0.0f;
+    }
+}
+
+static void copy_row(const f32* a, usize a_stride, const f32* b, usize b_stride, f32* result, usize r_stride, usize n) {
+    if (a_stride == 1 && r_stride == 1) {
+        if (a != result) {
+            memcpy(result, a, n * sizeof(f32));
         }
+        return;
+    }
+    for (usize i = 0; i < n; i++) {
+        result[i * r_stride] = a[i * a_stride];
+    }
+}
+
+static void elemwise_run(const Tensor** ops, usize n_ops, elemwise_fn fn, const void* args);
+
+static void to_f32_run(const void* args, void* const* p, usize n) {
+    cpu_kernels()->cvt_to_f32(p[0], p[1], n);
+}
+
+static void to_bf16_run(const void* args, void* const* p, usize n) {
+    cpu_kernels()->cvt_to_bf16(p[0], p[1], n);
+}
+
+static void copy_bf16_run(const void* args, void* const* p, usize n) {
+    if (p[0] != p[1]) {
+        memcpy(p[1], p[0], n * sizeof(bf16));
     }
 }
 
-void _tensor_kernel_add_bwd(Tensor* a_grad, Tensor* b_grad, const Tensor* in_grad, arena_allocator* arena) {
-    Tensor* a_red = in_grad;
-    Tensor* b_red = in_grad;
+// bf16 on either side with evenly spaced rows converts (or copies) whole rows, anything else goes
+// through the broadcast iteration
+void _tensor_kernel_copy(const Tensor* src, Tensor* dst) {
+    if ((src->dtype == TENSOR_F32 && dst->dtype == TENSOR_F32) || tensor_row_ld(src) == 0 || tensor_row_ld(dst) == 0) {
+        binary_run((BinaryJob){.a = src, .b = src, .result = dst, .row = copy_row});
+        return;
+    }
+    elemwise_fn fn = src->dtype == dst->dtype ? copy_bf16_run : dst->dtype == TENSOR_BF16 ? to_bf16_run : to_f32_run;
+    elemwise_run((const Tensor*[]){src, dst}, 2, fn, NULL);
+}
+
+void _tensor_kernel_add(const Tensor* a, const Tensor* b, Tensor* result) {
+    _tensor_kernel_binary(BINARY_ADD, a, b, result);
+}
+
+// the first contribution to a gradient is stored, later ones are added to it
+static void grad_store(Tensor* grad, const Tensor* contrib, bool accumulate) {
+    if (accumulate) {
+        _tensor_kernel_binary(BINARY_ADD, grad, contrib, grad);
+    } else if (grad->data != contrib->data) { // in place planned buffers
+        _tensor_kernel_copy(contrib, grad);
+    }
+}
+
+void _tensor_kernel_add_bwd(Tensor* a_grad, bool a_acc, Tensor* b_grad, bool b_acc, const Tensor* in_grad, arena_allocator* arena) {
+    const Tensor* a_red = in_grad;
+    const Tensor* b_red = in_grad;
 
     for (usize i = 0; i < 4; i++) {
         if (a_grad != NULL && a_grad->shape[i] < in_grad->shape[i]) {
             a_red = tensor_reduce_add(a_red, i, arena);
-        } else if (b_grad != NULL && b_grad->shape[i] < in_grad->shape[i]) {
+        }
+        if (b_grad != NULL && b_grad->shape[i] < in_grad->shape[i]) {
             b_red = tensor_reduce_add(b_red, i, arena);
         }
-     }
-    
+    }
+
     if (a_grad != NULL) {
-        memcpy(a_grad->data, a_red->data, a_grad->data_len * sizeof(f32));
+        grad_store(a_grad, a_red, a_acc);
     }
 
     if (b_grad != NULL) {
-        memcpy(b_grad->data, b_red->data, b_grad->data_len * sizeof(f32));
+        grad_store(b_grad, b_red, b_acc);
     }
 }
 
-static inline void mmul_6x16(const f32* a, const f32* b, f32* res, u32 a_cols, u32 b_cols, u32 n, u32 m) {
-    __m512 res_tile[6];
-    for (i32 i = 0; i < 6; i++) {
-        res_tile[i] = _mm512_setzero_ps();
-    }
+typedef struct {
+    const Tensor* a;
+    const Tensor* b;
+    Tensor* result;
+    bool at;
+    bool bt;
+    const GemmEpilogue* epi;
+    u32 m_blk;
+    u32 n_blk;
+    u32 m_blks;
+    u32 n_blks;
+} GemmJob;
+
+static StridedMat tensor_mat(const Tensor* t, usize offset, usize rs, usize cs) {
+    return mat_offset((StridedMat){.data = t->data, .rs = rs, .cs = cs, .data16 = t->data16}, offset);
+}
 
-    __m512 a_vec, b_vec;
-    if (m == 16) {
-        for (u32 k = 0; k < a_cols; k++) {
-            b_vec = _mm512_loadu_ps(&b[k * b_cols]);
-            
-            for (u32 i = 0; i < n; i++) {
-                a_vec = _mm512_set1_ps(a[i * a_cols + k]);
-                res_tile[i] = _mm512_fmadd_ps(a_vec, b_vec, res_tile[i]);
+// A bf16 result is computed a block of rows at a time into an f32 tile that stays in cache and is
+// rounded from there. Every element still sums its full K in the same order as an f32 result.
+// The tile comes from the scratch arena of whichever thread runs the task.
+static void gemm_bf16_out(StridedMat a, StridedMat b, bf16* c, usize ldc, u32 m, u32 k, u32 n, const GemmEpilogue* epi) {
+    const CpuKernels* kernels = cpu_kernels();
+    u32 rows = BF16_TILE_FLOATS / n / kernels->gemm_mr * kernels->gemm_mr;
+    rows = rows < kernels->gemm_mr ? kernels->gemm_mr : rows;
+    rows = rows > m ? m : rows;
+    arena_allocator* scratch = parallel_scratch_arena();
+    arena_scope scope = arena_scope_begin(scratch);
+    f32* tile = arena_alloc_aligned(scratch, sizeof(f32), (usize)rows * n, 64);
+    for (u32 i = 0; i < m; i += rows) {
+        u32 mi = m - i < rows ? m - i : rows;
+        if (epi != NULL && epi->accumulate) {
+            for (u32 r = 0; r < mi; r++) {
+                kernels->cvt_to_f32(&c[(i + r) * ldc], &tile[r * n], n);
             }
         }
-    
-        for (u32 i = 0; i < n; i++) {
-            _mm512_storeu_ps(&res[i * b_cols], res_tile[i]);
-        }
-    } else {
-        __mmask16 mask = 0xFFFF >> (16 - m);
-        for (u32 k = 0; k < a_cols; k++) {
-            b_vec = _mm512_maskz_loadu_ps(mask, &b[k * b_cols]);
-            
-            for (u32 i = 0; i < n; i++) {
-                a_vec = _mm512_set1_ps(a[i * a_cols + k]);
-                res_tile[i] = _mm512_fmadd_ps(a_vec, b_vec, res_tile[i]);
-            }
+        kernels->gemm(mat_offset(a, i * a.rs), b, tile, n, mi, k, n, epi);
+        for (u32 r = 0; r < mi; r++) {
+            kernels->cvt_to_bf16(&tile[r * n], &c[(i + r) * ldc], n);
         }
+    }
+    arena_scope_end(scope);
+}
 
-        for (u32 i = 0; i < n; i++) {
-            _mm512_mask_storeu_ps(&res[i * b_cols], mask, res_tile[i]);
-        }
+// one task computes an m_blk x n_blk block of one output matrix over the full K,
+// so every element sees the same accumulation order regardless of the split
+static void gemm_task(const GemmJob* job, u32 task) {
+    const Tensor* a = job->a;
+    const Tensor* b = job->b;
+    Tensor* result = job->result;
+
+    u32 blks = job->m_blks * job->n_blks;
+    u32 mat = task / blks;
+    u32 i0 = (task % blks) / job->n_blks * job->m_blk;
+    u32 j0 = (task % blks) % job->n_blks * job->n_blk;
+    u32 m = result->shape[2] - i0 < job->m_blk ? result->shape[2] - i0 : job->m_blk;
+    u32 n = result->shape[3] - j0 < job->n_blk ? result->shape[3] - j0 : job->n_blk;
+    u32 k = job->at ? a->shape[2] : a->shape[3];
+
+    u32 index[2] = {mat / result->shape[1], mat % result->shape[1]};
+    usize a_offset = 0, b_offset = 0, res_offset = 0;
+    for (int i = 0; i < 2; i++) {
+        a_offset += index[i] * a->stride[i];
+        b_offset += index[i] * b->stride[i];
+        res_offset += index[i] * result->stride[i];
+    }
+
+    usize a_rs = job->at ? a->stride[3] : a->stride[2];
+    usize a_cs = job->at ? a->stride[2] : a->stride[3];
+    usize b_rs = job->bt ? b->stride[3] : b->stride[2];
+    usize b_cs = job->bt ? b->stride[2] : b->stride[3];
+    usize ldc = result->stride[2];
+    usize c_offset = res_offset + i0 * ldc + j0;
+
+    StridedMat a_mat = tensor_mat(a, a_offset + i0 * a_rs, a_rs, a_cs);
+    StridedMat b_mat = tensor_mat(b, b_offset + j0 * b_cs, b_rs, b_cs);
+    GemmEpilogue epi;
+    if (job->epi != NULL) {
+        epi.bias = job->epi->bias != NULL ? &job->epi->bias[j0] : NULL;
+        epi.relu = job->epi->relu;
+        epi.accumulate = job->epi->accumulate;
+    }
+    if (result->dtype == TENSOR_BF16) {
+        gemm_bf16_out(a_mat, b_mat, &result->data16[c_offset], ldc, m, k, n, job->epi != NULL ? &epi : NULL);
+        return;
     }
+    cpu_kernels()->gemm(a_mat, b_mat, &result->data[c_offset], ldc, m, k, n, job->epi != NULL ? &epi : NULL);
 }
 
-// https://salykova.github.io/gemm-cpu
-static void matmul_tile6x16(const f32* a, const f32* b, f32* res, u32 a_rows, u32 a_cols, u32 b_cols) {
-    u32 n, m;
-    for (u32 i = 0; i < a_rows; i += 6) {
-        n = (a_rows - i) >= 6 ? 6 : (a_rows - i);
-        for (u32 j = 0; j < b_cols; j += 16) {
-            m = (b_cols - j) >= 16 ? 16 : (b_cols - j);
-            // printf("mmul_6x16 at (%u, %u) (%u, %u): a[%u], b[%u], res[%u]\n", i, j, m, n, i*a_cols, j, i*b_cols + j);
-            mmul_6x16(&a[i * a_cols], &b[j], &res[i * b_cols + j], a_cols, b_cols, n, m);
+static void gemm_tasks(void* ctx, usize begin, usize end) {
+    for (usize task = begin; task < end; task++) {
+        gemm_task(ctx, task);
+    }
+}
+
+// result = epi(op(a) * op(b)) for every (broadcast) matrix in dims 0 and 1, epi may be NULL.
+// Operands are read through their strides, so a transposed view (tensor_transpose) packs exactly
+// like the at / bt variants and is never materialized.
+// Serially each matrix is one task; with more threads the M and N ranges are halved
+// (keeping MR / NR multiples) until there are a few tasks per thread.
+static void gemm_batched(const Tensor* a, const Tensor* b, Tensor* result, bool at, bool bt, const GemmEpilogue* epi) {
+    const CpuKernels* kernels = cpu_kernels();
+    u32 m = result->shape[2];
+    u32 n = result->shape[3];
+    u32 mats = result->shape[0] * result->shape[1];
+    u32 n_threads = parallel_get_num_threads();
+    u32 target_tasks = n_threads > 1 ? 4 * n_threads : 1;
+    if (m == 0 || n == 0 || mats == 0) {
+        return;
+    }
+
+    GemmJob job = {.a = a, .b = b, .result = result, .at = at, .bt = bt, .epi = epi, .m_blk = m, .n_blk = n};
+    while (mats * ((m + job.m_blk - 1) / job.m_blk) * ((n + job.n_blk - 1) / job.n_blk) < target_tasks) {
+        if (job.m_blk > kernels->gemm_mr && (job.m_blk >= job.n_blk || job.n_blk <= kernels->gemm_nr)) {
+            job.m_blk = ALIGN_UP((job.m_blk + 1) / 2, kernels->gemm_mr);
+        } else if (job.n_blk > kernels->gemm_nr) {
+            job.n_blk = ALIGN_UP((job.n_blk + 1) / 2, kernels->gemm_nr);
+        } else {
+            break;
         }
     }
+    job.m_blks = (m + job.m_blk - 1) / job.m_blk;
+    job.n_blks = (n + job.n_blk - 1) / job.n_blk;
+
+    parallel_for(0, mats * job.m_blks * job.n_blks, 1, gemm_tasks, &job);
 }
 
 void _tensor_kernel_mul(const Tensor* a, const Tensor* b, Tensor* result) {
-    u32 index[4] = {0, 0, 0, 0};
-    usize mat_idx = 0, total_mats = result->shape[0] * result->shape[1];
-    while (mat_idx < total_mats) {
-        u32 a_offset = 0, b_offset = 0, res_offset = 0;
-        for (int i = 0; i < 2; i++) {
-            a_offset += index[i] * a->stride[i];
-            b_offset += index[i] * b->stride[i];
-            res_offset += index[i] * result->stride[i];
-        }
+    gemm_batched(a, b, result, false, false, NULL);
+}
 
-        matmul_tile6x16(&a->data[a_offset], &b->data[b_offset], &result->data[res_offset], a->shape[2], a->shape[3], b->shape[3]);
-    
-        for (int i = 1; i >= 0; i--) {
-            index[i]++;
-            if (index[i] < result->shape[i]) {
-                break;
-            } else {
-                index[i] = 0;
-            }
+void _tensor_kernel_linear(const Tensor* x, const Tensor* w, const Tensor* bias, bool relu, Tensor* result) {
+    GemmEpilogue epi = {.bias = bias != NULL ? bias->data : NULL, .relu = relu};
+    gemm_batched(x, w, result, false, false, &epi);
+}
+
+// relu(x * w + bias) only keeps out > 0 where the pre-activation was positive, so the output alone
+// masks the incoming gradient and the pre-activation never has to be stored
+void _tensor_kernel_linear_bwd(const Tensor* x, Tensor* x_grad, bool x_acc, const Tensor* w, Tensor* w_grad, bool w_acc,
+                               Tensor* bias_grad, bool bias_acc, const Tensor* out, const Tensor* out_grad, bool relu,
+                               arena_allocator* arena) {
+    const Tensor* pre_grad = out_grad;
+    if (relu) {
+        Tensor* masked = tensor_create(out_grad->shape, 4, arena);
+        _tensor_kernel_relu_bwd(out, masked, false, out_grad);
+        pre_grad = masked;
+    }
+    _tensor_kernel_mul_bwd(x, x_grad, x_acc, w, w_grad, w_acc, pre_grad, arena);
+    if (bias_grad != NULL) {
+        _tensor_kernel_add_bwd(NULL, false, bias_grad, bias_acc, pre_grad, arena);
+    }
+}
+
+#define ELEMWISE_OPERANDS 5
+
+typedef struct {
+    const Tensor* ops[ELEMWISE_OPERANDS];
+    usize n_ops;
+    usize ld[ELEMWISE_OPERANDS];
+    usize cols;
+    bool flat;
+    elemwise_fn fn;
+    const void* args;
+} ElemwiseJob;
+
+typedef struct {
+    f32 alpha;
+    bool accumulate;
+    f32 lr;
+    f32 mu;
+    bool nesterov;
+    const AdamStep* hp;
+    bool p16;
+} ElemwiseArgs;
+
+static void* elem_ptr(const Tensor* t, usize i) {
+    return t->dtype == TENSOR_BF16 ? (void*)&t->data16[i] : (void*)&t->data[i];
+}
+
+static void elemwise_range(void* ctx, usize begin, usize end) {
+    const ElemwiseJob* job = ctx;
+    void* p[ELEMWISE_OPERANDS];
+    if (job->flat) {
+        for (usize i = 0; i < job->n_ops; i++) {
+            p[i] = elem_ptr(job->ops[i], begin);
+        }
+        job->fn(job->args, p, end - begin);
+        return;
+    }
+    for (usize r = begin; r < end; r++) {
+        for (usize i = 0; i < job->n_ops; i++) {
+            p[i] = elem_ptr(job->ops[i], r * job->ld[i]);
         }
-        mat_idx++;
+        job->fn(job->args, p, job->cols);
+    }
+}
+
+// The flat kernels (optimizer updates, *_scaled, relu_bwd) on same-shape operands: a single run
+// split across threads when all of them are contiguous, otherwise row by row with every operand's
+// rows tensor_row_ld apart (padded rows, windows). The tensor_* / gradt_* builders pack or reject
+// other views (transposes) before they get here.
+static void elemwise_run(const Tensor** ops, usize n_ops, elemwise_fn fn, const void* args) {
+    ElemwiseJob job = {.n_ops = n_ops, .cols = ops[0]->shape[3], .flat = true, .fn = fn, .args = args};
+    for (usize i = 0; i < n_ops; i++) {
+        job.ops[i] = ops[i];
+        job.ld[i] = tensor_row_ld(ops[i]);
+        job.flat = job.flat && tensor_is_contiguous(ops[i]);
+    }
+    if (job.flat) {
+        parallel_for(0, ops[0]->data_len, ELEMWISE_GRAIN, elemwise_range, &job);
+    } else if (job.cols > 0) {
+        parallel_for(0, ops[0]->data_len / job.cols, job.cols >= ELEMWISE_GRAIN ? 1 : ELEMWISE_GRAIN / job.cols,
+                     elemwise_range, &job);
     }
 }
+
+// on the bits: a clear sign bit and a nonzero value is > 0, everything else becomes +0
+static void relu_bf16_run(const void* args, void* const* p, usize n) {
+    const i16* src = p[0];
+    i16* dst = p[1];
+    for (usize i = 0; i < n; i++) {
+        dst[i] = src[i] > 0 ? src[i] : 0;
+    }
+}
+
 void _tensor_kernel_relu(const Tensor* src, Tensor* dst) {
     for (usize i = 0; i < 4; i++) {
         if (src->shape[i] != dst->shape[i]) {
@@ -180,26 +510,40 @@ void _tensor_kernel_relu(const Tensor* src, Tensor* dst) {
         }
     }
 
+    if (src->dtype != dst->dtype) {
+        printf("Bad dtype in relu_tensor\n");
+        return;
+    }
+
     // for (usize i = 0; i < src->data_len; i++) {
     //     dst->data[i] = (src->data[i] > 0.0) ? src->data[i] : 0.0;
     // }
 
-    u32 vecs = src->data_len / 16;
-    usize i = 0;
-    __m512 zerov = _mm512_setzero_ps();
-    for (u32 iv = 0; iv < vecs; iv++) {
-        __m512 srcv = _mm512_loadu_ps(&src->data[i]);
-        srcv = _mm512_max_ps(srcv, zerov);
-        _mm512_storeu_ps(&dst->data[i], srcv);
-        i += 16;
+    if (src->dtype == TENSOR_BF16 && tensor_row_ld(src) != 0 && tensor_row_ld(dst) != 0) {
+        elemwise_run((const Tensor*[]){src, dst}, 2, relu_bf16_run, NULL);
+        return;
     }
+    binary_run((BinaryJob){.a = src, .b = src, .result = dst, .row = relu_row});
+}
+
+static void relu_bwd_run(const void* ctx, void* const* p, usize n) {
+    const ElemwiseArgs* args = ctx;
+    cpu_kernels()->relu_bwd(p[0], p[1], p[2], n, args->accumulate);
+}
 
-    for (; i < src->data_len; i++) {
-        dst->data[i] = (src->data[i] > 0.0) ? src->data[i] : 0.0;
+// the mask is the sign of the bf16 value
+static void relu_bwd_bf16_run(const void* ctx, void* const* p, usize n) {
+    const ElemwiseArgs* args = ctx;
+    const i16* src = p[0];
+    const f32* in_grad = p[1];
+    f32* src_grad = p[2];
+    for (usize i = 0; i < n; i++) {
+        f32 g = src[i] > 0 ? in_grad[i] : 0.0f;
+        src_grad[i] = args->accumulate ? src_grad[i] + g : g;
     }
 }
 
-void _tensor_kernel_relu_bwd(const Tensor* src, Tensor* src_grad, const Tensor* in_grad) {
+void _tensor_kernel_relu_bwd(const Tensor* src, Tensor* src_grad, bool accumulate, const Tensor* in_grad) {
     if (src_grad == NULL) {
         return;
     }
@@ -214,153 +558,30 @@ void _tensor_kernel_relu_bwd(const Tensor* src, Tensor* src_grad, const Tensor*
     // for (usize i = 0; i < src->data_len; i++) {
     //     src_grad->data[i] = (src->data[i] > 0.0) ? in_grad->data[i] : 0.0;
     // }
-    u32 vecs = src->data_len / 16;
-    usize i = 0;
-    __m512 zerov = _mm512_setzero_ps();
-    for (u32 iv = 0; iv < vecs; iv++) {
-        __m512 srcv = _mm512_loadu_ps(&src->data[i]);
-        __m512 ingv = _mm512_loadu_ps(&in_grad->data[i]);
-        __mmask16 mask = _mm512_cmp_ps_mask(srcv, zerov, _CMP_GT_OQ);
-        ingv = _mm512_maskz_mov_ps(mask, ingv);
-        _mm512_storeu_ps(&src_grad->data[i], ingv);
-        i += 16;
-    }
-    
-    for (; i < src->data_len; i++) {
-        src_grad->data[i] = (src->data[i] > 0.0) ? in_grad->data[i] : 0.0;
-    }
-}
-
-static void mmul_6x16_at(const f32* a, const f32* b, f32* res, u32 at_rows, u32 b_rows, u32 b_cols, int n, int m) {
-    __m512 res_tile[6];
-    for (u32 i = 0; i < 6; i++) {
-        res_tile[i] = _mm512_setzero_ps();
-    }
-
-    if (m == 16) {
-        for (u32 k = 0; k < b_rows; k++) {
-            __m512 b_vec = _mm512_loadu_ps(&b[k * b_cols]);
-
-            for (u32 i = 0; i < n; i++) {
-                __m512 a_vec = _mm512_set1_ps(a[at_rows * k + i]);
-                res_tile[i] = _mm512_fmadd_ps(a_vec, b_vec, res_tile[i]);
-            }
-        }
-
-        for (u32 i = 0; i < n; i++) {
-            _mm512_storeu_ps(&res[i * b_cols], res_tile[i]);
-        }
-    } else {
-        __mmask16 mask = 0xFFFF >> (16 - m);
-        for (u32 k = 0; k < b_rows; k++) {
-            __m512 b_vec = _mm512_maskz_loadu_ps(mask, &b[k * b_cols]);
-
-            for (u32 i = 0; i < n; i++) {
-                __m512 a_vec = _mm512_set1_ps(a[at_rows * k + i]);
-                res_tile[i] = _mm512_fmadd_ps(a_vec, b_vec, res_tile[i]);
-            }
-        }
-
-        for (u32 i = 0; i < n; i++) {
-            _mm512_storeu_ps(&res[i * b_cols], res_tile[i]);
-        }
-    }
-}
-
-static void matmul_at(const f32* a, const f32* b, f32* res, u32 at_rows, u32 at_cols, u32 b_cols) {
-    for (u32 i = 0; i < at_rows; i += 6) {
-        u32 n = (at_rows - i) >= 6 ? 6 : (at_rows - i);
-        for (u32 j = 0; j < b_cols; j += 16) {
-            u32 m = (b_cols - j) >= 16 ? 16 : (b_cols - j);
-            mmul_6x16_at(&a[i], &b[j], &res[i * b_cols + j], at_rows, at_cols, b_cols, n, m);
-        }
-    }
+    ElemwiseArgs args = {.accumulate = accumulate};
+    elemwise_run((const Tensor*[]){src, in_grad, src_grad}, 3, src->dtype == TENSOR_BF16 ? relu_bwd_bf16_run : relu_bwd_run, &args);
 }
 
 void _tensor_kernel_mul_at(const Tensor* a, const Tensor* b, Tensor* result) {
-    u32 index[4] = {0, 0, 0, 0};
-    usize mat_idx = 0, total_mats = result->shape[0] * result->shape[1];
-    while (mat_idx < total_mats) {
-        u32 a_offset = 0, b_offset = 0, res_offset = 0;
-        for (int i = 0; i < 2; i++) {
-            a_offset += index[i] * a->stride[i];
-            b_offset += index[i] * b->stride[i];
-            res_offset += index[i] * result->stride[i];
-        }
-
-        matmul_at(&a->data[a_offset], &b->data[b_offset], &result->data[res_offset], a->shape[3], a->shape[2], b->shape[3]);
-            
-        for (int i = 1; i >= 0; i--) {
-            index[i]++;
-            if (index[i] < result->shape[i]) {
-                break;
-            } else {
-                index[i] = 0;
-            }
-        }
-        mat_idx++;
-    }
-}
-
-static void matmul_bt(const f32* a, const f32* b, f32* res, u32 a_rows, u32 a_cols, u32 b_cols) {
-    u32 vecs = a_cols / 16;
-    for (u32 i = 0; i < a_rows; i++) {
-        for (u32 j = 0; j < b_cols; j++) {
-            u32 k = 0;
-            __m512 av, bv;
-            __m512 acc = _mm512_setzero_ps();
-            for (u32 kv = 0; kv < vecs; kv++) {
-                // printf("i: %d, j: %d, k: %d, a[%d], b[%d]\n", i, j, k, i*a_cols + k, j*a_cols + k);
-                av = _mm512_loadu_ps(&a[i * a_cols + k]);
-                bv = _mm512_loadu_ps(&b[j * a_cols + k]);
-                acc = _mm512_fmadd_ps(av, bv, acc);
-                k += 16;
-            }
-            // printf("finished vec sumadd\n");
-            f32 el = _mm512_reduce_add_ps(acc);
-            for (; k < a_cols; k++) {
-                // printf("i: %d, j: %d, k: %d, a[%d], b[%d]\n", i, j, k, i*a_cols + k, j*a_cols + k);
-                el += a[i * a_cols + k] * b[j * a_cols + k];
-            }
-            // printf("res[%d] = %f\n", i*b_cols + j, el);
-            res[i * b_cols + j] = el;
-        }
-    }
+    gemm_batched(a, b, result, true, false, NULL);
 }
 
 void _tensor_kernel_mul_bt(const Tensor* a, const Tensor* b, Tensor* result) {
-    u32 index[4] = {0, 0, 0, 0};
-    usize mat_idx = 0, total_mats = result->shape[0] * result->shape[1];
-    while (mat_idx < total_mats) {
-        u32 a_offset = 0, b_offset = 0, res_offset = 0;
-        for (int i = 0; i < 2; i++) {
-            a_offset += index[i] * a->stride[i];
-            b_offset += index[i] * b->stride[i];
-            res_offset += index[i] * result->stride[i];
-        }
-
-        matmul_bt(&a->data[a_offset], &b->data[b_offset], &result->data[res_offset], a->shape[2], a->shape[3], b->shape[2]);
-            
-        for (int i = 1; i >= 0; i--) {
-            index[i]++;
-            if (index[i] < result->shape[i]) {
-                break;
-            } else {
-                index[i] = 0;
-            }
-        }
-        mat_idx++;
-    }
+    gemm_batched(a, b, result, false, true, NULL);
 }
 
 void _tensor_kernel_mul_atbt(const Tensor* a, const Tensor* b, Tensor* result) {
-    UNIMPL();
+    gemm_batched(a, b, result, true, true, NULL);
 }
 
-void _tensor_kernel_mul_bwd(const Tensor* a, Tensor* a_grad, const Tensor* b, Tensor* b_grad, const Tensor* result_grad, arena_allocator* arena) {
+// where a gradient matches the batch dims of result_grad the gemm writes (or accumulates into) it
+// directly, broadcast operands go through a temporary that is reduced first
+void _tensor_kernel_mul_bwd(const Tensor* a, Tensor* a_grad, bool a_acc, const Tensor* b, Tensor* b_grad, bool b_acc,
+                            const Tensor* result_grad, arena_allocator* arena) {
     if (a_grad != NULL) {
         if (result_grad->shape[0] == a_grad->shape[0] && result_grad->shape[1] == a_grad->shape[1]) {
-            _tensor_kernel_mul_bt(result_grad, b, a_grad);
+            GemmEpilogue epi = {.accumulate = a_acc};
+            gemm_batched(result_grad, b, a_grad, false, true, &epi);
         } else {
             Tensor* a_grad_broad = tensor_mul_tr(result_grad, b, false, true, arena);
             for (usize i = 0; i < 2; i++) {
@@ -368,126 +589,204 @@ void _tensor_kernel_mul_bwd(const Tensor* a, Tensor* a_grad, const Tensor* b, Te
                     a_grad_broad = tensor_reduce_add(a_grad_broad, i, arena);
                 }
             }
-            memcpy(a_grad->data, a_grad_broad->data, a_grad->data_len * sizeof(f32));
+            grad_store(a_grad, a_grad_broad, a_acc);
         }
     }
 
     if (b_grad != NULL) {
         if (result_grad->shape[0] == b_grad->shape[0] && result_grad->shape[1] == b_grad->shape[1]) {
-            _tensor_kernel_mul_at(a, result_grad, b_grad);
+            GemmEpilogue epi = {.accumulate = b_acc};
+            gemm_batched(a, result_grad, b_grad, true, false, &epi);
         } else {
             Tensor* b_grad_broad = tensor_mul_tr(a, result_grad, true, false, arena);
             for (usize i = 0; i < 2; i++) {
                 if (result_grad->shape[i] != b_grad->shape[i]) {
-                    b_grad_broad = tensor_reduce_add(b_grad, i, arena);
+                    b_grad_broad = tensor_reduce_add(b_grad_broad, i, arena);
                 }
             }
-            memcpy(b_grad->data, b_grad_broad->data, b_grad->data_len * sizeof(f32));
+            grad_store(b_grad, b_grad_broad, b_acc);
         }
     }
 }
 
-void _tensor_kernel_reduce_add(const Tensor* src, Tensor* result, usize red_dim) {
-    usize dims_common[3];
-    usize dims_map[3];
-    usize dims_idx = 0;
-    for (usize i = 0; i < 4; i++) {
-        if (i != red_dim) {
-            dims_common[dims_idx] = src->shape[i];
-            dims_map[dims_idx] = i;
-            dims_idx++;
+typedef struct {
+    const f32* src;
+    const bf16* src16; // instead of src for bf16 sources
+    f32* dst;
+    usize red_len;
+    usize inner;
+    usize ld;    // between consecutive reduced rows of src
+    usize slice; // between outer slices of src
+    usize chunk_rows;
+    usize n_chunks;
+} ReduceJob;
+
+// task t sums rows [c * chunk_rows, (c + 1) * chunk_rows) of outer slice o into its own partial
+static void reduce_range(void* ctx, usize begin, usize end) {
+    const ReduceJob* job = ctx;
+    const CpuKernels* kernels = cpu_kernels();
+    for (usize t = begin; t < end; t++) {
+        usize o = t / job->n_chunks;
+        usize r0 = (t % job->n_chunks) * job->chunk_rows;
+        usize rows = job->red_len - r0 < job->chunk_rows ? job->red_len - r0 : job->chunk_rows;
+        usize offset = o * job->slice + r0 * job->ld;
+        if (job->src16 != NULL) {
+            kernels->reduce_rows_bf16(&job->src16[offset], rows, job->inner, job->ld, &job->dst[t * job->inner]);
+        } else {
+            kernels->reduce_rows(&job->src[offset], rows, job->inner, job->ld, &job->dst[t * job->inner]);
         }
     }
+}
 
-    for (usize i = 0; i < dims_common[0]; i++) {
-        for (usize j = 0; j < dims_common[1]; j++) {
-            for (usize k = 0; k < dims_common[2]; k++) {
-                usize src_offset = 0;
-                src_offset += i * src->stride[dims_map[0]];
-                src_offset += j * src->stride[dims_map[1]];
-                src_offset += k * src->stride[dims_map[2]];
-                usize res_offset = 0;
-                res_offset += i * result->stride[dims_map[0]];
-                res_offset += j * result->stride[dims_map[1]];
-                res_offset += k * result->stride[dims_map[2]];
-                result->data[res_offset] = 0.0;
-                for (usize r = 0; r < src->shape[red_dim]; r++) {
-                    result->data[res_offset] += src->data[src_offset];
-                    src_offset += src->stride[red_dim];
-                }
-            }
+// The source is viewed as [outer x red_len x inner]. Reducing the innermost dim (inner == 1) sums
+// contiguous runs, any other dim sums rows of inner values vertically. Long reductions are cut into
+// chunks whose size depends only on the shape, and the chunk partials are added up in chunk order,
+// so the result is bit-identical for any number of threads. Reducing one of the last two dims
+// also takes padded rows (tensor_row_ld), other dims need a contiguous src; result is contiguous.
+void _tensor_kernel_reduce_add(const Tensor* src, Tensor* result, usize red_dim, arena_allocator* temp) {
+    usize outer = 1;
+    usize inner = 1;
+    for (usize i = 0; i < red_dim; i++) {
+        outer *= src->shape[i];
+    }
+    for (usize i = red_dim + 1; i < 4; i++) {
+        inner *= src->shape[i];
+    }
+
+    ReduceJob job = {.src = src->data, .src16 = src->data16, .red_len = src->shape[red_dim], .inner = inner, .ld = inner};
+    if (red_dim >= 2) {
+        usize row_ld = tensor_row_ld(src);
+        job.ld = red_dim == 2 ? row_ld : 1;
+        job.slice = red_dim == 2 ? src->shape[2] * row_ld : row_ld;
+    } else {
+        job.slice = job.red_len * inner;
+    }
+    if (job.red_len == 0) {
+        memset(result->data, 0, result->data_len * sizeof(f32));
+        return;
+    }
+    job.chunk_rows = inner >= REDUCE_CHUNK ? 1 : REDUCE_CHUNK / inner;
+    job.n_chunks = (job.red_len + job.chunk_rows - 1) / job.chunk_rows;
+
+    usize tasks = outer * job.n_chunks;
+    usize task_len = (job.chunk_rows < job.red_len ? job.chunk_rows : job.red_len) * inner;
+    usize grain = task_len >= ELEMWISE_GRAIN ? 1 : ELEMWISE_GRAIN / task_len;
+    if (job.n_chunks == 1) {
+        job.dst = result->data;
+        parallel_for(0, tasks, grain, reduce_range, &job);
+        return;
+    }
+
+    arena_scope scope = arena_scope_begin(temp);
+    job.dst = arena_alloc(temp, sizeof(f32), tasks * inner);
+    parallel_for(0, tasks, grain, reduce_range, &job);
+
+    const CpuKernels* kernels = cpu_kernels();
+    for (usize o = 0; o < outer; o++) {
+        f32* res = &result->data[o * inner];
+        const f32* part = &job.dst[o * job.n_chunks * inner];
+        memcpy(res, part, inner * sizeof(f32));
+        for (usize c = 1; c < job.n_chunks; c++) {
+            kernels->binary[BINARY_ADD](res, 1, &part[c * inner], 1, res, 1, inner);
         }
     }
+    arena_scope_end(scope);
 }
 
-void _tensor_kernel_cross_entropy(const Tensor* src, const Tensor* truth, Tensor* result) {
+typedef struct {
+    const Tensor* src;
+    const Tensor* truth;
+    Tensor* stats;
+    f32 scale;
+    Tensor* src_grad;
+    bool accumulate;
+} XentJob;
+
+static void xent_range(void* ctx, usize begin, usize end) {
+    const XentJob* job = ctx;
+    const CpuKernels* kernels = cpu_kernels();
+    usize n = job->src->shape[3];
+    for (usize r = begin; r < end; r++) {
+        f32* stats = &job->stats->data[r * XENT_STATS];
+        stats[2] = kernels->xent_row(&job->src->data[r * job->src->stride[2]], &job->truth->data[r * job->truth->stride[2]], n, stats);
+    }
+}
+
+static void xent_bwd_range(void* ctx, usize begin, usize end) {
+    const XentJob* job = ctx;
+    const CpuKernels* kernels = cpu_kernels();
+    usize n = job->src->shape[3];
+    for (usize r = begin; r < end; r++) {
+        kernels->xent_row_bwd(&job->src->data[r * job->src->stride[2]], &job->truth->data[r * job->truth->stride[2]],
+                              &job->stats->data[r * XENT_STATS], job->scale, &job->src_grad->data[r * job->src_grad->stride[2]], n, job->accumulate);
+    }
+}
+
+// mean over rows of the softmax cross entropy, stats keeps what the backward pass needs per row
+void _tensor_kernel_cross_entropy(const Tensor* src, const Tensor* truth, Tensor* result, Tensor* stats) {
+    usize rows = src->shape[2];
+    usize n = src->shape[3];
+    XentJob job = {.src = src, .truth = truth, .stats = stats};
+    parallel_for(0, rows, n >= ELEMWISE_GRAIN ? 1 : ELEMWISE_GRAIN / n, xent_range, &job);
+
+    // row order, so the loss doesn't depend on the thread count
     f32 ce = 0.0;
-    for (usize j = 0; j < src->shape[2]; j++) {
-        f32 acc = 0.0;
-        usize base = src->stride[2] * j;
-        for (usize i = 0; i < src->data_len; i++) {
-            usize idx = base + i;
-            if (truth->data[idx] >= 0.99) { // fp stuff
-                ce = -src->data[idx];
-            }
-            acc += expf(src->data[idx]);
-        }
-        ce += logf(acc) / (f32)src->shape[2];
+    for (usize r = 0; r < rows; r++) {
+        ce += stats->data[r * XENT_STATS + 2];
     }
-    result->data[0] = ce;
+    result->data[0] = ce / (f32)rows;
 }
 
-void _tensor_kernel_cross_entropy_bwd(const Tensor* src, const Tensor* truth, Tensor* src_grad) {
+void _tensor_kernel_cross_entropy_bwd(const Tensor* src, const Tensor* truth, const Tensor* stats,
+                                      const Tensor* in_grad, Tensor* src_grad, bool accumulate) {
     if (src_grad == NULL) {
         return;
     }
-    for (usize j = 0; j < src->shape[2]; j++) {
-        f32 sftmx_den = 0.0;
-        usize base = src->stride[2] * j;
-        for (usize i = 0; i < src->shape[3]; i++) {
-            usize idx = base + i;
-            sftmx_den += expf(src->data[idx]);
-        }
+    usize rows = src->shape[2];
+    usize n = src->shape[3];
+    XentJob job = {.src = src, .truth = truth, .stats = (Tensor*)stats, .src_grad = src_grad,
+                  .accumulate = accumulate};
+    job.scale = (in_grad != NULL ? in_grad->data[0] : 1.0f) / (f32)rows;
+    parallel_for(0, rows, n >= ELEMWISE_GRAIN ? 1 : ELEMWISE_GRAIN / n, xent_bwd_range, &job);
+}
 
-        for (usize i = 0; i < src->shape[3]; i++) {
-            usize idx = base + i;
-            src_grad->data[idx] = (expf(src->data[idx])/sftmx_den - truth->data[idx]) / (f32)src->shape[2];
-        }
-    }
+static void sub_scaled_run(const void* ctx, void* const* p, usize n) {
+    const ElemwiseArgs* args = ctx;
+    cpu_kernels()->sub_scaled(p[0], p[1], args->alpha, p[2], n);
 }
 
 void _tensor_kernel_sub_scaled(const Tensor* a, const Tensor* b, f32 alpha, Tensor* result) {
-    __m512 alpha_v = _mm512_set1_ps(alpha);
-    usize i = 0;
-    usize nvecs = a->data_len / 16;
-    for (usize iv = 0; iv < nvecs; iv++) {
-        __m512 bv = _mm512_loadu_ps(&b->data[i]);
-        bv = _mm512_mul_ps(bv, alpha_v);
-        __m512 av = _mm512_loadu_ps(&a->data[i]);
-        __m512 res_v = _mm512_sub_ps(av, bv);
-        _mm512_storeu_ps(&result->data[i], res_v);
-        i += 16;
-    }
+    ElemwiseArgs args = {.alpha = alpha};
+    elemwise_run((const Tensor*[]){a, b, result}, 3, sub_scaled_run, &args);
+}
 
-    for (; i < a->data_len; i++) {
-        result->data[i] = a->data[i] - alpha * b->data[i];
-    }
+static void add_scaled_run(const void* ctx, void* const* p, usize n) {
+    const ElemwiseArgs* args = ctx;
+    cpu_kernels()->add_scaled(p[0], p[1], args->alpha, p[2], n);
 }
 
 void _tensor_kernel_add_scaled(const Tensor* a, const Tensor* b, f32 alpha, Tensor* result) {
-    __m512 alpha_v = _mm512_set1_ps(alpha);
-    usize i = 0;
-    usize nvecs = a->data_len / 16;
-    for (usize iv = 0; iv < nvecs; iv++) {
-        __m512 bv = _mm512_loadu_ps(&b->data[i]);
-        bv = _mm512_mul_ps(bv, alpha_v);
-        __m512 av = _mm512_loadu_ps(&a->data[i]);
-        __m512 res_v = _mm512_add_ps(av, bv);
-        _mm512_storeu_ps(&result->data[i], res_v);
-        i += 16;
-    }
+    ElemwiseArgs args = {.alpha = alpha};
+    elemwise_run((const Tensor*[]){a, b, result}, 3, add_scaled_run, &args);
+}
 
-    for (; i < a->data_len; i++) {
-        result->data[i] = a->data[i] - alpha * b->data[i];
-    }
+// the bf16 copy of p, when there is one, is the last operand
+static void momentum_step_run(const void* ctx, void* const* p, usize n) {
+    const ElemwiseArgs* args = ctx;
+    cpu_kernels()->momentum_step(p[0], p[1], p[2], args->lr, args->mu, args->nesterov, args->p16 ? p[3] : NULL, n);
+}
+
+void _tensor_kernel_momentum_step(Tensor* p, const Tensor* g, Tensor* v, f32 lr, f32 mu, bool nesterov, Tensor* p16) {
+    ElemwiseArgs args = {.lr = lr, .mu = mu, .nesterov = nesterov, .p16 = p16 != NULL};
+    elemwise_run((const Tensor*[]){p, g, v, p16}, p16 != NULL ? 4 : 3, momentum_step_run, &args);
+}
+
+static void adam_step_run(const void* ctx, void* const* p, usize n) {
+    const ElemwiseArgs* args = ctx;
+    cpu_kernels()->adam_step(p[0], p[1], p[2], p[3], args->hp, args->p16 ? p[4] : NULL, n);
+}
+
+void _tensor_kernel_adam_step(Tensor* p, const Tensor* g, Tensor* m, Tensor* v, const AdamStep* hp, Tensor* p16) {
+    ElemwiseArgs args = {.hp = hp, .p16 = p16 != NULL};
+    elemwise_run((const Tensor*[]){p, g, m, v, p16}, p16 != NULL ? 5 : 4, adam_step_run, &args);
 }
@@ -0,0 +1,4 @@
+// AVX2 + FMA variant of the kernels in cpu_kernels_impl.h, built with -mavx2 -mfma (see Makefile)
+#define CPU_KERNELS_TABLE cpu_kernels_avx2
+#define CPU_KERNELS_ISA CPU_ISA_AVX2
+#include "cpu_kernels_impl.h"
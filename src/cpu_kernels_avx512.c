@@ -0,0 +1,4 @@
+// AVX-512 variant of the kernels in cpu_kernels_impl.h, built with -mavx512f -mfma (see Makefile)
+#define CPU_KERNELS_TABLE cpu_kernels_avx512
+#define CPU_KERNELS_ISA CPU_ISA_AVX512
+#include "cpu_kernels_impl.h"
@@ -0,0 +1,723 @@
+// Kernel bodies shared by every ISA variant. Included once by each of cpu_kernels_avx512.c,
+// cpu_kernels_avx2.c and cpu_kernels_scalar.c, which define CPU_KERNELS_TABLE / CPU_KERNELS_ISA
+// and are compiled with the matching target flags, so simd.h resolves to that backend.
+
+#include "../include/cpu_kernels.h"
+#include "../include/parallel.h"
+#include "../include/simd.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#define GEMM_NV (GEMM_NR / VEC_WIDTH)
+
+// packs an mc x kc block of A into MR-row micro-panels, column-major inside each panel,
+// zero padding the last panel up to MR rows
+static void gemm_pack_a(StridedMat a, u32 mc, u32 kc, f32* dst) {
+    for (u32 ir = 0; ir < mc; ir += GEMM_MR) {
+        u32 mr = (mc - ir) >= GEMM_MR ? GEMM_MR : (mc - ir);
+        const f32* src = &a.data[ir * a.rs];
+        if (a.rs == 1 && mr == GEMM_MR) {
+            // A^T: the MR values of a column are already contiguous
+            for (u32 p = 0; p < kc; p++) {
+                memcpy(&dst[p * GEMM_MR], &src[p * a.cs], GEMM_MR * sizeof(f32));
+            }
+#if VEC_WIDTH > 1 && GEMM_MR <= VEC_WIDTH
+        } else if (a.cs == 1 && mr == GEMM_MR) {
+            // row-major A: transpose VEC_WIDTH-column strips (rows MR.. are padding)
+            bool aligned = vec_is_aligned(src) && a.rs % VEC_WIDTH == 0;
+            u32 p = 0;
+            for (; p + VEC_WIDTH <= kc; p += VEC_WIDTH) {
+                vec rows[VEC_WIDTH];
+                for (u32 i = 0; i < VEC_WIDTH; i++) {
+                    const f32* row = &src[i * a.rs + p];
+                    rows[i] = i >= GEMM_MR ? vec_zero() : aligned ? vec_load(row) : vec_loadu(row);
+                }
+                vec_transpose(rows);
+                for (u32 q = 0; q < VEC_WIDTH; q++) {
+                    vec_mask_storeu(&dst[(p + q) * GEMM_MR], vec_tail_mask(GEMM_MR), rows[q]);
+                }
+            }
+            for (; p < kc; p++) {
+                for (u32 i = 0; i < GEMM_MR; i++) {
+                    dst[p * GEMM_MR + i] = src[i * a.rs + p];
+                }
+            }
+#endif
+        } else {
+            for (u32 i = 0; i < mr; i++) {
+                for (u32 p = 0; p < kc; p++) {
+                    dst[p * GEMM_MR + i] = src[i * a.rs + p * a.cs];
+                }
+            }
+            for (u32 i = mr; i < GEMM_MR; i++) {
+                for (u32 p = 0; p < kc; p++) {
+                    dst[p * GEMM_MR + i] = 0.0;
+                }
+            }
+        }
+        dst += kc * GEMM_MR;
+    }
+}
+
+// packs a kc x nc block of B into NR-column micro-panels, row-major inside each panel,
+// zero padding the last panel up to NR columns
+static void gemm_pack_b(StridedMat b, u32 kc, u32 nc, f32* dst) {
+    for (u32 jr = 0; jr < nc; jr += GEMM_NR) {
+        u32 nr = (nc - jr) >= GEMM_NR ? GEMM_NR : (nc - jr);
+        const f32* src = &b.data[jr * b.cs];
+        if (b.cs == 1) {
+            vec_mask masks[GEMM_NV];
+            for (u32 v = 0; v < GEMM_NV; v++) {
+                u32 lanes = nr > v * VEC_WIDTH ? nr - v * VEC_WIDTH : 0;
+                masks[v] = vec_tail_mask(lanes < VEC_WIDTH ? lanes : VEC_WIDTH);
+            }
+            for (u32 p = 0; p < kc; p++) {
+                for (u32 v = 0; v < GEMM_NV; v++) {
+                    vec_store(&dst[p * GEMM_NR + v * VEC_WIDTH], vec_maskz_loadu(masks[v], &src[p * b.rs + v * VEC_WIDTH]));
+                }
+            }
+#if VEC_WIDTH > 1
+        } else if (b.rs == 1 && nr == GEMM_NR) {
+            // B^T: each panel column is a contiguous row of the original, transpose square blocks
+            u32 p = 0;
+            for (; p + VEC_WIDTH <= kc; p += VEC_WIDTH) {
+                for (u32 h = 0; h < GEMM_NR; h += VEC_WIDTH) {
+                    vec rows[VEC_WIDTH];
+                    for (u32 j = 0; j < VEC_WIDTH; j++) {
+                        rows[j] = vec_loadu(&src[(h + j) * b.cs + p]);
+                    }
+                    vec_transpose(rows);
+                    for (u32 q = 0; q < VEC_WIDTH; q++) {
+                        vec_store(&dst[(p + q) * GEMM_NR + h], rows[q]);
+                    }
+                }
+            }
+            for (; p < kc; p++) {
+                for (u32 j = 0; j < GEMM_NR; j++) {
+                    dst[p * GEMM_NR + j] = src[j * b.cs + p];
+                }
+            }
+#endif
+        } else {
+            for (u32 j = 0; j < nr; j++) {
+                for (u32 p = 0; p < kc; p++) {
+                    dst[p * GEMM_NR + j] = src[j * b.cs + p * b.rs];
+                }
+            }
+            for (u32 j = nr; j < GEMM_NR; j++) {
+                for (u32 p = 0; p < kc; p++) {
+                    dst[p * GEMM_NR + j] = 0.0;
+                }
+            }
+        }
+        dst += kc * GEMM_NR;
+    }
+}
+
+// first n lanes of p, zeros after (a masked bf16 load would need AVX-512BW)
+static inline vec vec_loadn_bf16(const bf16* p, u32 n) {
+    bf16 tmp[VEC_WIDTH] = {0};
+    memcpy(tmp, p, n * sizeof(bf16));
+    return vec_loadu_bf16(tmp);
+}
+
+static inline void vec_storen_bf16(bf16* p, vec v, u32 n) {
+    if (n == VEC_WIDTH) {
+        vec_storeu_bf16(p, v);
+        return;
+    }
+    bf16 tmp[VEC_WIDTH];
+    vec_storeu_bf16(tmp, v);
+    memcpy(p, tmp, n * sizeof(bf16));
+}
+
+// gemm_pack_a for bf16 A, widening while packing so the microkernel only ever sees f32
+static void gemm_pack_a_bf16(StridedMat a, u32 mc, u32 kc, f32* dst) {
+    for (u32 ir = 0; ir < mc; ir += GEMM_MR) {
+        u32 mr = (mc - ir) >= GEMM_MR ? GEMM_MR : (mc - ir);
+        const bf16* src = &a.data16[ir * a.rs];
+#if VEC_WIDTH > 1 && GEMM_MR <= VEC_WIDTH
+        if (a.cs == 1 && mr == GEMM_MR) {
+            u32 p = 0;
+            for (; p + VEC_WIDTH <= kc; p += VEC_WIDTH) {
+                vec rows[VEC_WIDTH];
+                for (u32 i = 0; i < VEC_WIDTH; i++) {
+                    rows[i] = i >= GEMM_MR ? vec_zero() : vec_loadu_bf16(&src[i * a.rs + p]);
+                }
+                vec_transpose(rows);
+                for (u32 q = 0; q < VEC_WIDTH; q++) {
+                    vec_mask_storeu(&dst[(p + q) * GEMM_MR], vec_tail_mask(GEMM_MR), rows[q]);
+                }
+            }
+            for (; p < kc; p++) {
+                for (u32 i = 0; i < GEMM_MR; i++) {
+                    dst[p * GEMM_MR + i] = bf16_to_f32(src[i * a.rs + p]);
+                }
+            }
+            dst += kc * GEMM_MR;
+            continue;
+        }
+#endif
+        // column by column, contiguous for A^T
+        for (u32 p = 0; p < kc; p++) {
+            for (u32 i = 0; i < GEMM_MR; i++) {
+                dst[p * GEMM_MR + i] = i < mr ? bf16_to_f32(src[i * a.rs + p * a.cs]) : 0.0f;
+            }
+        }
+        dst += kc * GEMM_MR;
+    }
+}
+
+// gemm_pack_b for bf16 B (e.g. the bf16 copy of a weight)
+static void gemm_pack_b_bf16(StridedMat b, u32 kc, u32 nc, f32* dst) {
+    for (u32 jr = 0; jr < nc; jr += GEMM_NR) {
+        u32 nr = (nc - jr) >= GEMM_NR ? GEMM_NR : (nc - jr);
+        const bf16* src = &b.data16[jr * b.cs];
+        if (b.cs == 1) {
+            for (u32 p = 0; p < kc; p++) {
+                for (u32 v = 0; v < GEMM_NV; v++) {
+                    u32 lanes = nr > v * VEC_WIDTH ? nr - v * VEC_WIDTH : 0;
+                    const bf16* row = &src[p * b.rs + v * VEC_WIDTH];
+                    vec_store(&dst[p * GEMM_NR + v * VEC_WIDTH], lanes >= VEC_WIDTH ? vec_loadu_bf16(row) : vec_loadn_bf16(row, lanes));
+                }
+            }
+#if VEC_WIDTH > 1
+        } else if (b.rs == 1 && nr == GEMM_NR) {
+            u32 p = 0;
+            for (; p + VEC_WIDTH <= kc; p += VEC_WIDTH) {
+                for (u32 h = 0; h < GEMM_NR; h += VEC_WIDTH) {
+                    vec rows[VEC_WIDTH];
+                    for (u32 j = 0; j < VEC_WIDTH; j++) {
+                        rows[j] = vec_loadu_bf16(&src[(h + j) * b.cs + p]);
+                    }
+                    vec_transpose(rows);
+                    for (u32 q = 0; q < VEC_WIDTH; q++) {
+                        vec_store(&dst[(p + q) * GEMM_NR + h], rows[q]);
+                    }
+                }
+            }
+            for (; p < kc; p++) {
+                for (u32 j = 0; j < GEMM_NR; j++) {
+                    dst[p * GEMM_NR + j] = bf16_to_f32(src[j * b.cs + p]);
+                }
+            }
+#endif
+        } else {
+            for (u32 j = 0; j < GEMM_NR; j++) {
+                for (u32 p = 0; p < kc; p++) {
+                    dst[p * GEMM_NR + j] = j < nr ? bf16_to_f32(src[j * b.cs + p * b.rs]) : 0.0f;
+                }
+            }
+        }
+        dst += kc * GEMM_NR;
+    }
+}
+
+// C[mr x nr] (+)= A_panel * B_panel, the full MR x NR tile is accumulated in registers.
+// epi (last K block only) adds the bias and applies ReLU before the tile leaves the registers.
+// c_aligned: every row of the tile starts on a vector boundary (aligned C, padded ldc).
+static inline void gemm_ukernel(u32 kc, const f32* a, const f32* b, f32* c, usize ldc, u32 mr, u32 nr, bool accumulate,
+                                bool c_aligned, const GemmEpilogue* epi) {
+    vec acc[GEMM_MR][GEMM_NV];
+    #pragma GCC unroll 16
+    for (u32 i = 0; i < GEMM_MR; i++) {
+        #pragma GCC unroll 4
+        for (u32 v = 0; v < GEMM_NV; v++) {
+            acc[i][v] = vec_zero();
+        }
+    }
+
+    for (u32 p = 0; p < kc; p++) {
+        vec b_vec[GEMM_NV];
+        #pragma GCC unroll 4
+        for (u32 v = 0; v < GEMM_NV; v++) {
+            b_vec[v] = vec_load(&b[v * VEC_WIDTH]);
+        }
+        #pragma GCC unroll 16
+        for (u32 i = 0; i < GEMM_MR; i++) {
+            vec a_vec = vec_set1(a[i]);
+            #pragma GCC unroll 4
+            for (u32 v = 0; v < GEMM_NV; v++) {
+                acc[i][v] = vec_fmadd(a_vec, b_vec[v], acc[i][v]);
+            }
+        }
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+
+    if (mr == GEMM_MR && nr == GEMM_NR) {
+        vec bias[GEMM_NV];
+        #pragma GCC unroll 4
+        for (u32 v = 0; v < GEMM_NV; v++) {
+            bias[v] = epi != NULL && epi->bias != NULL ? vec_loadu(&epi->bias[v * VEC_WIDTH]) : vec_zero();
+        }
+        #pragma GCC unroll 16
+        for (u32 i = 0; i < GEMM_MR; i++) {
+            #pragma GCC unroll 4
+            for (u32 v = 0; v < GEMM_NV; v++) {
+                f32* c_row = &c[i * ldc + v * VEC_WIDTH];
+                if (accumulate) {
+                    acc[i][v] = vec_add(acc[i][v], c_aligned ? vec_load(c_row) : vec_loadu(c_row));
+                }
+                if (epi != NULL) {
+                    acc[i][v] = vec_add(acc[i][v], bias[v]);
+                    if (epi->relu) {
+                        acc[i][v] = vec_max(acc[i][v], vec_zero());
+                    }
+                }
+                if (c_aligned) {
+                    vec_store(c_row, acc[i][v]);
+                } else {
+                    vec_storeu(c_row, acc[i][v]);
+                }
+            }
+        }
+    } else {
+        vec_mask masks[GEMM_NV];
+        vec bias[GEMM_NV];
+        for (u32 v = 0; v < GEMM_NV; v++) {
+            u32 lanes = nr > v * VEC_WIDTH ? nr - v * VEC_WIDTH : 0;
+            masks[v] = vec_tail_mask(lanes < VEC_WIDTH ? lanes : VEC_WIDTH);
+            bias[v] = epi != NULL && epi->bias != NULL ? vec_maskz_loadu(masks[v], &epi->bias[v * VEC_WIDTH]) : vec_zero();
+        }
+        for (u32 i = 0; i < mr; i++) {
+            for (u32 v = 0; v < GEMM_NV; v++) {
+                f32* c_row = &c[i * ldc + v * VEC_WIDTH];
+                if (accumulate) {
+                    acc[i][v] = vec_add(acc[i][v], vec_maskz_loadu(masks[v], c_row));
+                }
+                if (epi != NULL) {
+                    acc[i][v] = vec_add(acc[i][v], bias[v]);
+                    if (epi->relu) {
+                        acc[i][v] = vec_max(acc[i][v], vec_zero());
+                    }
+                }
+                vec_mask_storeu(c_row, masks[v], acc[i][v]);
+            }
+        }
+    }
+}
+
+// Blocked GEMM following the BLIS loop nest (https://salykova.github.io/gemm-cpu).
+// B is packed into KC x NC blocks that stay resident in L3, A into MC x KC blocks
+// that stay in L2, and the MR x NR microkernel streams one KC x NR micro-panel of
+// B from L1 while holding the whole C tile in registers.
+static inline f32 mat_at(StridedMat m, usize i, usize j) {
+    usize at = i * m.rs + j * m.cs;
+    return m.data16 != NULL ? bf16_to_f32(m.data16[at]) : m.data[at];
+}
+
+// plain dot products, for k == 0 and when there is no memory for the packed panels
+static void gemm_unpacked(StridedMat a, StridedMat b, f32* c, usize ldc, u32 m, u32 k, u32 n, const GemmEpilogue* epi) {
+    bool accumulate = epi != NULL && epi->accumulate;
+    for (u32 i = 0; i < m; i++) {
+        for (u32 j = 0; j < n; j++) {
+            f32 v = 0.0f;
+            for (u32 p = 0; p < k; p++) {
+                v += mat_at(a, i, p) * mat_at(b, p, j);
+            }
+            v += (accumulate ? c[i * ldc + j] : 0.0f) + (epi != NULL && epi->bias != NULL ? epi->bias[j] : 0.0f);
+            c[i * ldc + j] = epi != NULL && epi->relu && v < 0.0f ? 0.0f : v;
+        }
+    }
+}
+
+static void gemm(StridedMat a, StridedMat b, f32* c, usize ldc, u32 m, u32 k, u32 n, const GemmEpilogue* epi) {
+    bool accumulate = epi != NULL && epi->accumulate;
+    // the panels come from the calling thread's scratch arena, so concurrent gemm tasks never share them
+    arena_allocator* scratch = k > 0 ? parallel_scratch_arena() : NULL;
+    if (scratch == NULL) {
+        gemm_unpacked(a, b, c, ldc, m, k, n, epi);
+        return;
+    }
+    arena_scope scope = arena_scope_begin(scratch);
+    f32* a_pack = arena_alloc_aligned(scratch, sizeof(f32), GEMM_MC * GEMM_KC, 64);
+    f32* b_pack = arena_alloc_aligned(scratch, sizeof(f32), GEMM_KC * GEMM_NC, 64);
+    if (a_pack == NULL || b_pack == NULL) {
+        arena_scope_end(scope);
+        gemm_unpacked(a, b, c, ldc, m, k, n, epi);
+        return;
+    }
+
+    // tile columns start at multiples of NR, so the alignment of c and ldc carries over to every tile
+    bool c_aligned = vec_is_aligned(c) && ldc % VEC_WIDTH == 0;
+    for (u32 jc = 0; jc < n; jc += GEMM_NC) {
+        u32 nc = (n - jc) >= GEMM_NC ? GEMM_NC : (n - jc);
+        for (u32 pc = 0; pc < k; pc += GEMM_KC) {
+            u32 kc = (k - pc) >= GEMM_KC ? GEMM_KC : (k - pc);
+            StridedMat b_blk = mat_offset(b, pc * b.rs + jc * b.cs);
+            if (b.data16 != NULL) {
+                gemm_pack_b_bf16(b_blk, kc, nc, b_pack);
+            } else {
+                gemm_pack_b(b_blk, kc, nc, b_pack);
+            }
+            bool last = pc + kc == k;
+
+            for (u32 ic = 0; ic < m; ic += GEMM_MC) {
+                u32 mc = (m - ic) >= GEMM_MC ? GEMM_MC : (m - ic);
+                StridedMat a_blk = mat_offset(a, ic * a.rs + pc * a.cs);
+                if (a.data16 != NULL) {
+                    gemm_pack_a_bf16(a_blk, mc, kc, a_pack);
+                } else {
+                    gemm_pack_a(a_blk, mc, kc, a_pack);
+                }
+
+                for (u32 jr = 0; jr < nc; jr += GEMM_NR) {
+                    u32 nr = (nc - jr) >= GEMM_NR ? GEMM_NR : (nc - jr);
+                    GemmEpilogue tile_epi;
+                    if (last && epi != NULL) {
+                        tile_epi.bias = epi->bias != NULL ? &epi->bias[jc + jr] : NULL;
+                        tile_epi.relu = epi->relu;
+                        tile_epi.accumulate = epi->accumulate;
+                    }
+                    for (u32 ir = 0; ir < mc; ir += GEMM_MR) {
+                        u32 mr = (mc - ir) >= GEMM_MR ? GEMM_MR : (mc - ir);
+                        gemm_ukernel(kc, &a_pack[ir * kc], &b_pack[jr * kc],
+                                     &c[(ic + ir) * ldc + jc + jr], ldc, mr, nr, pc > 0 || accumulate, c_aligned,
+                                     last && epi != NULL ? &tile_epi : NULL);
+                    }
+                }
+            }
+        }
+    }
+    arena_scope_end(scope);
+}
+
+static inline __attribute__((always_inline)) vec binary_vec(BinaryOp op, vec a, vec b) {
+    switch (op) {
+        case BINARY_SUB: return vec_sub(a, b);
+        case BINARY_MUL: return vec_mul(a, b);
+        default: return vec_add(a, b);
+    }
+}
+
+static inline __attribute__((always_inline)) f32 binary_scalar(BinaryOp op, f32 a, f32 b) {
+    switch (op) {
+        case BINARY_SUB: return a - b;
+        case BINARY_MUL: return a * b;
+        default: return a + b;
+    }
+}
+
+// fast paths for contiguous runs where each input is either contiguous too or a broadcast scalar,
+// anything else (strided outputs or inputs) falls back to the scalar loop
+static inline __attribute__((always_inline)) void binary_row(BinaryOp op, const f32* a, usize a_stride, const f32* b, usize b_stride,
+                                                             f32* result, usize r_stride, usize n) {
+    usize i = 0;
+    if (r_stride == 1 && a_stride == 1 && b_stride == 1) {
+        for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+            vec_storeu(&result[i], binary_vec(op, vec_loadu(&a[i]), vec_loadu(&b[i])));
+        }
+    } else if (r_stride == 1 && a_stride == 1 && b_stride == 0) {
+        vec bv = vec_set1(b[0]);
+        for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+            vec_storeu(&result[i], binary_vec(op, vec_loadu(&a[i]), bv));
+        }
+    } else if (r_stride == 1 && a_stride == 0 && b_stride == 1) {
+        vec av = vec_set1(a[0]);
+        for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+            vec_storeu(&result[i], binary_vec(op, av, vec_loadu(&b[i])));
+        }
+    }
+
+    for (; i < n; i++) {
+        result[i * r_stride] = binary_scalar(op, a[i * a_stride], b[i * b_stride]);
+    }
+}
+
+static void add_row(const f32* a, usize a_stride, const f32* b, usize b_stride, f32* result, usize r_stride, usize n) {
+    binary_row(BINARY_ADD, a, a_stride, b, b_stride, result, r_stride, n);
+}
+
+static void sub_row(const f32* a, usize a_stride, const f32* b, usize b_stride, f32* result, usize r_stride, usize n) {
+    binary_row(BINARY_SUB, a, a_stride, b, b_stride, result, r_stride, n);
+}
+
+static void mul_row(const f32* a, usize a_stride, const f32* b, usize b_stride, f32* result, usize r_stride, usize n) {
+    binary_row(BINARY_MUL, a, a_stride, b, b_stride, result, r_stride, n);
+}
+
+// sum of n contiguous values, four independent accumulators combined as a tree
+// src is f32 or, with half set, bf16 widened on load; both sum in the same order
+static inline __attribute__((always_inline)) vec reduce_load(const void* src, bool half, usize i) {
+    return half ? vec_loadu_bf16(&((const bf16*)src)[i]) : vec_loadu(&((const f32*)src)[i]);
+}
+
+static inline __attribute__((always_inline)) vec reduce_loadn(const void* src, bool half, usize i, u32 lanes) {
+    return half ? vec_loadn_bf16(&((const bf16*)src)[i], lanes) : vec_maskz_loadu(vec_tail_mask(lanes), &((const f32*)src)[i]);
+}
+
+static inline __attribute__((always_inline)) f32 reduce_at(const void* src, bool half, usize i) {
+    return half ? bf16_to_f32(((const bf16*)src)[i]) : ((const f32*)src)[i];
+}
+
+static inline __attribute__((always_inline)) f32 reduce_flat(const void* src, bool half, usize n) {
+    vec acc[4] = {vec_zero(), vec_zero(), vec_zero(), vec_zero()};
+    usize i = 0;
+    for (; i + 4 * VEC_WIDTH <= n; i += 4 * VEC_WIDTH) {
+        #pragma GCC unroll 4
+        for (u32 v = 0; v < 4; v++) {
+            acc[v] = vec_add(acc[v], reduce_load(src, half, i + v * VEC_WIDTH));
+        }
+    }
+    for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+        acc[0] = vec_add(acc[0], reduce_load(src, half, i));
+    }
+    f32 sum = vec_reduce_add(vec_add(vec_add(acc[0], acc[1]), vec_add(acc[2], acc[3])));
+    for (; i < n; i++) {
+        sum += reduce_at(src, half, i);
+    }
+    return sum;
+}
+
+static inline __attribute__((always_inline)) void reduce_rows_impl(const void* src, bool half, usize rows, usize cols, usize ld, f32* dst) {
+    if (cols == 1 && ld == 1) {
+        dst[0] = reduce_flat(src, half, rows);
+        return;
+    }
+
+    // vertical: a block of columns stays in registers while walking down the rows
+    usize j = 0;
+    for (; j + 4 * VEC_WIDTH <= cols; j += 4 * VEC_WIDTH) {
+        vec acc[4] = {vec_zero(), vec_zero(), vec_zero(), vec_zero()};
+        for (usize r = 0; r < rows; r++) {
+            #pragma GCC unroll 4
+            for (u32 v = 0; v < 4; v++) {
+                acc[v] = vec_add(acc[v], reduce_load(src, half, r * ld + j + v * VEC_WIDTH));
+            }
+        }
+        #pragma GCC unroll 4
+        for (u32 v = 0; v < 4; v++) {
+            vec_storeu(&dst[j + v * VEC_WIDTH], acc[v]);
+        }
+    }
+    for (; j < cols; j += VEC_WIDTH) {
+        u32 lanes = cols - j < VEC_WIDTH ? cols - j : VEC_WIDTH;
+        vec acc = vec_zero();
+        for (usize r = 0; r < rows; r++) {
+            acc = vec_add(acc, reduce_loadn(src, half, r * ld + j, lanes));
+        }
+        vec_mask_storeu(&dst[j], vec_tail_mask(lanes), acc);
+    }
+}
+
+static void reduce_rows(const f32* src, usize rows, usize cols, usize ld, f32* dst) {
+    reduce_rows_impl(src, false, rows, cols, ld, dst);
+}
+
+static void reduce_rows_bf16(const bf16* src, usize rows, usize cols, usize ld, f32* dst) {
+    reduce_rows_impl(src, true, rows, cols, ld, dst);
+}
+
+static void cvt_to_f32(const bf16* src, f32* dst, usize n) {
+    usize i = 0;
+    for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+        vec_storeu(&dst[i], vec_loadu_bf16(&src[i]));
+    }
+    for (; i < n; i++) {
+        dst[i] = bf16_to_f32(src[i]);
+    }
+}
+
+static void cvt_to_bf16(const f32* src, bf16* dst, usize n) {
+    usize i = 0;
+    for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+        vec_storeu_bf16(&dst[i], vec_loadu(&src[i]));
+    }
+    for (; i < n; i++) {
+        dst[i] = bf16_from_f32(src[i]);
+    }
+}
+
+// softmax cross entropy of one row of logits against a truth distribution (one-hot or soft labels),
+// also writes the softmax statistics {max, 1 / sum(e^(x - max))} reused by the backward pass
+static f32 xent_row(const f32* x, const f32* truth, usize n, f32* stats) {
+    vec max_v = vec_set1(-INFINITY);
+    vec dot_v = vec_zero();
+    usize i = 0;
+    for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+        vec xv = vec_loadu(&x[i]);
+        max_v = vec_max(max_v, xv);
+        dot_v = vec_fmadd(xv, vec_loadu(&truth[i]), dot_v);
+    }
+    f32 max = vec_reduce_max(max_v);
+    f32 dot = vec_reduce_add(dot_v);
+    for (usize j = i; j < n; j++) {
+        max = x[j] > max ? x[j] : max;
+        dot += x[j] * truth[j];
+    }
+
+    vec sum_v = vec_zero();
+    vec max_b = vec_set1(max);
+    for (i = 0; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+        sum_v = vec_add(sum_v, vec_exp(vec_sub(vec_loadu(&x[i]), max_b)));
+    }
+    f32 sum = vec_reduce_add(sum_v);
+    for (; i < n; i++) {
+        sum += simd_expf(x[i] - max);
+    }
+
+    stats[0] = max;
+    stats[1] = 1.0f / sum;
+    return max + logf(sum) - dot;
+}
+
+// grad (+)= scale * (softmax(x) - truth), a single pass using the statistics of xent_row
+static void xent_row_bwd(const f32* x, const f32* truth, const f32* stats, f32 scale, f32* grad, usize n, bool accumulate) {
+    vec max_b = vec_set1(stats[0]);
+    vec inv_sum = vec_set1(stats[1]);
+    vec scale_v = vec_set1(scale);
+    usize i = 0;
+    for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+        vec p = vec_mul(vec_exp(vec_sub(vec_loadu(&x[i]), max_b)), inv_sum);
+        vec g = vec_mul(vec_sub(p, vec_loadu(&truth[i])), scale_v);
+        vec_storeu(&grad[i], accumulate ? vec_add(vec_loadu(&grad[i]), g) : g);
+    }
+
+    for (; i < n; i++) {
+        f32 g = (simd_expf(x[i] - stats[0]) * stats[1] - truth[i]) * scale;
+        grad[i] = accumulate ? grad[i] + g : g;
+    }
+}
+
+static void relu(const f32* src, f32* dst, usize n) {
+    usize i = 0;
+    vec zerov = vec_zero();
+    for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+        vec_storeu(&dst[i], vec_max(vec_loadu(&src[i]), zerov));
+    }
+
+    for (; i < n; i++) {
+        dst[i] = (src[i] > 0.0) ? src[i] : 0.0;
+    }
+}
+
+static void relu_bwd(const f32* src, const f32* in_grad, f32* src_grad, usize n, bool accumulate) {
+    usize i = 0;
+    if (accumulate) {
+        for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+            vec g = vec_select_pos(vec_loadu(&src[i]), vec_loadu(&in_grad[i]));
+            vec_storeu(&src_grad[i], vec_add(vec_loadu(&src_grad[i]), g));
+        }
+        for (; i < n; i++) {
+            src_grad[i] += (src[i] > 0.0) ? in_grad[i] : 0.0;
+        }
+        return;
+    }
+
+    for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+        vec_storeu(&src_grad[i], vec_select_pos(vec_loadu(&src[i]), vec_loadu(&in_grad[i])));
+    }
+
+    for (; i < n; i++) {
+        src_grad[i] = (src[i] > 0.0) ? in_grad[i] : 0.0;
+    }
+}
+
+static void sub_scaled(const f32* a, const f32* b, f32 alpha, f32* result, usize n) {
+    vec alpha_v = vec_set1(alpha);
+    usize i = 0;
+    for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+        vec bv = vec_mul(vec_loadu(&b[i]), alpha_v);
+        vec_storeu(&result[i], vec_sub(vec_loadu(&a[i]), bv));
+    }
+
+    for (; i < n; i++) {
+        result[i] = a[i] - alpha * b[i];
+    }
+}
+
+static void add_scaled(const f32* a, const f32* b, f32 alpha, f32* result, usize n) {
+    vec alpha_v = vec_set1(alpha);
+    usize i = 0;
+    for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+        vec_storeu(&result[i], vec_fmadd(vec_loadu(&b[i]), alpha_v, vec_loadu(&a[i])));
+    }
+
+    for (; i < n; i++) {
+        result[i] = a[i] + alpha * b[i];
+    }
+}
+
+// The optimizer steps finish with a masked vector instead of a scalar loop, so every element gets
+// the same arithmetic wherever a run ends (padded rows split a tensor into one run per row).
+// The updated values are also rounded into p16 (when not NULL) while still in registers.
+static inline __attribute__((always_inline)) void momentum_step_impl(f32* p, const f32* g, f32* v, f32 lr, f32 mu, bool nesterov,
+                                                                     bf16* p16, usize n) {
+    vec lr_v = vec_set1(lr);
+    vec mu_v = vec_set1(mu);
+    for (usize i = 0; i < n; i += VEC_WIDTH) {
+        u32 len = n - i < VEC_WIDTH ? n - i : VEC_WIDTH;
+        vec_mask mask = vec_tail_mask(len);
+        vec gv = vec_maskz_loadu(mask, &g[i]);
+        vec vv = vec_fmadd(mu_v, vec_maskz_loadu(mask, &v[i]), gv);
+        vec step = nesterov ? vec_fmadd(mu_v, vv, gv) : vv;
+        vec pv = vec_sub(vec_maskz_loadu(mask, &p[i]), vec_mul(lr_v, step));
+        vec_mask_storeu(&v[i], mask, vv);
+        vec_mask_storeu(&p[i], mask, pv);
+        if (p16 != NULL) {
+            vec_storen_bf16(&p16[i], pv, len);
+        }
+    }
+}
+
+static void momentum_step(f32* p, const f32* g, f32* v, f32 lr, f32 mu, bool nesterov, bf16* p16, usize n) {
+    if (nesterov) {
+        momentum_step_impl(p, g, v, lr, mu, true, p16, n);
+    } else {
+        momentum_step_impl(p, g, v, lr, mu, false, p16, n);
+    }
+}
+
+static void adam_step(f32* p, const f32* g, f32* m, f32* v, const AdamStep* hp, bf16* p16, usize n) {
+    vec b1 = vec_set1(hp->beta1);
+    vec b2 = vec_set1(hp->beta2);
+    vec one_b1 = vec_set1(1.0f - hp->beta1);
+    vec one_b2 = vec_set1(1.0f - hp->beta2);
+    vec eps = vec_set1(hp->eps);
+    vec l2 = vec_set1(hp->l2);
+    vec keep = vec_set1(1.0f - hp->lr * hp->decay);
+    vec lr_m = vec_set1(hp->lr * hp->m_scale);
+    vec v_scale = vec_set1(hp->v_scale);
+    for (usize i = 0; i < n; i += VEC_WIDTH) {
+        u32 len = n - i < VEC_WIDTH ? n - i : VEC_WIDTH;
+        vec_mask mask = vec_tail_mask(len);
+        vec pv = vec_maskz_loadu(mask, &p[i]);
+        vec gv = vec_fmadd(l2, pv, vec_maskz_loadu(mask, &g[i]));
+        vec mv = vec_fmadd(b1, vec_maskz_loadu(mask, &m[i]), vec_mul(one_b1, gv));
+        vec vv = vec_fmadd(b2, vec_maskz_loadu(mask, &v[i]), vec_mul(one_b2, vec_mul(gv, gv)));
+        vec_mask_storeu(&m[i], mask, mv);
+        vec_mask_storeu(&v[i], mask, vv);
+        vec denom = vec_add(vec_sqrt(vec_mul(vv, v_scale)), eps);
+        pv = vec_sub(vec_mul(pv, keep), vec_div(vec_mul(lr_m, mv), denom));
+        vec_mask_storeu(&p[i], mask, pv);
+        if (p16 != NULL) {
+            vec_storen_bf16(&p16[i], pv, len);
+        }
+    }
+}
+
+const CpuKernels CPU_KERNELS_TABLE = {
+    .isa = CPU_KERNELS_ISA,
+    .gemm_mr = GEMM_MR,
+    .gemm_nr = GEMM_NR,
+    .gemm = gemm,
+    .binary = {
+        [BINARY_ADD] = add_row,
+        [BINARY_SUB] = sub_row,
+        [BINARY_MUL] = mul_row,
+    },
+    .reduce_rows = reduce_rows,
+    .reduce_rows_bf16 = reduce_rows_bf16,
+    .cvt_to_f32 = cvt_to_f32,
+    .cvt_to_bf16 = cvt_to_bf16,
+    .xent_row = xent_row,
+    .xent_row_bwd = xent_row_bwd,
+    .relu = relu,
+    .relu_bwd = relu_bwd,
+    .sub_scaled = sub_scaled,
+    .add_scaled = add_scaled,
+    .momentum_step = momentum_step,
+    .adam_step = adam_step,
+};
@@ -0,0 +1,4 @@
+// Portable scalar variant of the kernels in cpu_kernels_impl.h, built without extra target flags
+#define CPU_KERNELS_TABLE cpu_kernels_scalar
+#define CPU_KERNELS_ISA CPU_ISA_SCALAR
+#include "cpu_kernels_impl.h"
@@ -1,30 +1,146 @@
 #include "../include/grad.h"
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 
-static arena_allocator* gradt_arena = NULL;
+typedef struct {
+    GradTensor* gt;
+    bool expanded; // sources already pushed, emit on the next pop
+} TopoFrame;
+
+struct GradContext_struct {
+    arena_allocator* arena;
+    // NULL falls back to arena
+    arena_allocator* activation_arena;
+    arena_allocator* temp_arena;
+    // off inside no-grad sections
+    bool grad_enabled;
+    // bumped by every backward pass, a grad holds this pass's values once its grad_gen matches
+    u64 grad_pass;
+    // bumped by every sort, a node counts as visited when its visit_gen matches, so marks never need clearing
+    u64 topo_gen;
+    // grow-only buffers reused by every sort
+    TopoFrame* topo_stack;
+    usize topo_stack_len;
+    usize topo_stack_cap;
+    DynArray topo_order;
+};
+
+// what a thread works in until it sets a context of its own
+static _Thread_local GradContext thread_context = {.grad_enabled = true};
+static _Thread_local GradContext* current_context = NULL;
+
+static GradContext* ctx() {
+    return current_context != NULL ? current_context : &thread_context;
+}
+
+GradContext* gradt_context_create(arena_allocator* arena) {
+    GradContext* c = calloc(1, sizeof(GradContext));
+    c->arena = arena;
+    c->grad_enabled = true;
+    return c;
+}
+
+void gradt_context_destroy(GradContext* c) {
+    if (c->arena != NULL) {
+        arena_destroy(c->arena);
+    }
+    free(c->topo_stack);
+    free(c->topo_order.ptr);
+    if (current_context == c) {
+        current_context = NULL;
+    }
+    free(c);
+}
+
+GradContext* gradt_context_set(GradContext* c) {
+    GradContext* prev = current_context;
+    current_context = c;
+    return prev;
+}
+
+GradContext* gradt_context() {
+    return ctx();
+}
 
 void gradt_set_arena(arena_allocator* arena) {
-    gradt_arena = arena;
+    ctx()->arena = arena;
 }
 
 void gradt_destroy_arena() {
-    arena_destroy(gradt_arena);
-    gradt_arena = NULL;
+    arena_destroy(ctx()->arena);
+    ctx()->arena = NULL;
 }
 
 void gradt_detach_arena() {
-    gradt_arena = NULL;
+    ctx()->arena = NULL;
 }
 
 void gradt_set_and_destroy_arena(arena_allocator* arena) {
-    if (gradt_arena != NULL) {
-        arena_destroy(gradt_arena);
+    GradContext* c = ctx();
+    if (c->arena != NULL) {
+        arena_destroy(c->arena);
     }
-    gradt_arena = arena;
+    c->arena = arena;
 }
 
 arena_allocator* _gradt_get_arena() {
-    return gradt_arena;
+    return ctx()->arena;
+}
+
+void gradt_set_activation_arena(arena_allocator* arena) {
+    ctx()->activation_arena = arena;
+}
+
+void gradt_set_temp_arena(arena_allocator* arena) {
+    ctx()->temp_arena = arena;
+}
+
+arena_allocator* _gradt_get_activation_arena() {
+    GradContext* c = ctx();
+    return c->activation_arena != NULL ? c->activation_arena : c->arena;
+}
+
+arena_allocator* _gradt_get_temp_arena() {
+    GradContext* c = ctx();
+    return c->temp_arena != NULL ? c->temp_arena : c->arena;
+}
+
+bool gradt_set_grad_enabled(bool enabled) {
+    GradContext* c = ctx();
+    bool prev = c->grad_enabled;
+    c->grad_enabled = enabled;
+    return prev;
+}
+
+bool gradt_grad_enabled() {
+    return ctx()->grad_enabled;
+}
+
+static GradTensor* node_from_tens(Tensor* tens, arena_allocator* arena, bool grad_enabled) {
+    GradTensor* gt = arena_alloc(arena, sizeof(GradTensor), 1);
+    gt->tens = tens;
+    gt->tens16 = NULL;
+    gt->grad = NULL;
+    if (grad_enabled) {
+        gt->grad = tensor_create_like(tens, arena);
+    }
+    gt->optimize = grad_enabled;
+    gt->optim_state[0] = NULL;
+    gt->optim_state[1] = NULL;
+    gt->optim_step = 0;
+    gt->visit_gen = 0;
+    // no zeroing: a grad holds what was written into it until the next pass, see gradt_grad
+    gt->grad_gen = ctx()->grad_pass;
+    op_set_nop(&gt->op);
+    return gt;
+}
+
+// output of an op: lives in the activation arena and is never stepped by the optimizer
+static GradTensor* activation_from_tens(Tensor* tens) {
+    GradTensor* gt = node_from_tens(tens, _gradt_get_activation_arena(), ctx()->grad_enabled);
+    gt->optimize = false;
+    return gt;
 }
 
 GradTensor* gradt_create(u32* shape, usize shape_len) {
@@ -32,35 +148,23 @@ GradTensor* gradt_create(u32* shape, usize shape_len) {
         return NULL;
     }
 
-    GradTensor* gt = arena_alloc(gradt_arena, sizeof(GradTensor), 1);
-    gt->tens = tensor_create(shape, shape_len, gradt_arena);
-    gt->grad = tensor_create(shape, shape_len, gradt_arena);
-    gt->prev_grad = tensor_create(shape, shape_len, gradt_arena);
-    tensor_set(gt->grad, 0.0);
-    tensor_set(gt->prev_grad, 0.0);
-    gt->optimize = true;
-    op_set_nop(&gt->op);
-    return gt;
+    arena_allocator* arena = ctx()->arena;
+    return node_from_tens(tensor_create(shape, shape_len, arena), arena, ctx()->grad_enabled);
 }
 
 GradTensor* gradt_create_from_tens(Tensor* tens) {
-    GradTensor* gt = arena_alloc(gradt_arena, sizeof(GradTensor), 1);
-    gt->tens = tens;
-    gt->grad = tensor_create(tens->shape, 4, gradt_arena);
-    gt->prev_grad = tensor_create(tens->shape, 4, gradt_arena);
-    gt->optimize = true;
-    tensor_set(gt->grad, 0.0);
-    tensor_set(gt->prev_grad, 0.0);
-    op_set_nop(&gt->op);
-    return gt;
+    if (tensor_row_ld(tens) == 0) { // the optimizers update tens in place row by row
+        return NULL;
+    }
+    return node_from_tens(tens, ctx()->arena, ctx()->grad_enabled);
 }
 
 GradTensor* gradt_create_from_labels(u32* labels, u32 n_classes, u32 n_labels, bool optimize) {
     u32 shape[4] = {1, 1, n_labels, n_classes};
-    Tensor* t = tensor_create(shape, 4, gradt_arena);
+    Tensor* t = tensor_create(shape, 4, ctx()->arena);
     for (usize l = 0; l < n_labels; l++) {
-        usize base = t->stride[2];
-        for (usize i = 0; i < n_labels; i++) {
+        usize base = t->stride[2] * l;
+        for (usize i = 0; i < n_classes; i++) {
             usize idx = base + i;
             if (labels[l] == i) {
                 t->data[idx] = 1.0;
@@ -70,7 +174,7 @@ GradTensor* gradt_create_from_labels(u32* labels, u32 n_classes, u32 n_labels, b
         }
     }
     GradTensor* gt = gradt_create_from_tens(t);
-    gt->optimize = optimize;
+    gt->optimize = optimize && gt->grad != NULL;
     return gt;
 }
 
@@ -79,90 +183,254 @@ GradTensor* gradt_create_nograd(u32* shape, usize shape_len) {
         return NULL;
     }
 
-    GradTensor* gt = arena_alloc(gradt_arena, sizeof(GradTensor), 1);
-    gt->tens = tensor_create(shape, shape_len, gradt_arena);
+    arena_allocator* arena = ctx()->arena;
+    GradTensor* gt = arena_alloc(arena, sizeof(GradTensor), 1);
+    gt->tens = tensor_create(shape, shape_len, arena);
+    gt->tens16 = NULL;
     gt->grad = NULL;
-    gt->prev_grad = NULL;
     gt->optimize = false;
+    gt->optim_state[0] = NULL;
+    gt->optim_state[1] = NULL;
+    gt->optim_step = 0;
+    gt->visit_gen = 0;
+    gt->grad_gen = 0;
     op_set_nop(&gt->op);
     return gt;
 }
 
+void gradt_enable_bf16(GradTensor* gt) {
+    if (gt->tens16 == NULL) {
+        gt->tens16 = tensor_to_dtype(gt->tens, TENSOR_BF16, ctx()->arena);
+    }
+}
+
+void _gradt_sync_bf16(GradTensor* gt) {
+    if (gt->tens16 != NULL) {
+        _tensor_kernel_copy(gt->tens, gt->tens16);
+    }
+}
+
+// with grad disabled the op builders below stop after computing the output: no grad, no Op record
 GradTensor* gradt_relu(GradTensor* gt) {
-    GradTensor* res = gradt_create(gt->tens->shape, 4);
+    GradTensor* res = activation_from_tens(tensor_create_dtype(gt->tens->shape, 4, gt->tens->dtype, _gradt_get_activation_arena()));
+    if (!ctx()->grad_enabled) {
+        _tensor_kernel_relu(gt->tens, res->tens);
+        return res;
+    }
     op_set_relu(&res->op, gt, res);
     op_fwd(&res->op);
     return res;
 }
 
 GradTensor* gradt_add(GradTensor* gt1, GradTensor* gt2) {
-    Tensor* tens = tensor_add(gt1->tens, gt2->tens, gradt_arena);
-    GradTensor* gt = gradt_create_from_tens(tens);
-    op_set_add(&gt->op, gt1, gt2, gt);
+    Tensor* tens = tensor_add(gt1->tens, gt2->tens, _gradt_get_activation_arena());
+    if (tens == NULL) {
+        return NULL;
+    }
+    GradTensor* gt = activation_from_tens(tens);
+    if (ctx()->grad_enabled) {
+        op_set_add(&gt->op, gt1, gt2, gt);
+    }
     return gt;
 }
 
 GradTensor* gradt_mul(GradTensor* gt1, GradTensor* gt2) {
-    Tensor* tens = tensor_mul_tr(gt1->tens, gt2->tens, false, false, gradt_arena);
-    GradTensor* gt = gradt_create_from_tens(tens);
-    op_set_mul(&gt->op, gt1, gt2, gt);
+    Tensor* tens = tensor_mul_tr(gradt_value(gt1), gradt_value(gt2), false, false, _gradt_get_activation_arena());
+    if (tens == NULL) {
+        return NULL;
+    }
+    GradTensor* gt = activation_from_tens(tens);
+    if (ctx()->grad_enabled) {
+        op_set_mul(&gt->op, gt1, gt2, gt);
+    }
+    return gt;
+}
+
+GradTensor* gradt_linear(GradTensor* x, GradTensor* w, GradTensor* b, bool relu) {
+    Tensor* tens = tensor_linear(gradt_value(x), gradt_value(w), b != NULL ? b->tens : NULL, relu, _gradt_get_activation_arena());
+    if (tens == NULL) {
+        return NULL;
+    }
+    GradTensor* gt = activation_from_tens(tens);
+    if (ctx()->grad_enabled) {
+        op_set_linear(&gt->op, x, w, b, gt, relu);
+    }
     return gt;
 }
 
-static void topo_sort(GradTensor* gt, DynArray* topo, DynArray* visited) {
-    if (!contains(visited, gt)) {
-        push_dynarr(visited, gt);
-        if (gt->op.type == Mono) {
-            if (gt->op.op.mono.src != NULL) // check if it's not NOP
-                topo_sort(gt->op.op.mono.src, topo, visited);
+// a cast of data without a gradient (input batches) gets none either, it is only replayed forward
+GradTensor* gradt_cast(GradTensor* gt, TensorDtype dtype) {
+    Tensor* tens = tensor_to_dtype(gt->tens, dtype, _gradt_get_activation_arena());
+    GradTensor* res = node_from_tens(tens, _gradt_get_activation_arena(), ctx()->grad_enabled && gt->grad != NULL);
+    res->optimize = false;
+    if (ctx()->grad_enabled) {
+        op_set_cast(&res->op, gt, res);
+    }
+    return res;
+}
+
+static void topo_push(GradContext* c, GradTensor* gt, bool expanded) {
+    if (gt == NULL) { // nop ops have no sources
+        return;
+    }
+    if (c->topo_stack_len == c->topo_stack_cap) {
+        c->topo_stack_cap = c->topo_stack_cap < 64 ? 64 : 2 * c->topo_stack_cap;
+        c->topo_stack = realloc(c->topo_stack, c->topo_stack_cap * sizeof(TopoFrame));
+    }
+    c->topo_stack[c->topo_stack_len++] = (TopoFrame){.gt = gt, .expanded = expanded};
+}
+
+// Iterative post-order DFS from gt, every node after its sources. O(nodes + edges), no recursion.
+// The returned array is owned by the context and overwritten by its next sort.
+static DynArray* topo_sort(GradContext* c, GradTensor* gt) {
+    if (c->topo_order.ptr == NULL) {
+        c->topo_order = create_dynarr(64);
+    }
+    c->topo_order.len = 0;
+    u64 gen = ++c->topo_gen;
+
+    topo_push(c, gt, false);
+    while (c->topo_stack_len > 0) {
+        TopoFrame frame = c->topo_stack[--c->topo_stack_len];
+        GradTensor* node = frame.gt;
+        if (frame.expanded) {
+            push_dynarr(&c->topo_order, node);
+            continue;
+        }
+        if (node->visit_gen == gen) {
+            continue;
+        }
+        node->visit_gen = gen;
+        topo_push(c, node, true);
+        // reversed, so src1's subtree is emitted first
+        if (node->op.type == Mono) {
+            topo_push(c, node->op.op.mono.src, false);
+        } else if (node->op.type == Ternary) {
+            topo_push(c, node->op.op.tern.src3, false);
+            topo_push(c, node->op.op.tern.src2, false);
+            topo_push(c, node->op.op.tern.src1, false);
         } else {
-            topo_sort(gt->op.op.bin.src1, topo, visited);
-            topo_sort(gt->op.op.bin.src2, topo, visited);
+            topo_push(c, node->op.op.bin.src2, false);
+            topo_push(c, node->op.op.bin.src1, false);
         }
-        push_dynarr(topo, gt);
     }
+    return &c->topo_order;
 }
 
+
+// bf16 logits are widened by a cast op first, the loss kernels are f32 only
 GradTensor* gradt_cross_entropy_loss(GradTensor* src, GradTensor* truth) {
-    Tensor* t_loss = tensor_cross_entropy(src->tens, truth->tens, gradt_arena);
-    GradTensor* loss = gradt_create_from_tens(t_loss);
-    op_set_cse(&loss->op, src, truth, loss);
+    if (src->tens->dtype != TENSOR_F32) {
+        src = gradt_cast(src, TENSOR_F32);
+    }
+    Tensor* stats = NULL;
+    Tensor* t_loss = tensor_cross_entropy(src->tens, truth->tens, &stats, _gradt_get_activation_arena());
+    if (t_loss == NULL) {
+        return NULL;
+    }
+    GradTensor* loss = activation_from_tens(t_loss);
+    if (ctx()->grad_enabled) {
+        op_set_cse(&loss->op, src, truth, loss, stats);
+    }
     return loss;
 }
 
+bool _gradt_grad_accumulate(GradTensor* gt) {
+    if (gt == NULL || gt->grad == NULL) {
+        return false;
+    }
+    u64 pass = ctx()->grad_pass;
+    if (gt->grad_gen == pass) {
+        return true;
+    }
+    gt->grad_gen = pass;
+    return false;
+}
+
+Tensor* gradt_grad(GradTensor* gt) {
+    u64 pass = ctx()->grad_pass;
+    if (gt->grad != NULL && gt->grad_gen != pass) {
+        tensor_set(gt->grad, 0.0);
+        gt->grad_gen = pass;
+    }
+    return gt->grad;
+}
+
+static void grad_pass_begin(GradContext* c, GradTensor* loss) {
+    c->grad_pass++;
+    tensor_set(loss->grad, 1.0);
+    loss->grad_gen = c->grad_pass;
+}
+
+// an op whose output got no gradient this pass contributes nothing and is skipped
+static void grad_pass_bwd(GradContext* c, GradTensor* gt) {
+    if (gt->grad == NULL || gt->grad_gen == c->grad_pass) {
+        op_bwd(&gt->op);
+    }
+}
+
 void gradt_backward(GradTensor* gt, Optimizer optim, void* optim_config) {
     if (gt->tens->data_len != 1) {
         printf("Only scalar tensors allowed in backward, got %lu length\n", gt->tens->data_len);
     }
-    tensor_set(gt->grad, 1.0);
+    if (gt->grad == NULL) {
+        printf("No graph to backpropagate through, was it built with grad disabled?\n");
+        return;
+    }
     
-    DynArray topo = create_dynarr(10);
-    DynArray visited = create_dynarr(10);
-    topo_sort(gt, &topo, &visited);
-    // printf("Computing bwd pass of %lu tensors\n", topo.len);
-    for (usize i = 0; i < topo.len - 1; i++) {
-        GradTensor* gti = (GradTensor*)topo.ptr[i];
-        if (gti->grad == NULL || gti->prev_grad == NULL) {
-            continue;
+    GradContext* c = ctx();
+    DynArray* topo = topo_sort(c, gt);
+    // printf("Computing bwd pass of %lu tensors\n", topo->len);
+    grad_pass_begin(c, gt);
+    for (usize i = 0; i < topo->len; i++) {
+        grad_pass_bwd(c, (GradTensor*)topo->ptr[topo->len - i - 1]);
+    }
+
+    for (usize i = 0; i < topo->len; i++) {
+        GradTensor* gti = (GradTensor*)topo->ptr[topo->len - i - 1];
+        if (gti->optimize && optim != NULL) {
+            optim(gti, optim_config);
         }
-        Tensor* temp = gti->grad;
-        gti->grad = gti->prev_grad;
-        gti->prev_grad = temp;
-        tensor_set(gti->grad, 0.0); 
     }
-    
-    for (usize i = 0; i < topo.len; i++) {
-        GradTensor* gti = (GradTensor*)topo.ptr[topo.len - i - 1];
-        op_bwd(&gti->op);
+}
+
+GradPlan gradt_plan_capture(GradTensor* loss) {
+    GradContext* c = ctx();
+    DynArray* topo = topo_sort(c, loss);
+    GradPlan plan = {.loss = loss, .len = topo->len, .n_steps = 2 * topo->len, .ctx = c};
+    plan.order = arena_alloc(c->arena, sizeof(GradTensor*), topo->len);
+    memcpy(plan.order, topo->ptr, topo->len * sizeof(GradTensor*));
+    plan.steps = arena_alloc(c->arena, sizeof(PlanStep), plan.n_steps);
+    for (usize i = 0; i < plan.len; i++) {
+        plan.steps[i] = (PlanStep){.node = i, .bwd = false};
+        plan.steps[plan.len + i] = (PlanStep){.node = plan.len - 1 - i, .bwd = true};
     }
+    return plan;
+}
 
-    for (usize i = 0; i < topo.len; i++) {
-        GradTensor* gti = (GradTensor*)topo.ptr[topo.len - i - 1];
-        if (gti->optimize) {
+// runs in the plan's context whichever thread calls it
+void gradt_plan_step(GradPlan* plan, Optimizer optim, void* optim_config) {
+    GradContext* prev = gradt_context_set(plan->ctx);
+    GradContext* c = plan->ctx;
+    bool backward = false;
+    for (usize t = 0; t < plan->n_steps; t++) {
+        GradTensor* gt = plan->order[plan->steps[t].node];
+        if (!plan->steps[t].bwd) {
+            op_fwd(&gt->op);
+            continue;
+        }
+        if (!backward) {
+            grad_pass_begin(c, plan->loss);
+            backward = true;
+        }
+        grad_pass_bwd(c, gt);
+    }
+
+    for (usize i = 0; i < plan->len; i++) {
+        GradTensor* gti = plan->order[plan->len - i - 1];
+        if (gti->optimize && optim != NULL) {
             optim(gti, optim_config);
         }
     }
-    
-    free_dynarr(&topo);
-    free_dynarr(&visited);
+    gradt_context_set(prev);
 }
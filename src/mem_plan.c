@@ -0,0 +1,346 @@
+#include "../include/mem_plan.h"
+#include "../include/parallel.h"
+
+#include <stdlib.h>
+
+// offsets in the pool start on 64 byte boundaries
+#define MEM_PLAN_ALIGN 64
+#define ALIGN_UP(n, p) ((((n) + (p) - 1) / (p)) * (p))
+// live ranges per buffer: the forward one and, for a checkpointed value, the recomputed one
+#define PLAN_SPANS 2
+
+typedef struct {
+    const GradTensor* gt;
+    usize index;
+} PlanNode;
+
+// buffer 2 * i is the value of plan->order[i], 2 * i + 1 its grad
+typedef struct {
+    Tensor* tens;
+    usize bytes;
+    i64 def[PLAN_SPANS];  // step writing it
+    i64 last[PLAN_SPANS]; // last step reading that write
+    u32 n_spans;
+    usize slot; // buffer whose memory it shares, itself unless it was placed in place
+    usize offset;
+    bool planned;
+} PlanBuf;
+
+static int cmp_plan_node(const void* a, const void* b) {
+    const GradTensor* x = ((const PlanNode*)a)->gt;
+    const GradTensor* y = ((const PlanNode*)b)->gt;
+    return x < y ? -1 : x > y;
+}
+
+// order index of every node, looked up by pointer; free the result
+static PlanNode* plan_nodes(const GradPlan* plan) {
+    PlanNode* nodes = malloc(plan->len * sizeof(PlanNode));
+    for (usize i = 0; i < plan->len; i++) {
+        nodes[i] = (PlanNode){.gt = plan->order[i], .index = i};
+    }
+    qsort(nodes, plan->len, sizeof(PlanNode), cmp_plan_node);
+    return nodes;
+}
+
+static usize plan_node_index(const PlanNode* nodes, usize n, const GradTensor* gt) {
+    PlanNode key = {.gt = gt};
+    const PlanNode* found = bsearch(&key, nodes, n, sizeof(PlanNode), cmp_plan_node);
+    return found->index;
+}
+
+static bool is_leaf(const GradTensor* gt) {
+    return gt->op.type == Mono && gt->op.op.mono.src == NULL;
+}
+
+// values start a new span on every write, grads keep accumulating into their first one
+static void span_write(PlanBuf* b, i64 step, bool fresh) {
+    if (fresh || b->n_spans == 0) {
+        b->def[b->n_spans] = step;
+        b->last[b->n_spans] = step;
+        b->n_spans++;
+    } else {
+        b->last[b->n_spans - 1] = step;
+    }
+}
+
+static void span_read(PlanBuf* b, i64 step) {
+    if (b->n_spans > 0 && step > b->last[b->n_spans - 1]) {
+        b->last[b->n_spans - 1] = step;
+    }
+}
+
+static usize slot_of(PlanBuf* bufs, usize b) {
+    while (bufs[b].slot != b) {
+        bufs[b].slot = bufs[bufs[b].slot].slot;
+        b = bufs[b].slot;
+    }
+    return b;
+}
+
+// an in place op walks both buffers with the same offsets
+static bool same_layout(const Tensor* a, const Tensor* b) {
+    if (a->dtype != b->dtype) {
+        return false;
+    }
+    for (usize d = 0; d < 4; d++) {
+        if (a->shape[d] != b->shape[d] || a->stride[d] != b->stride[d]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool lifetimes_overlap(const PlanBuf* a, const PlanBuf* b) {
+    for (u32 i = 0; i < a->n_spans; i++) {
+        for (u32 j = 0; j < b->n_spans; j++) {
+            if (a->def[i] <= b->last[j] && b->def[j] <= a->last[i]) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// b's memory becomes part of src's slot if every write of b happens at a step where a span of the
+// slot ends (the in place op reading its input for the last time) and the joined spans stay disjoint
+static bool place_in_place(PlanBuf* bufs, usize b, usize src) {
+    usize slot = slot_of(bufs, src);
+    PlanBuf joined = bufs[slot];
+    for (u32 k = 0; k < bufs[b].n_spans; k++) {
+        u32 m = 0;
+        while (m < joined.n_spans && joined.last[m] != bufs[b].def[k]) {
+            m++;
+        }
+        if (m == joined.n_spans) {
+            return false;
+        }
+        joined.last[m] = bufs[b].last[k];
+    }
+    for (u32 i = 0; i < joined.n_spans; i++) {
+        for (u32 j = i + 1; j < joined.n_spans; j++) {
+            if (joined.def[i] <= joined.last[j] && joined.def[j] <= joined.last[i]) {
+                return false;
+            }
+        }
+    }
+
+    joined.bytes = bufs[b].bytes > joined.bytes ? bufs[b].bytes : joined.bytes;
+    bufs[slot] = joined;
+    bufs[b].slot = slot;
+    return true;
+}
+
+static int cmp_slot_size(const void* a, const void* b) {
+    const PlanBuf* x = *(const PlanBuf* const*)a;
+    const PlanBuf* y = *(const PlanBuf* const*)b;
+    if (x->bytes != y->bytes) {
+        return x->bytes > y->bytes ? -1 : 1;
+    }
+    return x->def[0] < y->def[0] ? -1 : x->def[0] > y->def[0];
+}
+
+MemPlanStats mem_plan_apply(GradPlan* plan, arena_allocator* arena) {
+    MemPlanStats stats = {0};
+    usize n = plan->len;
+    i64 end = plan->n_steps; // the pass-end zeroing of grads nobody wrote
+
+    PlanNode* nodes = plan_nodes(plan);
+    PlanBuf* bufs = malloc(2 * n * sizeof(PlanBuf));
+    for (usize i = 0; i < n; i++) {
+        GradTensor* gt = plan->order[i];
+        bool planned = !is_leaf(gt) && gt != plan->loss;
+        bufs[2 * i] = (PlanBuf){.tens = gt->tens, .bytes = ALIGN_UP(tensor_storage_len(gt->tens) * tensor_elem_size(gt->tens), MEM_PLAN_ALIGN),
+                                .slot = 2 * i, .planned = planned};
+        bufs[2 * i + 1] = (PlanBuf){.tens = gt->grad, .slot = 2 * i + 1, .planned = planned && gt->grad != NULL};
+        if (gt->grad != NULL) {
+            bufs[2 * i + 1].bytes = ALIGN_UP(tensor_storage_len(gt->grad) * sizeof(f32), MEM_PLAN_ALIGN);
+        }
+    }
+
+    // a fwd reads its inputs' values and writes its output, a bwd reads dst's grad (and the values
+    // in Op.bwd_reads) and writes its inputs' grads
+    for (usize t = 0; t < plan->n_steps; t++) {
+        usize j = plan->steps[t].node;
+        const Op* op = &plan->order[j]->op;
+        GradTensor* srcs[3];
+        usize n_srcs = op_srcs(op, srcs);
+        for (usize k = 0; k < n_srcs; k++) {
+            if (srcs[k] == NULL) {
+                continue;
+            }
+            usize s = plan_node_index(nodes, n, srcs[k]);
+            if (!plan->steps[t].bwd) {
+                span_read(&bufs[2 * s], t);
+                continue;
+            }
+            if (op->bwd_reads & (OP_BWD_SRC1 << k)) {
+                span_read(&bufs[2 * s], t);
+            }
+            span_write(&bufs[2 * s + 1], t, false);
+        }
+        if (!plan->steps[t].bwd) {
+            span_write(&bufs[2 * j], t, true);
+        } else {
+            if (op->bwd_reads & OP_BWD_DST) {
+                span_read(&bufs[2 * j], t);
+            }
+            span_read(&bufs[2 * j + 1], t);
+        }
+    }
+    for (usize i = 0; i < n; i++) {
+        if (bufs[2 * i + 1].n_spans == 0) {
+            span_write(&bufs[2 * i + 1], end, false);
+        }
+    }
+
+    // elementwise ops overwrite an input that dies at them: values along the forward order,
+    // grads (dst's grad handed to a src whose first contribution this is) along the backward order
+    for (usize j = 0; j < n; j++) {
+        const Op* op = &plan->order[j]->op;
+        GradTensor* srcs[3];
+        usize n_srcs = op_srcs(op, srcs);
+        for (usize k = 0; k < n_srcs && op->inplace && bufs[2 * j].planned; k++) {
+            if (srcs[k] == NULL || !same_layout(srcs[k]->tens, plan->order[j]->tens)) {
+                continue;
+            }
+            usize s = plan_node_index(nodes, n, srcs[k]);
+            if (bufs[2 * s].planned && place_in_place(bufs, 2 * j, 2 * s)) {
+                stats.n_inplace++;
+                break;
+            }
+        }
+    }
+    for (usize r = 0; r < n; r++) {
+        usize j = n - 1 - r;
+        const Op* op = &plan->order[j]->op;
+        GradTensor* srcs[3];
+        usize n_srcs = op_srcs(op, srcs);
+        for (usize k = 0; k < n_srcs && op->inplace && bufs[2 * j + 1].planned; k++) {
+            if (srcs[k] == NULL || srcs[k]->grad == NULL || !same_layout(srcs[k]->grad, plan->order[j]->grad)) {
+                continue;
+            }
+            usize s = plan_node_index(nodes, n, srcs[k]);
+            if (bufs[2 * s + 1].planned && place_in_place(bufs, 2 * s + 1, 2 * j + 1)) {
+                stats.n_inplace++;
+                break;
+            }
+        }
+    }
+
+    // greedy by size: each slot goes to the lowest offset clear of every placed slot it is alive with
+    PlanBuf** slots = malloc(2 * n * sizeof(PlanBuf*));
+    usize n_slots = 0;
+    for (usize b = 0; b < 2 * n; b++) {
+        if (bufs[b].planned) {
+            stats.n_buffers++;
+            stats.naive_bytes += bufs[b].bytes;
+            if (slot_of(bufs, b) == b) {
+                slots[n_slots++] = &bufs[b];
+            }
+        }
+    }
+    qsort(slots, n_slots, sizeof(PlanBuf*), cmp_slot_size);
+    for (usize i = 0; i < n_slots; i++) {
+        PlanBuf* slot = slots[i];
+        slot->offset = 0;
+        bool moved = true;
+        while (moved) {
+            moved = false;
+            for (usize p = 0; p < i; p++) {
+                if (lifetimes_overlap(slot, slots[p]) && slot->offset < slots[p]->offset + slots[p]->bytes &&
+                    slots[p]->offset < slot->offset + slot->bytes) {
+                    slot->offset = slots[p]->offset + slots[p]->bytes;
+                    moved = true;
+                }
+            }
+        }
+        if (slot->offset + slot->bytes > stats.planned_bytes) {
+            stats.planned_bytes = slot->offset + slot->bytes;
+        }
+    }
+
+    u8* pool = arena_alloc_aligned(arena, 1, stats.planned_bytes, MEM_PLAN_ALIGN);
+    // faulted in by the workers rather than on whichever node the first planned step runs from
+    parallel_first_touch(pool, stats.planned_bytes);
+    for (usize b = 0; b < 2 * n; b++) {
+        if (bufs[b].planned) {
+            u8* mem = pool + bufs[slot_of(bufs, b)].offset;
+            if (bufs[b].tens->dtype == TENSOR_BF16) {
+                bufs[b].tens->data16 = (bf16*)mem;
+            } else {
+                bufs[b].tens->data = (f32*)mem;
+            }
+        }
+    }
+
+    free(slots);
+    free(bufs);
+    free(nodes);
+    return stats;
+}
+
+usize mem_plan_checkpoint(GradPlan* plan, usize every) {
+    usize n = plan->len;
+    every = every > 0 ? every : 1;
+    PlanNode* nodes = plan_nodes(plan);
+    usize* seg = malloc(n * sizeof(usize));
+    bool* drop = malloc(n * sizeof(bool));
+    usize n_ops = 0;
+    for (usize i = 0; i < n; i++) {
+        GradTensor* gt = plan->order[i];
+        bool leaf = is_leaf(gt);
+        seg[i] = n_ops / every;
+        drop[i] = !leaf && gt != plan->loss && n_ops % every != every - 1;
+        n_ops += !leaf;
+    }
+    // a recomputed value must only be needed by its own segment, which is rerun as a whole
+    for (usize j = 0; j < n; j++) {
+        GradTensor* srcs[3];
+        usize n_srcs = op_srcs(&plan->order[j]->op, srcs);
+        for (usize k = 0; k < n_srcs; k++) {
+            if (srcs[k] != NULL) {
+                usize s = plan_node_index(nodes, n, srcs[k]);
+                drop[s] = drop[s] && seg[s] == seg[j];
+            }
+        }
+    }
+
+    usize n_dropped = 0;
+    for (usize i = 0; i < n; i++) {
+        n_dropped += drop[i];
+    }
+    plan->n_steps = 2 * n + n_dropped;
+    // in the plan's arena, whichever context is current
+    GradContext* prev = gradt_context_set(plan->ctx);
+    plan->steps = arena_alloc(_gradt_get_arena(), sizeof(PlanStep), plan->n_steps);
+    gradt_context_set(prev);
+    usize t = 0;
+    for (usize i = 0; i < n; i++) {
+        plan->steps[t++] = (PlanStep){.node = i, .bwd = false};
+    }
+    bool entered = false;
+    usize current = 0;
+    for (usize r = 0; r < n; r++) {
+        usize i = n - 1 - r;
+        // entering a segment from its end: rerun its dropped ops first
+        if (!is_leaf(plan->order[i]) && (!entered || seg[i] != current)) {
+            entered = true;
+            current = seg[i];
+            usize start = i;
+            while (start > 0 && (is_leaf(plan->order[start - 1]) || seg[start - 1] == current)) {
+                start--;
+            }
+            for (usize m = start; m <= i; m++) {
+                if (drop[m]) {
+                    plan->steps[t++] = (PlanStep){.node = m, .bwd = false};
+                }
+            }
+        }
+        plan->steps[t++] = (PlanStep){.node = i, .bwd = true};
+    }
+
+    free(drop);
+    free(seg);
+    free(nodes);
+    return n_dropped;
+}
@@ -5,18 +5,18 @@ LinearLayer nn_linear_create(u32 in, u32 out) {
     u32 b_shape[4] = {1, 1, 1, out};
     LinearLayer l = {
         .w = gradt_create(w_shape, 4),
-        .b = gradt_create(b_shape, 4),
-        ._proj = NULL
+        .b = gradt_create(b_shape, 4)
     };
     // xavier init?
     return l;
 }
 
 GradTensor* nn_linear_forward(LinearLayer* layer, GradTensor* in) {
-    layer->_proj = gradt_mul(in, layer->w);
-    // not weights, shouldnt be optimized
-    layer->_proj->optimize = false;
-    return gradt_add(layer->_proj, layer->b);
+    return gradt_linear(in, layer->w, layer->b, false);
+}
+
+GradTensor* nn_linear_relu_forward(LinearLayer* layer, GradTensor* in) {
+    return gradt_linear(in, layer->w, layer->b, true);
 }
 
 GradTensor* nn_relu(GradTensor* gt) {
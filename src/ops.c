@@ -7,6 +7,9 @@ void op_fwd(Op* op) {
         const GradTensor* src = op->op.mono.src;
         GradTensor* dst = op->op.mono.dst;
         op->op.mono.fwd(src, dst);
+    } else if (op->type == Ternary) {
+        TernOp* tern = &op->op.tern;
+        tern->fwd(tern->src1, tern->src2, tern->src3, tern->dst);
     } else {
         const GradTensor* src1 = op->op.bin.src1;
         const GradTensor* src2 = op->op.bin.src2;
@@ -20,6 +23,9 @@ void op_bwd(Op* op) {
         GradTensor* src = op->op.mono.src;
         const GradTensor* dst = op->op.mono.dst;
         op->op.mono.bwd(src, dst);
+    } else if (op->type == Ternary) {
+        TernOp* tern = &op->op.tern;
+        tern->bwd(tern->src1, tern->src2, tern->src3, tern->dst);
     } else {
         GradTensor* src1 = op->op.bin.src1;
         GradTensor* src2 = op->op.bin.src2;
@@ -28,6 +34,21 @@ void op_bwd(Op* op) {
     }
 }
 
+usize op_srcs(const Op* op, struct GradTensor_struct** srcs) {
+    if (op->type == Mono) {
+        srcs[0] = op->op.mono.src;
+        return srcs[0] != NULL ? 1 : 0;
+    } else if (op->type == Ternary) {
+        srcs[0] = op->op.tern.src1;
+        srcs[1] = op->op.tern.src2;
+        srcs[2] = op->op.tern.src3;
+        return 3;
+    }
+    srcs[0] = op->op.bin.src1;
+    srcs[1] = op->op.bin.src2;
+    return 2;
+}
+
 static void nop_fwd(const GradTensor* src, GradTensor* dst) {}
 static void nop_bwd(GradTensor* src, const GradTensor* dst) {}
 
@@ -37,14 +58,19 @@ void op_set_nop(Op* op) {
     op->op.mono.dst = NULL;
     op->op.mono.fwd = nop_fwd;
     op->op.mono.bwd = nop_bwd;
+    op->saved = NULL;
+    op->bwd_reads = 0;
+    op->inplace = false;
 }
 
 static void relu_fwd(const GradTensor* src, GradTensor* dst) {
     _tensor_kernel_relu(src->tens, dst->tens);
 }
 
+// relu(x) > 0 exactly where x > 0, so the output masks the gradient and the input can be dropped
 static void relu_bwd(GradTensor* src, const GradTensor* dst) {
-    _tensor_kernel_relu_bwd(src->tens, src->grad, dst->grad);
+    bool acc = _gradt_grad_accumulate(src);
+    _tensor_kernel_relu_bwd(dst->tens, src->grad, acc, dst->grad);
 }
 
 void op_set_relu(Op* op, struct GradTensor_struct* src, struct GradTensor_struct* dst) {
@@ -53,6 +79,9 @@ void op_set_relu(Op* op, struct GradTensor_struct* src, struct GradTensor_struct
    op->op.mono.dst = dst;
    op->op.mono.fwd = relu_fwd;
    op->op.mono.bwd = relu_bwd; 
+   op->saved = NULL;
+   op->bwd_reads = OP_BWD_DST;
+   op->inplace = true;
 }
 
 static void add_fwd(const GradTensor* src1, const GradTensor* src2, GradTensor* dst) {
@@ -60,7 +89,11 @@ static void add_fwd(const GradTensor* src1, const GradTensor* src2, GradTensor*
 }
 
 static void add_bwd(GradTensor* src1, GradTensor* src2, const GradTensor* dst) {
-    _tensor_kernel_add_bwd(src1->grad, src2->grad, dst->grad, _gradt_get_arena());
+    bool acc1 = _gradt_grad_accumulate(src1);
+    bool acc2 = _gradt_grad_accumulate(src2);
+    arena_scope temp = arena_scope_begin(_gradt_get_temp_arena());
+    _tensor_kernel_add_bwd(src1->grad, acc1, src2->grad, acc2, dst->grad, temp.arena);
+    arena_scope_end(temp);
 }
 
 void op_set_add(Op* op, struct GradTensor_struct* src1, struct GradTensor_struct* src2, struct GradTensor_struct* dst) {
@@ -70,14 +103,21 @@ void op_set_add(Op* op, struct GradTensor_struct* src1, struct GradTensor_struct
     op->op.bin.dst = dst;
     op->op.bin.fwd = add_fwd;
     op->op.bin.bwd = add_bwd;
+    op->saved = NULL;
+    op->bwd_reads = 0;
+    op->inplace = true;
 }
 
 static void mul_fwd(const GradTensor* src1, const GradTensor* src2, GradTensor* dst) {
-    _tensor_kernel_mul(src1->tens, src2->tens, dst->tens);
+    _tensor_kernel_mul(gradt_value(src1), gradt_value(src2), dst->tens);
 }
 
 static void mul_bwd(GradTensor* src1, GradTensor* src2, const GradTensor* dst) {
-    _tensor_kernel_mul_bwd(src1->tens, src1->grad, src2->tens, src2->grad, dst->grad, _gradt_get_arena());
+    bool acc1 = _gradt_grad_accumulate(src1);
+    bool acc2 = _gradt_grad_accumulate(src2);
+    arena_scope temp = arena_scope_begin(_gradt_get_temp_arena());
+    _tensor_kernel_mul_bwd(gradt_value(src1), src1->grad, acc1, gradt_value(src2), src2->grad, acc2, dst->grad, temp.arena);
+    arena_scope_end(temp);
 }
 
 void op_set_mul(Op* op, struct GradTensor_struct* src1, struct GradTensor_struct* src2, struct GradTensor_struct* dst) {
@@ -87,21 +127,93 @@ void op_set_mul(Op* op, struct GradTensor_struct* src1, struct GradTensor_struct
     op->op.bin.dst = dst;
     op->op.bin.fwd = mul_fwd;
     op->op.bin.bwd = mul_bwd;
+    op->saved = NULL;
+    op->bwd_reads = OP_BWD_SRC1 | OP_BWD_SRC2;
+    op->inplace = false;
+}
+
+static void cast_fwd(const GradTensor* src, GradTensor* dst) {
+    _tensor_kernel_copy(src->tens, dst->tens);
+}
+
+static void cast_bwd(GradTensor* src, const GradTensor* dst) {
+    if (dst->grad == NULL) {
+        return;
+    }
+    bool acc = _gradt_grad_accumulate(src);
+    arena_scope temp = arena_scope_begin(_gradt_get_temp_arena());
+    _tensor_kernel_add_bwd(src->grad, acc, NULL, false, dst->grad, temp.arena);
+    arena_scope_end(temp);
+}
+
+void op_set_cast(Op* op, struct GradTensor_struct* src, struct GradTensor_struct* dst) {
+    op->type = Mono;
+    op->op.mono.src = src;
+    op->op.mono.dst = dst;
+    op->op.mono.fwd = cast_fwd;
+    op->op.mono.bwd = cast_bwd;
+    op->saved = NULL;
+    op->bwd_reads = 0;
+    op->inplace = false;
+}
+
+static void linear_fwd(const GradTensor* x, const GradTensor* w, const GradTensor* b, GradTensor* dst) {
+    _tensor_kernel_linear(gradt_value(x), gradt_value(w), b != NULL ? b->tens : NULL, false, dst->tens);
+}
+
+static void linear_bwd_impl(GradTensor* x, GradTensor* w, GradTensor* b, const GradTensor* dst, bool relu) {
+    bool x_acc = _gradt_grad_accumulate(x);
+    bool w_acc = _gradt_grad_accumulate(w);
+    bool b_acc = _gradt_grad_accumulate(b);
+    arena_scope temp = arena_scope_begin(_gradt_get_temp_arena());
+    _tensor_kernel_linear_bwd(gradt_value(x), x->grad, x_acc, gradt_value(w), w->grad, w_acc, b != NULL ? b->grad : NULL, b_acc,
+                              dst->tens, dst->grad, relu, temp.arena);
+    arena_scope_end(temp);
+}
+
+static void linear_bwd(GradTensor* x, GradTensor* w, GradTensor* b, const GradTensor* dst) {
+    linear_bwd_impl(x, w, b, dst, false);
+}
+
+static void linear_relu_fwd(const GradTensor* x, const GradTensor* w, const GradTensor* b, GradTensor* dst) {
+    _tensor_kernel_linear(gradt_value(x), gradt_value(w), b != NULL ? b->tens : NULL, true, dst->tens);
+}
+
+static void linear_relu_bwd(GradTensor* x, GradTensor* w, GradTensor* b, const GradTensor* dst) {
+    linear_bwd_impl(x, w, b, dst, true);
+}
+
+void op_set_linear(Op* op, struct GradTensor_struct* x, struct GradTensor_struct* w, struct GradTensor_struct* b, struct GradTensor_struct* dst, bool relu) {
+    op->type = Ternary;
+    op->op.tern.src1 = x;
+    op->op.tern.src2 = w;
+    op->op.tern.src3 = b;
+    op->op.tern.dst = dst;
+    op->op.tern.fwd = relu ? linear_relu_fwd : linear_fwd;
+    op->op.tern.bwd = relu ? linear_relu_bwd : linear_bwd;
+    op->saved = NULL;
+    op->bwd_reads = OP_BWD_SRC1 | OP_BWD_SRC2 | (relu ? OP_BWD_DST : 0);
+    op->inplace = false;
 }
 
 static void cse_fwd(const GradTensor* src, const GradTensor* truth, GradTensor* dst) {
-    _tensor_kernel_cross_entropy(src->tens, truth->tens, dst->tens);
+    _tensor_kernel_cross_entropy(src->tens, truth->tens, dst->tens, dst->op.saved);
 }
 
 static void cse_bwd(GradTensor* src, GradTensor* truth, const GradTensor* dst) {
-    _tensor_kernel_cross_entropy_bwd(src->tens, truth->tens, src->grad);
+    bool acc = _gradt_grad_accumulate(src);
+    _tensor_kernel_cross_entropy_bwd(src->tens, truth->tens, dst->op.saved, dst->grad, src->grad, acc);
 }
 
-void op_set_cse(Op* op, struct GradTensor_struct* src, struct GradTensor_struct* truth, struct GradTensor_struct* dst) {
+// stats: {1, 1, rows, XENT_STATS} softmax statistics written by fwd and streamed by bwd
+void op_set_cse(Op* op, struct GradTensor_struct* src, struct GradTensor_struct* truth, struct GradTensor_struct* dst, Tensor* stats) {
     op->type = Binary;
     op->op.bin.src1 = src;
     op->op.bin.src2 = truth;
     op->op.bin.dst = dst;
     op->op.bin.fwd = cse_fwd;
     op->op.bin.bwd = cse_bwd;
+    op->saved = stats;
+    op->bwd_reads = OP_BWD_SRC1 | OP_BWD_SRC2;
+    op->inplace = false;
 }
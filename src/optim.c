@@ -1,9 +1,20 @@
 #include "../include/optim.h"
 #include "../include/grad.h"
 
+#include <math.h>
+
+static Tensor* optim_state(GradTensor* gt, usize slot) {
+    if (gt->optim_state[slot] == NULL) {
+        gt->optim_state[slot] = tensor_create_like(gt->tens, _gradt_get_arena());
+        tensor_set(gt->optim_state[slot], 0.0);
+    }
+    return gt->optim_state[slot];
+}
+
 void optim_sgd(GradTensor* gt, void* sgd_config) {
     SGDConfig* config = (SGDConfig*)sgd_config;
-    _tensor_kernel_sub_scaled(gt->tens, gt->grad, config->lr, gt->tens);
+    _tensor_kernel_sub_scaled(gt->tens, gradt_grad(gt), config->lr, gt->tens);
+    _gradt_sync_bf16(gt);
 }
 
 SGDConfig optim_sgd_get_config(f32 lr) {
@@ -13,12 +24,42 @@ SGDConfig optim_sgd_get_config(f32 lr) {
 
 void optim_sgd_momentum(GradTensor* gt, void* sgd_momentum_config) {
     SGDMomentumConfig* config = (SGDMomentumConfig*)sgd_momentum_config;
-    // fuse?
-    Tensor* update = tensor_add_scaled(gt->grad, gt->prev_grad, config->mu, _gradt_get_arena());
-    _tensor_kernel_sub_scaled(gt->tens, update, config->lr, gt->tens);
+    _tensor_kernel_momentum_step(gt->tens, gradt_grad(gt), optim_state(gt, 0), config->lr, config->mu, config->nesterov, gt->tens16);
+    gt->optim_step++;
 }
 
 SGDMomentumConfig optim_sgd_momentum_get_config(f32 lr, f32 mu) {
-    SGDMomentumConfig c = { .lr = lr, .mu = mu };
+    SGDMomentumConfig c = { .lr = lr, .mu = mu, .nesterov = false };
+    return c;
+}
+
+SGDMomentumConfig optim_sgd_nesterov_get_config(f32 lr, f32 mu) {
+    SGDMomentumConfig c = { .lr = lr, .mu = mu, .nesterov = true };
+    return c;
+}
+
+void optim_adam(GradTensor* gt, void* adam_config) {
+    AdamConfig* config = (AdamConfig*)adam_config;
+    gt->optim_step++;
+    AdamStep hp = {
+        .lr = config->lr,
+        .beta1 = config->beta1,
+        .beta2 = config->beta2,
+        .eps = config->eps,
+        .l2 = config->decoupled ? 0.0f : config->weight_decay,
+        .decay = config->decoupled ? config->weight_decay : 0.0f,
+        .m_scale = 1.0f / (1.0f - powf(config->beta1, (f32)gt->optim_step)),
+        .v_scale = 1.0f / (1.0f - powf(config->beta2, (f32)gt->optim_step)),
+    };
+    _tensor_kernel_adam_step(gt->tens, gradt_grad(gt), optim_state(gt, 0), optim_state(gt, 1), &hp, gt->tens16);
+}
+
+AdamConfig optim_adam_get_config(f32 lr, f32 beta1, f32 beta2, f32 eps, f32 weight_decay) {
+    AdamConfig c = { .lr = lr, .beta1 = beta1, .beta2 = beta2, .eps = eps, .weight_decay = weight_decay, .decoupled = false };
+    return c;
+}
+
+AdamConfig optim_adamw_get_config(f32 lr, f32 beta1, f32 beta2, f32 eps, f32 weight_decay) {
+    AdamConfig c = { .lr = lr, .beta1 = beta1, .beta2 = beta2, .eps = eps, .weight_decay = weight_decay, .decoupled = true };
     return c;
 }
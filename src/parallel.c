@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+#include "../include/parallel.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#define PARALLEL_MAX_THREADS 256
+#define DEQUE_CAP 1024
+#define IDLE_SPINS 256
+// bytes zeroed per first touch task at least, 64 small pages
+#define TOUCH_GRAIN (256 * 1024)
+// address space of each thread's scratch arena, only what is used gets committed
+#define SCRATCH_RESERVE GiB(1)
+
+typedef struct {
+    parallel_for_fn fn;
+    void* ctx;
+    atomic_size_t pending; // ranges handed out and not finished yet
+} ParallelJob;
+
+typedef struct {
+    ParallelJob* job;
+    usize begin;
+    usize end;
+    usize grain;
+} ParallelTask;
+
+// owner pushes and pops at bottom (LIFO, keeps its working set hot), thieves take from top (FIFO, biggest halves)
+typedef struct {
+    pthread_mutex_t lock;
+    usize top;
+    usize bottom;
+    ParallelTask tasks[DEQUE_CAP];
+} TaskDeque;
+
+// deque 0 is shared by every thread that is not a pool worker, worker i owns deque i
+static TaskDeque deques[PARALLEL_MAX_THREADS];
+static pthread_t workers[PARALLEL_MAX_THREADS];
+static u32 n_workers = 0;
+static bool pin_workers = false;
+// parallel_for holds it shared, parallel_init / parallel_shutdown exclusively, so the pool is never
+// rebuilt under a running job. Readers are preferred (the glibc default), which nested parallel_for
+// calls on workers rely on.
+static pthread_rwlock_t pool_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static pthread_mutex_t sleep_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sleep_cond = PTHREAD_COND_INITIALIZER;
+static atomic_ulong work_epoch = 0;
+static atomic_uint sleeping = 0;
+static bool stopping = false;
+
+static _Thread_local u32 worker_id = 0;
+
+// the key's destructor releases a thread's scratch arena when the thread exits
+static _Thread_local arena_allocator* scratch = NULL;
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void deque_init(TaskDeque* d) {
+    pthread_mutex_init(&d->lock, NULL);
+    d->top = 0;
+    d->bottom = 0;
+}
+
+static bool deque_push(TaskDeque* d, const ParallelTask* t) {
+    pthread_mutex_lock(&d->lock);
+    bool ok = d->bottom - d->top < DEQUE_CAP;
+    if (ok) {
+        d->tasks[d->bottom % DEQUE_CAP] = *t;
+        d->bottom++;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return ok;
+}
+
+static bool deque_pop(TaskDeque* d, ParallelTask* t) {
+    pthread_mutex_lock(&d->lock);
+    bool ok = d->bottom > d->top;
+    if (ok) {
+        d->bottom--;
+        *t = d->tasks[d->bottom % DEQUE_CAP];
+    }
+    pthread_mutex_unlock(&d->lock);
+    return ok;
+}
+
+static bool deque_steal(TaskDeque* d, ParallelTask* t) {
+    pthread_mutex_lock(&d->lock);
+    bool ok = d->bottom > d->top;
+    if (ok) {
+        *t = d->tasks[d->top % DEQUE_CAP];
+        d->top++;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return ok;
+}
+
+static bool find_task(ParallelTask* t) {
+    if (deque_pop(&deques[worker_id], t)) {
+        return true;
+    }
+    u32 n_deques = n_workers + 1;
+    for (u32 i = 1; i < n_deques; i++) {
+        if (deque_steal(&deques[(worker_id + i) % n_deques], t)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void notify_worker() {
+    atomic_fetch_add(&work_epoch, 1);
+    if (atomic_load(&sleeping) > 0) {
+        pthread_mutex_lock(&sleep_mutex);
+        pthread_cond_signal(&sleep_cond);
+        pthread_mutex_unlock(&sleep_mutex);
+    }
+}
+
+// keeps the lower half of the range and publishes the upper halves until the rest is below 2 * grain
+static void run_task(const ParallelTask* t) {
+    ParallelJob* job = t->job;
+    usize begin = t->begin;
+    usize end = t->end;
+    while (end - begin >= 2 * t->grain) {
+        usize mid = begin + (end - begin) / 2;
+        ParallelTask half = {.job = job, .begin = mid, .end = end, .grain = t->grain};
+        atomic_fetch_add(&job->pending, 1);
+        if (!deque_push(&deques[worker_id], &half)) {
+            atomic_fetch_sub(&job->pending, 1);
+            break;
+        }
+        notify_worker();
+        end = mid;
+    }
+    job->fn(job->ctx, begin, end);
+    atomic_fetch_sub_explicit(&job->pending, 1, memory_order_release);
+}
+
+static void pin_to_core(u32 idx) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) {
+        return;
+    }
+    u32 target = idx % CPU_COUNT(&allowed);
+    for (u32 cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && target-- == 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            return;
+        }
+    }
+}
+
+static void* worker_main(void* arg) {
+    worker_id = (u32)(usize)arg;
+    if (pin_workers) {
+        pin_to_core(worker_id);
+    }
+
+    while (true) {
+        u64 epoch = atomic_load(&work_epoch);
+        ParallelTask t;
+        bool found = false;
+        for (u32 spin = 0; spin < IDLE_SPINS && !found; spin++) {
+            found = find_task(&t);
+            if (!found) {
+                __builtin_ia32_pause();
+            }
+        }
+        if (found) {
+            run_task(&t);
+            continue;
+        }
+
+        // the epoch was read before scanning, so a push that raced with the scan prevents the sleep
+        pthread_mutex_lock(&sleep_mutex);
+        atomic_fetch_add(&sleeping, 1);
+        while (!stopping && atomic_load(&work_epoch) == epoch) {
+            pthread_cond_wait(&sleep_cond, &sleep_mutex);
+        }
+        atomic_fetch_sub(&sleeping, 1);
+        bool stop = stopping;
+        pthread_mutex_unlock(&sleep_mutex);
+        if (stop) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void scratch_release(void* arena) {
+    arena_destroy(arena);
+}
+
+static void scratch_key_init() {
+    pthread_key_create(&scratch_key, scratch_release);
+}
+
+arena_allocator* parallel_scratch_arena() {
+    if (scratch == NULL) {
+        pthread_once(&scratch_once, scratch_key_init);
+        scratch = arena_create(SCRATCH_RESERVE, MiB(1), 64);
+        pthread_setspecific(scratch_key, scratch);
+    }
+    return scratch;
+}
+
+static void shutdown_locked() {
+    pthread_mutex_lock(&sleep_mutex);
+    stopping = true;
+    pthread_cond_broadcast(&sleep_cond);
+    pthread_mutex_unlock(&sleep_mutex);
+    for (u32 i = 0; i < n_workers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    n_workers = 0;
+    stopping = false;
+    if (scratch != NULL) {
+        pthread_setspecific(scratch_key, NULL);
+        arena_destroy(scratch);
+        scratch = NULL;
+    }
+}
+
+void parallel_shutdown() {
+    pthread_rwlock_wrlock(&pool_lock);
+    shutdown_locked();
+    pthread_rwlock_unlock(&pool_lock);
+}
+
+void parallel_init(u32 n_threads, bool pin_cores) {
+    n_threads = n_threads == 0 ? 1 : n_threads;
+    n_threads = n_threads > PARALLEL_MAX_THREADS ? PARALLEL_MAX_THREADS : n_threads;
+    pthread_rwlock_wrlock(&pool_lock);
+    shutdown_locked();
+
+    pin_workers = pin_cores;
+    for (u32 i = 0; i < n_threads; i++) {
+        deque_init(&deques[i]);
+    }
+    for (u32 i = 1; i < n_threads; i++) {
+        if (pthread_create(&workers[i - 1], NULL, worker_main, (void*)(usize)i) != 0) {
+            break;
+        }
+        n_workers++;
+    }
+    pthread_rwlock_unlock(&pool_lock);
+}
+
+void parallel_set_num_threads(u32 n_threads) {
+    pthread_rwlock_rdlock(&pool_lock);
+    bool pin = pin_workers;
+    pthread_rwlock_unlock(&pool_lock);
+    parallel_init(n_threads, pin);
+}
+
+u32 parallel_get_num_threads() {
+    return n_workers + 1;
+}
+
+void parallel_for(usize begin, usize end, usize grain, parallel_for_fn fn, void* ctx) {
+    if (end <= begin) {
+        return;
+    }
+    grain = grain == 0 ? 1 : grain;
+    pthread_rwlock_rdlock(&pool_lock);
+    if (n_workers == 0 || end - begin < 2 * grain) {
+        fn(ctx, begin, end);
+        pthread_rwlock_unlock(&pool_lock);
+        return;
+    }
+
+    ParallelJob job = {.fn = fn, .ctx = ctx};
+    atomic_init(&job.pending, 1);
+    ParallelTask root = {.job = &job, .begin = begin, .end = end, .grain = grain};
+    run_task(&root);
+
+    // help with whatever is queued (ours or not) until every range of this job has finished
+    while (atomic_load_explicit(&job.pending, memory_order_acquire) > 0) {
+        ParallelTask t;
+        if (find_task(&t)) {
+            run_task(&t);
+        } else {
+            sched_yield();
+        }
+    }
+    pthread_rwlock_unlock(&pool_lock);
+}
+
+static void first_touch_range(void* ctx, usize begin, usize end) {
+    memset((u8*)ctx + begin, 0, end - begin);
+}
+
+void parallel_first_touch(void* mem, usize bytes) {
+    parallel_for(0, bytes, TOUCH_GRAIN, first_touch_range, mem);
+}
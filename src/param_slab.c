@@ -0,0 +1,89 @@
+#include "../include/param_slab.h"
+
+#include <string.h>
+
+// every parameter starts on a 64 byte boundary, the padding stays 0 in values, gradients and state.
+// Parameters keep their row layout (padded rows included), grads, state and bf16 copies share it.
+#define SLAB_ALIGN 16
+
+ParamSlab param_slab_create(GradTensor** params, usize n_params) {
+    arena_allocator* arena = _gradt_get_arena();
+    ParamSlab slab = {0};
+    // the flat gradient only exists with grad enabled, without it the params are left untouched
+    if (!gradt_grad_enabled()) {
+        return slab;
+    }
+    slab.n_params = n_params;
+    slab.params = arena_alloc(arena, sizeof(GradTensor*), n_params);
+    memcpy(slab.params, params, n_params * sizeof(GradTensor*));
+
+    usize len = 0;
+    u64 step = 0;
+    for (usize i = 0; i < n_params; i++) {
+        len += (tensor_storage_len(params[i]->tens) + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+        step = params[i]->optim_step > step ? params[i]->optim_step : step;
+    }
+
+    u32 shape[4] = {1, 1, 1, len};
+    GradTensor* flat = gradt_create(shape, 4);
+    flat->optim_step = step;
+    for (usize s = 0; s < 2; s++) {
+        flat->optim_state[s] = tensor_create(shape, 4, arena);
+    }
+    Tensor* slabs[4] = {flat->tens, flat->grad, flat->optim_state[0], flat->optim_state[1]};
+    for (usize s = 0; s < 4; s++) {
+        tensor_set(slabs[s], 0.0);
+    }
+    // bf16 copies get a slab at the same offsets, so the optimizer sweep rounds them as well
+    for (usize i = 0; i < n_params && flat->tens16 == NULL; i++) {
+        if (params[i]->tens16 != NULL) {
+            flat->tens16 = tensor_create_dtype(shape, 4, TENSOR_BF16, arena);
+            memset(flat->tens16->data16, 0, len * sizeof(bf16));
+        }
+    }
+
+    usize offset = 0;
+    for (usize i = 0; i < n_params; i++) {
+        GradTensor* p = params[i];
+        usize n = tensor_storage_len(p->tens);
+        memcpy(&flat->tens->data[offset], p->tens->data, n * sizeof(f32));
+        p->tens->data = &flat->tens->data[offset];
+        if (p->tens16 != NULL) {
+            Tensor* copy = tensor_view(flat->tens16, p->tens->shape, p->tens->stride, offset, arena);
+            _tensor_kernel_copy(p->tens16, copy);
+            p->tens16 = copy;
+        }
+        // existing headers are repointed at the slab, missing ones are created as views into it
+        if (p->grad != NULL) {
+            memcpy(&flat->grad->data[offset], p->grad->data, n * sizeof(f32));
+            p->grad->data = &flat->grad->data[offset];
+        } else {
+            p->grad = tensor_view(flat->grad, p->tens->shape, p->tens->stride, offset, arena);
+        }
+        for (usize s = 0; s < 2; s++) {
+            if (p->optim_state[s] != NULL) {
+                memcpy(&flat->optim_state[s]->data[offset], p->optim_state[s]->data, n * sizeof(f32));
+                p->optim_state[s]->data = &flat->optim_state[s]->data[offset];
+            } else {
+                p->optim_state[s] = tensor_view(flat->optim_state[s], p->tens->shape, p->tens->stride, offset, arena);
+            }
+        }
+        p->optimize = false;
+        offset += (n + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+    }
+
+    slab.flat = flat;
+    return slab;
+}
+
+void param_slab_step(ParamSlab* slab, Optimizer optim, void* optim_config) {
+    if (slab->flat == NULL) {
+        return;
+    }
+    // zeroes the grads of params the last pass didn't reach, the flat grad is then current as a whole
+    for (usize i = 0; i < slab->n_params; i++) {
+        gradt_grad(slab->params[i]);
+    }
+    _gradt_grad_accumulate(slab->flat);
+    optim(slab->flat, optim_config);
+}
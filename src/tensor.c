@@ -5,28 +5,225 @@
 #include <string.h>
 #include <stdbool.h>
 
+// rows narrower than a cache line are left unpadded
+#define PAD_MIN_COLS (TENSOR_ALIGN / sizeof(f32))
+
+// off unless asked for, see tensor_set_row_padding
+static bool pad_rows = false;
+
+bool tensor_set_row_padding(bool enabled) {
+    bool prev = pad_rows;
+    pad_rows = enabled;
+    return prev;
+}
+
+u32 tensor_padded_ld(u32 cols) {
+    const u32 line = TENSOR_ALIGN / sizeof(f32);
+    if (cols < PAD_MIN_COLS) {
+        return cols;
+    }
+    u32 ld = (cols + line - 1) / line * line;
+    if ((ld * sizeof(f32)) % 4096 == 0) { // rows a multiple of 4 KiB apart map to the same L1 sets
+        ld += line;
+    }
+    return ld;
+}
+
+static Tensor* create_ld(const u32* shape, usize shape_len, u32 ld, TensorDtype dtype, arena_allocator* arena);
+
 Tensor* tensor_create(const u32* shape, usize shape_len, arena_allocator* arena) {
+    if (shape_len == 0) {
+        return tensor_create_ld(shape, shape_len, 1, arena);
+    }
+    u32 cols = shape[shape_len - 1];
+    return tensor_create_ld(shape, shape_len, pad_rows ? tensor_padded_ld(cols) : cols, arena);
+}
+
+Tensor* tensor_create_dtype(const u32* shape, usize shape_len, TensorDtype dtype, arena_allocator* arena) {
+    if (dtype == TENSOR_F32) {
+        return tensor_create(shape, shape_len, arena);
+    }
+    return create_ld(shape, shape_len, shape_len > 0 ? shape[shape_len - 1] : 1, dtype, arena);
+}
+
+Tensor* tensor_create_ld(const u32* shape, usize shape_len, u32 ld, arena_allocator* arena) {
+    return create_ld(shape, shape_len, ld, TENSOR_F32, arena);
+}
+
+static Tensor* create_ld(const u32* shape, usize shape_len, u32 ld, TensorDtype dtype, arena_allocator* arena) {
     if (shape_len > 4) {
         return NULL;
     }
     Tensor* t = arena_alloc(arena, sizeof(Tensor), 1);
-    u32 curr_stride = 1;
-    for (usize i = 0; i < shape_len; i++) {
-        u32 dim = shape[shape_len - i - 1];
-        t->shape[3-i] = dim;
-        t->stride[3-i] = dim == 1 ? 0 : curr_stride;
-        curr_stride *= dim;
-    }
-
     for (usize i = shape_len; i < 4; i++) {
         t->shape[3-i] = 1;
-        t->stride[3-i] = 0;
     }
-    t->data_len = curr_stride;
-    t->data = arena_alloc(arena, sizeof(f32), curr_stride);
+    memcpy(&t->shape[4 - shape_len], shape, shape_len * sizeof(u32));
+    if (ld < t->shape[3]) {
+        ld = t->shape[3];
+    }
+
+    usize rows = (usize)t->shape[0] * t->shape[1] * t->shape[2];
+    t->stride[3] = t->shape[3] == 1 ? 0 : 1;
+    u32 curr_stride = ld;
+    for (i32 i = 2; i >= 0; i--) {
+        t->stride[i] = t->shape[i] == 1 ? 0 : curr_stride;
+        curr_stride *= t->shape[i];
+    }
+    t->data_len = rows * t->shape[3];
+    t->dtype = dtype;
+    if (dtype == TENSOR_BF16) {
+        t->data = NULL;
+        t->data16 = arena_alloc_aligned(arena, sizeof(bf16), rows * ld, TENSOR_ALIGN);
+        return t;
+    }
+    t->data16 = NULL;
+    t->data = arena_alloc_aligned(arena, sizeof(f32), rows * ld, TENSOR_ALIGN);
+    // kept at zero, so whole-buffer updates (param slabs) leave the padding alone
+    for (usize r = 0; r < rows && ld > t->shape[3]; r++) {
+        memset(&t->data[r * ld + t->shape[3]], 0, (ld - t->shape[3]) * sizeof(f32));
+    }
     return t;
 }
 
+Tensor* tensor_create_like(const Tensor* t, arena_allocator* arena) {
+    u32 ld = tensor_row_ld(t);
+    return tensor_create_ld(t->shape, 4, ld != 0 ? ld : t->shape[3], arena);
+}
+
+Tensor* tensor_to_dtype(const Tensor* t, TensorDtype dtype, arena_allocator* arena) {
+    Tensor* res = tensor_create_dtype(t->shape, 4, dtype, arena);
+    _tensor_kernel_copy(t, res);
+    return res;
+}
+
+usize tensor_elem_size(const Tensor* t) {
+    return t->dtype == TENSOR_BF16 ? sizeof(bf16) : sizeof(f32);
+}
+
+Tensor* tensor_view(const Tensor* t, const u32* shape, const u32* stride, usize offset, arena_allocator* arena) {
+    Tensor* v = arena_alloc(arena, sizeof(Tensor), 1);
+    v->data_len = 1;
+    for (usize i = 0; i < 4; i++) {
+        v->shape[i] = shape[i];
+        v->stride[i] = shape[i] == 1 ? 0 : stride[i];
+        v->data_len *= shape[i];
+    }
+    v->dtype = t->dtype;
+    v->data = t->data != NULL ? &t->data[offset] : NULL;
+    v->data16 = t->data16 != NULL ? &t->data16[offset] : NULL;
+    return v;
+}
+
+Tensor* tensor_slice(const Tensor* t, usize dim, u32 begin, u32 end, arena_allocator* arena) {
+    if (dim > 3 || begin >= end || end > t->shape[dim]) {
+        return NULL;
+    }
+    u32 shape[4];
+    memcpy(shape, t->shape, sizeof(shape));
+    shape[dim] = end - begin;
+    return tensor_view(t, shape, t->stride, (usize)begin * t->stride[dim], arena);
+}
+
+bool tensor_is_contiguous(const Tensor* t) {
+    usize expect = 1;
+    for (i32 i = 3; i >= 0; i--) {
+        if (t->shape[i] == 1) {
+            continue;
+        }
+        if (t->stride[i] != expect) {
+            return false;
+        }
+        expect *= t->shape[i];
+    }
+    return true;
+}
+
+u32 tensor_row_ld(const Tensor* t) {
+    if (t->shape[3] > 1 && t->stride[3] != 1) {
+        return 0;
+    }
+    // the innermost row dim that isn't size 1 gives the candidate, every other one has to agree
+    u32 ld = t->shape[3];
+    usize span = 1;
+    bool found = false;
+    for (i32 i = 2; i >= 0; i--) {
+        if (t->shape[i] == 1) {
+            continue;
+        }
+        if (!found) {
+            if (t->stride[i] < t->shape[3]) {
+                return 0;
+            }
+            ld = t->stride[i];
+            found = true;
+        } else if (t->stride[i] != span * ld) {
+            return 0;
+        }
+        span *= t->shape[i];
+    }
+    return ld;
+}
+
+usize tensor_storage_len(const Tensor* t) {
+    if (t->data_len == 0) {
+        return 0;
+    }
+    usize len = 1;
+    for (usize i = 0; i < 4; i++) {
+        len += (usize)(t->shape[i] - 1) * t->stride[i];
+    }
+    return len;
+}
+
+Tensor* tensor_reshape(const Tensor* t, const u32* shape, usize shape_len, arena_allocator* arena) {
+    if (shape_len > 4 || !tensor_is_contiguous(t)) {
+        return NULL;
+    }
+    u32 full[4] = {1, 1, 1, 1};
+    memcpy(&full[4 - shape_len], shape, shape_len * sizeof(u32));
+    u32 stride[4];
+    usize len = 1;
+    for (i32 i = 3; i >= 0; i--) {
+        stride[i] = len;
+        len *= full[i];
+    }
+    if (len != t->data_len) {
+        return NULL;
+    }
+    return tensor_view(t, full, stride, 0, arena);
+}
+
+Tensor* tensor_transpose(const Tensor* t, arena_allocator* arena) {
+    u32 shape[4] = {t->shape[0], t->shape[1], t->shape[3], t->shape[2]};
+    u32 stride[4] = {t->stride[0], t->stride[1], t->stride[3], t->stride[2]};
+    return tensor_view(t, shape, stride, 0, arena);
+}
+
+Tensor* tensor_contiguous(const Tensor* t, arena_allocator* arena) {
+    if (tensor_is_contiguous(t)) {
+        return (Tensor*)t;
+    }
+    Tensor* res = create_ld(t->shape, 4, t->shape[3], t->dtype, arena);
+    _tensor_kernel_copy(t, res);
+    return res;
+}
+
+// element offset of row r, rows being the (dims 0 - 2) index space walked in row-major order
+static usize row_offset(const Tensor* t, usize r) {
+    usize i2 = r % t->shape[2];
+    r /= t->shape[2];
+    return (r / t->shape[1]) * t->stride[0] + (r % t->shape[1]) * t->stride[1] + i2 * t->stride[2];
+}
+
+static inline void set_elem(Tensor* t, usize i, f32 v) {
+    if (t->dtype == TENSOR_BF16) {
+        t->data16[i] = bf16_from_f32(v);
+    } else {
+        t->data[i] = v;
+    }
+}
+
 void tensor_print(const Tensor* t, bool print_data) {
     printf("Shape: [");
     for (int i = 0; i < 4; i++) {
@@ -40,27 +237,36 @@ void tensor_print(const Tensor* t, bool print_data) {
     printf(" ]\n");
     if (print_data) {
         printf("Data: [");
-        usize data_len = t->data_len;
-        for (usize i = 0; i < data_len; i++) {
-            printf(" %f", t->data[i]);
-            if ((i > 0 && (i+1) % t->shape[3] == 0) || t->shape[3] == 1) {
-                printf(" ;");
+        usize rows = (usize)t->shape[0] * t->shape[1] * t->shape[2];
+        for (usize r = 0; r < rows; r++) {
+            usize base = row_offset(t, r);
+            for (usize j = 0; j < t->shape[3]; j++) {
+                usize i = base + j * t->stride[3];
+                printf(" %f", t->dtype == TENSOR_BF16 ? bf16_to_f32(t->data16[i]) : t->data[i]);
             }
+            printf(" ;");
         }
         printf(" ]\n");
     }
 }
 
 void tensor_randomize(Tensor* t, f32 min, f32 max) {
-    usize data_len = t->data_len;
-    for (usize i = 0; i < data_len; i++) {
-        t->data[i] = random_f32(min, max);
-    }   
+    usize rows = (usize)t->shape[0] * t->shape[1] * t->shape[2];
+    for (usize r = 0; r < rows; r++) {
+        usize base = row_offset(t, r);
+        for (usize j = 0; j < t->shape[3]; j++) {
+            set_elem(t, base + j * t->stride[3], random_f32(min, max));
+        }
+    }
 }
 
 void tensor_set(Tensor* t, f32 v) {
-    for (usize i = 0; i < t->data_len; i++) {
-        t->data[i] = v;
+    usize rows = (usize)t->shape[0] * t->shape[1] * t->shape[2];
+    for (usize r = 0; r < rows; r++) {
+        usize base = row_offset(t, r);
+        for (usize j = 0; j < t->shape[3]; j++) {
+            set_elem(t, base + j * t->stride[3], v);
+        }
     }
 }
 
@@ -78,7 +284,7 @@ Tensor* tensor_add(const Tensor* a, const Tensor* b, arena_allocator* arena) {
         }
     }
 
-    Tensor* result = tensor_create(target_shape, 4, arena);
+    Tensor* result = tensor_create_dtype(target_shape, 4, a->dtype, arena);
     _tensor_kernel_add(a, b, result);
     return result;
 }
@@ -103,7 +309,7 @@ Tensor* tensor_mul(const Tensor* a, const Tensor* b, arena_allocator* arena) {
 
     target_shape[2] = a->shape[2];
     target_shape[3] = b->shape[3];
-    Tensor* result = tensor_create(target_shape, 4, arena);
+    Tensor* result = tensor_create_dtype(target_shape, 4, a->dtype, arena);
     _tensor_kernel_mul(a, b, result);
     return result;
 }
@@ -129,7 +335,7 @@ Tensor* tensor_mul_tr(const Tensor* a, const Tensor* b, bool at, bool bt, arena_
         }
         target_shape[2] = a->shape[3];
         target_shape[3] = b->shape[3];
-        result = tensor_create(target_shape, 4, arena);
+        result = tensor_create_dtype(target_shape, 4, a->dtype, arena);
         _tensor_kernel_mul_at(a, b, result);
     } else if (!at && bt) {
         if (a->shape[3] != b->shape[3]) {
@@ -137,7 +343,7 @@ Tensor* tensor_mul_tr(const Tensor* a, const Tensor* b, bool at, bool bt, arena_
         } 
         target_shape[2] = a->shape[2];
         target_shape[3] = b->shape[2];
-        result = tensor_create(target_shape, 4, arena);
+        result = tensor_create_dtype(target_shape, 4, a->dtype, arena);
         _tensor_kernel_mul_bt(a, b, result);
     } else if (at && bt) {
         if (a->shape[2] != b->shape[3]) {
@@ -145,7 +351,7 @@ Tensor* tensor_mul_tr(const Tensor* a, const Tensor* b, bool at, bool bt, arena_
         }
         target_shape[2] = a->shape[3];
         target_shape[3] = b->shape[2];
-        result = tensor_create(target_shape, 4, arena);
+        result = tensor_create_dtype(target_shape, 4, a->dtype, arena);
         _tensor_kernel_mul_atbt(a, b, result);
     } else {
         if (a->shape[3] != b->shape[2]) {
@@ -153,12 +359,40 @@ Tensor* tensor_mul_tr(const Tensor* a, const Tensor* b, bool at, bool bt, arena_
         }
         target_shape[2] = a->shape[2];
         target_shape[3] = b->shape[3];
-        result = tensor_create(target_shape, 4, arena);
+        result = tensor_create_dtype(target_shape, 4, a->dtype, arena);
         _tensor_kernel_mul(a, b, result);
     }
     return result;
 }
 
+Tensor* tensor_linear(const Tensor* x, const Tensor* w, const Tensor* bias, bool relu, arena_allocator* arena) {
+    // the epilogue reads the bias as one plain f32 row
+    if (bias != NULL && (bias->dtype != TENSOR_F32 || bias->data_len != w->shape[3] || bias->shape[3] != w->shape[3] ||
+                         (bias->shape[3] > 1 && bias->stride[3] != 1))) {
+        return NULL;
+    }
+
+    u32 target_shape[4];
+    for (int i = 0; i < 2; i++) {
+        if (x->shape[i] == w->shape[i] || w->shape[i] == 1) {
+            target_shape[i] = x->shape[i];
+        } else if (x->shape[i] == 1) {
+            target_shape[i] = w->shape[i];
+        } else {
+            return NULL;
+        }
+    }
+    if (x->shape[3] != w->shape[2]) {
+        return NULL;
+    }
+    target_shape[2] = x->shape[2];
+    target_shape[3] = w->shape[3];
+
+    Tensor* result = tensor_create_dtype(target_shape, 4, x->dtype, arena);
+    _tensor_kernel_linear(x, w, bias, relu, result);
+    return result;
+}
+
 Tensor* tensor_reduce_add(const Tensor* src, usize dim, arena_allocator* arena) {
     if (dim > 3) {
         return NULL;
@@ -168,12 +402,21 @@ Tensor* tensor_reduce_add(const Tensor* src, usize dim, arena_allocator* arena)
     memcpy(res_shape, src->shape, 4 * sizeof(u32));
     res_shape[dim] = 1;
     Tensor* res = tensor_create(res_shape, 4, arena);
-    _tensor_kernel_reduce_add(src, res, dim);
+    // padded rows are summed in place, other views are packed first; the kernel writes packed results
+    Tensor* dst = tensor_is_contiguous(res) ? res : tensor_create_ld(res_shape, 4, res_shape[3], arena);
+    _tensor_kernel_reduce_add(dim >= 2 && tensor_row_ld(src) != 0 ? src : tensor_contiguous(src, arena), dst, dim, arena);
+    if (dst != res) {
+        _tensor_kernel_copy(dst, res);
+    }
     return res;
 }
 
-Tensor* tensor_cross_entropy(const Tensor* src, const Tensor* truth, arena_allocator* arena) {
-    if (src->shape[3] != truth->shape[3]) {
+Tensor* tensor_cross_entropy(const Tensor* src, const Tensor* truth, Tensor** stats_out, arena_allocator* arena) {
+    if (src->dtype != TENSOR_F32 || truth->dtype != TENSOR_F32) {
+        return NULL;
+    }
+
+    if (src->shape[3] != truth->shape[3] || src->shape[2] != truth->shape[2]) {
         return NULL;
     }
 
@@ -184,14 +427,31 @@ Tensor* tensor_cross_entropy(const Tensor* src, const Tensor* truth, arena_alloc
     if (src->shape[0] != 1 || src->shape[1] != 1) { // src->shape[2] can be != 1 for batches
         return NULL;
     }
+
+    if (src->shape[3] > 1 && (src->stride[3] != 1 || truth->stride[3] != 1)) { // rows are streamed
+        return NULL;
+    }
     
     u32 shape[4] = {1, 1, 1, 1};
+    u32 stats_shape[4] = {1, 1, src->shape[2], XENT_STATS};
     Tensor* t = tensor_create(shape, 4, arena);
-    _tensor_kernel_cross_entropy(src, truth, t);
+    Tensor* stats = tensor_create(stats_shape, 4, arena);
+    _tensor_kernel_cross_entropy(src, truth, t, stats);
+    if (stats_out != NULL) {
+        *stats_out = stats;
+    }
     return t;
 }
 
+// the flat kernels walk rows, views without evenly spaced ones (transposes) are packed first
+static const Tensor* with_rows(const Tensor* t, arena_allocator* arena) {
+    return tensor_row_ld(t) != 0 ? t : tensor_contiguous(t, arena);
+}
+
 Tensor* tensor_sub_scaled(const Tensor* a, const Tensor* b, f32 alpha, arena_allocator* arena) {
+    if (a->dtype != TENSOR_F32 || b->dtype != TENSOR_F32) {
+        return NULL;
+    }
     for (usize i = 0; i <  4; i++) {
         if (a->shape[i] != b->shape[i]) {
             return NULL;
@@ -199,11 +459,14 @@ Tensor* tensor_sub_scaled(const Tensor* a, const Tensor* b, f32 alpha, arena_all
     }
 
     Tensor* result = tensor_create(a->shape, 4, arena);
-    _tensor_kernel_sub_scaled(a, b, alpha, result);
+    _tensor_kernel_sub_scaled(with_rows(a, arena), with_rows(b, arena), alpha, result);
     return result;
 }
 
 Tensor* tensor_add_scaled(const Tensor* a, const Tensor* b, f32 alpha, arena_allocator* arena) {
+    if (a->dtype != TENSOR_F32 || b->dtype != TENSOR_F32) {
+        return NULL;
+    }
     for (usize i = 0; i <  4; i++) {
         if (a->shape[i] != b->shape[i]) {
             return NULL;
@@ -211,6 +474,6 @@ Tensor* tensor_add_scaled(const Tensor* a, const Tensor* b, f32 alpha, arena_all
     }
 
     Tensor* result = tensor_create(a->shape, 4, arena);
-    _tensor_kernel_add_scaled(a, b, alpha, result);
+    _tensor_kernel_add_scaled(with_rows(a, arena), with_rows(b, arena), alpha, result);
     return result;
 }
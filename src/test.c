@@ -5,10 +5,21 @@
 #include "../include/utils.h"
 #include "../include/optim.h"
 #include "../include/nn.h"
+#include "../include/parallel.h"
+#include "../include/cpu_kernels.h"
+#include "../include/param_slab.h"
+#include "../include/mem_plan.h"
 
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 
 static void ref_matmul(const f32* a, const f32* b, f32* res,
                        u32 m, u32 k, u32 n, bool at, bool bt) {
@@ -67,6 +78,117 @@ void test_add(u32 rows, u32 cols) {
     arena_destroy(arena);
 }
 
+static bool run_add_broadcast(const char* label, u32 rows, u32 cols, u32 b_rows, u32 b_cols, arena_allocator* arena) {
+    u32 a_shape[] = {1, 1, rows, cols};
+    u32 b_shape[] = {1, 1, b_rows, b_cols};
+    Tensor* a = tensor_create(a_shape, 4, arena);
+    Tensor* b = tensor_create(b_shape, 4, arena);
+    tensor_randomize(a, 0.0f, 1.0f);
+    tensor_randomize(b, 0.0f, 1.0f);
+
+    double start = perf_counter_ns();
+    Tensor* c = tensor_add(a, b, arena);
+    double elapsed_ms = (perf_counter_ns() - start) / 1e6;
+
+    bool ok = true;
+    for (u32 i = 0; i < rows && ok; i++) {
+        for (u32 j = 0; j < cols; j++) {
+            f32 expect = a->data[i * cols + j] + b->data[(b_rows == 1 ? 0 : i) * b_cols + (b_cols == 1 ? 0 : j)];
+            if (fabsf(c->data[i * cols + j] - expect) > 1e-6f) {
+                printf("  FAIL %s at (%u, %u): got %f, expected %f\n", label, i, j, c->data[i * cols + j], expect);
+                ok = false;
+                break;
+            }
+        }
+    }
+
+    printf("  %s  %-8s %.3f ms\n", ok ? "PASS" : "FAIL", label, elapsed_ms);
+    return ok;
+}
+
+// bias-style row, per-row column and scalar broadcasts of b over a [rows x cols] a
+void test_add_broadcast(u32 rows, u32 cols) {
+    printf("test_add_broadcast [%u x %u]\n", rows, cols);
+
+    arena_allocator* arena = arena_create(GiB(1), MiB(1), 8);
+
+    run_add_broadcast("row", rows, cols, 1, cols, arena);
+    run_add_broadcast("column", rows, cols, rows, 1, arena);
+    run_add_broadcast("scalar", rows, cols, 1, 1, arena);
+
+    arena_destroy(arena);
+}
+
+// minibatch windows, reshapes and transposes as views: results must match packed copies exactly
+void test_views(u32 samples, u32 features, u32 batch) {
+    printf("test_views [%u x %u] dataset, batch %u\n", samples, features, batch);
+
+    arena_allocator* arena = arena_create(GiB(1), MiB(1), 8);
+    u32 data_shape[4] = {1, 1, samples, features};
+    u32 w_shape[4] = {1, 1, features, 64};
+    Tensor* data = tensor_create(data_shape, 4, arena);
+    Tensor* w = tensor_create(w_shape, 4, arena);
+    tensor_randomize(data, -1.0f, 1.0f);
+    tensor_randomize(w, -1.0f, 1.0f);
+    bool ok = true;
+
+    // windows vs memcpy'd minibatches through a matmul and a cross entropy
+    u32 batch_shape[4] = {1, 1, batch, features};
+    Tensor* copy = tensor_create(batch_shape, 4, arena);
+    double view_ms = 0.0, copy_ms = 0.0;
+    for (u32 b0 = 0; b0 + batch <= samples && ok; b0 += batch) {
+        double start = perf_counter_ns();
+        Tensor* window = tensor_slice(data, 2, b0, b0 + batch, arena);
+        view_ms += (perf_counter_ns() - start) / 1e6;
+        start = perf_counter_ns();
+        memcpy(copy->data, &data->data[(usize)b0 * features], copy->data_len * sizeof(f32));
+        copy_ms += (perf_counter_ns() - start) / 1e6;
+
+        Tensor* by_view = tensor_mul(window, w, arena);
+        Tensor* by_copy = tensor_mul(copy, w, arena);
+        ok = window->data == &data->data[(usize)b0 * features] && verify_data(by_view->data, by_copy->data, batch, 64, 0.0f);
+        Tensor* xent_view = tensor_cross_entropy(window, copy, NULL, arena);
+        Tensor* xent_copy = tensor_cross_entropy(copy, copy, NULL, arena);
+        ok = ok && xent_view->data[0] == xent_copy->data[0];
+    }
+
+    // a reshape shares the data, a transposed operand runs as the _at / _bt matmul
+    u32 flat_shape[2] = {samples / 2, 2 * features};
+    Tensor* flat = tensor_reshape(data, flat_shape, 2, arena);
+    ok = ok && flat != NULL && flat->data == data->data && flat->shape[2] == samples / 2;
+    Tensor* data_t = tensor_transpose(data, arena);
+    Tensor* w_t = tensor_transpose(w, arena);
+    u32 at_shape[4] = {1, 1, features, features};
+    u32 bt_shape[4] = {1, 1, samples, 64};
+    Tensor* at_view = tensor_create(at_shape, 4, arena);
+    Tensor* at_ref = tensor_create(at_shape, 4, arena);
+    Tensor* bt_view = tensor_create(bt_shape, 4, arena);
+    Tensor* bt_ref = tensor_create(bt_shape, 4, arena);
+    _tensor_kernel_mul(data_t, data, at_view);
+    _tensor_kernel_mul_at(data, data, at_ref);
+    Tensor* w_tt = tensor_contiguous(w_t, arena);
+    _tensor_kernel_mul(data, tensor_transpose(w_tt, arena), bt_view);
+    _tensor_kernel_mul_bt(data, w_tt, bt_ref);
+    ok = ok && verify_data(at_view->data, at_ref->data, features, features, 0.0f);
+    ok = ok && verify_data(bt_view->data, bt_ref->data, samples, 64, 0.0f);
+
+    // elementwise ops on a transposed view
+    u32 t_shape[4] = {1, 1, features, samples};
+    Tensor* relu_view = tensor_create(t_shape, 4, arena);
+    Tensor* relu_ref = tensor_create(t_shape, 4, arena);
+    _tensor_kernel_relu(data_t, relu_view);
+    _tensor_kernel_relu(tensor_contiguous(data_t, arena), relu_ref);
+    ok = ok && verify_data(relu_view->data, relu_ref->data, features, samples, 0.0f);
+    Tensor* scaled_view = tensor_add_scaled(data_t, data_t, 0.5f, arena);
+    Tensor* scaled_ref = tensor_add_scaled(tensor_contiguous(data_t, arena), tensor_contiguous(data_t, arena), 0.5f, arena);
+    ok = ok && verify_data(scaled_view->data, scaled_ref->data, features, samples, 0.0f);
+    ok = ok && gradt_create_from_tens(data_t) == NULL;
+
+    printf("  %s  %u windows: views %.3f ms, memcpy %.3f ms\n", ok ? "PASS" : "FAIL", samples / batch, view_ms, copy_ms);
+
+    arena_destroy(arena);
+}
+
 static void run_mul_variant(const char* label, u32 m, u32 k, u32 n, bool at, bool bt,
                             arena_allocator* arena) {
     u32 a_rows = at ? k : m;
@@ -101,6 +223,149 @@ void test_mul(u32 m, u32 k, u32 n) {
     run_mul_variant("A*B",  m, k, n, false, false, arena_create(GiB(1), MiB(1), 8));
     run_mul_variant("At*B", m, k, n, true,  false, arena_create(GiB(1), MiB(1), 8));
     run_mul_variant("A*Bt", m, k, n, false, true,  arena_create(GiB(1), MiB(1), 8));
+    run_mul_variant("At*Bt", m, k, n, true, true,  arena_create(GiB(1), MiB(1), 8));
+}
+
+void test_mul_parallel(u32 m, u32 k, u32 n, u32 n_threads) {
+    printf("test_mul_parallel [2 x 3 x %u x %u] * [1 x 3 x %u x %u] threads=%u\n", m, k, k, n, n_threads);
+
+    arena_allocator* arena = arena_create(GiB(1), MiB(1), 8);
+
+    const char* labels[] = {"A*B", "At*B", "A*Bt", "At*Bt"};
+    bool ats[] = {false, true, false, true};
+    bool bts[] = {false, false, true, true};
+    for (int v = 0; v < 4; v++) {
+        u32 a_shape[] = {2, 3, ats[v] ? k : m, ats[v] ? m : k};
+        u32 b_shape[] = {1, 3, bts[v] ? n : k, bts[v] ? k : n};
+        Tensor* a = tensor_create(a_shape, 4, arena);
+        Tensor* b = tensor_create(b_shape, 4, arena);
+        tensor_randomize(a, 0.0f, 1.0f);
+        tensor_randomize(b, 0.0f, 1.0f);
+
+        parallel_set_num_threads(1);
+        double start = perf_counter_ns();
+        Tensor* serial = tensor_mul_tr(a, b, ats[v], bts[v], arena);
+        double serial_ms = (perf_counter_ns() - start) / 1e6;
+
+        parallel_set_num_threads(n_threads);
+        start = perf_counter_ns();
+        Tensor* par = tensor_mul_tr(a, b, ats[v], bts[v], arena);
+        double par_ms = (perf_counter_ns() - start) / 1e6;
+
+        // the split only changes which thread owns a tile, never the summation order
+        bool ok = memcmp(serial->data, par->data, serial->data_len * sizeof(f32)) == 0;
+        // the packed panels go back to the scratch arena after every gemm
+        ok = ok && arena_get_stats(parallel_scratch_arena()).used == 0;
+        printf("  %-12s %s  serial %.3f ms, parallel %.3f ms\n", labels[v], ok ? "PASS" : "FAIL", serial_ms, par_ms);
+    }
+
+    parallel_set_num_threads(1);
+    arena_destroy(arena);
+}
+
+static void noop_range(void* ctx, usize begin, usize end) {
+    atomic_fetch_add((atomic_size_t*)ctx, end - begin);
+}
+
+typedef struct {
+    u32 iters;
+    atomic_size_t visited;
+} DispatchJob;
+
+static void* dispatch_job_run(void* arg) {
+    DispatchJob* job = arg;
+    for (u32 i = 0; i < job->iters; i++) {
+        parallel_for(0, 4096, 1, noop_range, &job->visited);
+    }
+    return NULL;
+}
+
+void bench_parallel_dispatch(u32 n_threads, u32 iters) {
+    printf("bench_parallel_dispatch threads=%u x%u\n", n_threads, iters);
+
+    parallel_init(n_threads, false);
+    atomic_size_t visited = 0;
+    usize ranges[] = {1, 64, 4096};
+    bool ok = true;
+    for (int r = 0; r < 3; r++) {
+        atomic_store(&visited, 0);
+        double start = perf_counter_ns();
+        for (u32 i = 0; i < iters; i++) {
+            parallel_for(0, ranges[r], 1, noop_range, &visited);
+        }
+        double elapsed_us = (perf_counter_ns() - start) / 1e3 / iters;
+        ok = ok && atomic_load(&visited) == ranges[r] * iters;
+        printf("  range %-5zu %.3f us / parallel_for\n", ranges[r], elapsed_us);
+    }
+
+    // another thread keeps submitting while this one resizes the pool, every range still runs once
+    DispatchJob job = {.iters = iters};
+    atomic_init(&job.visited, 0);
+    pthread_t submitter;
+    pthread_create(&submitter, NULL, dispatch_job_run, &job);
+    for (u32 i = 0; i < 8; i++) {
+        parallel_set_num_threads(i % 2 == 0 ? 1 : n_threads);
+    }
+    pthread_join(submitter, NULL);
+    ok = ok && atomic_load(&job.visited) == (usize)4096 * iters;
+    printf("  %s\n", ok ? "PASS" : "FAIL");
+
+    parallel_set_num_threads(1);
+}
+
+void bench_mul(u32 m, u32 k, u32 n, u32 iters) {
+    printf("bench_mul [%u x %u] * [%u x %u] x%u\n", m, k, k, n, iters);
+
+    arena_allocator* arena = arena_create(GiB(4), MiB(1), 8);
+
+    const char* labels[] = {"A*B", "At*B", "A*Bt", "At*Bt"};
+    void (*kernels[])(const Tensor*, const Tensor*, Tensor*) = {_tensor_kernel_mul, _tensor_kernel_mul_at, _tensor_kernel_mul_bt, _tensor_kernel_mul_atbt};
+    bool ats[] = {false, true, false, true};
+    bool bts[] = {false, false, true, true};
+    for (int v = 0; v < 4; v++) {
+        u32 a_shape[] = {1, 1, ats[v] ? k : m, ats[v] ? m : k};
+        u32 b_shape[] = {1, 1, bts[v] ? n : k, bts[v] ? k : n};
+        u32 c_shape[] = {1, 1, m, n};
+        Tensor* a = tensor_create(a_shape, 4, arena);
+        Tensor* b = tensor_create(b_shape, 4, arena);
+        Tensor* c = tensor_create(c_shape, 4, arena);
+        tensor_randomize(a, 0.0f, 1.0f);
+        tensor_randomize(b, 0.0f, 1.0f);
+
+        kernels[v](a, b, c); // warmup
+        double start = perf_counter_ns();
+        for (u32 i = 0; i < iters; i++) {
+            kernels[v](a, b, c);
+        }
+        double elapsed_ms = (perf_counter_ns() - start) / 1e6 / iters;
+        double gflops = 2.0 * m * k * n / (elapsed_ms * 1e6);
+
+        printf("  %-12s %.3f ms  %.1f GFLOP/s\n", labels[v], elapsed_ms, gflops);
+    }
+
+    arena_destroy(arena);
+}
+
+void test_isa_variants() {
+    CpuIsa host_isa = cpu_get_isa();
+    for (CpuIsa isa = CPU_ISA_SCALAR; isa < CPU_ISA_COUNT; isa++) {
+        if (!cpu_set_isa(isa)) {
+            printf("test_isa_variants isa=%s: not supported by this host, skipped\n", cpu_isa_name(isa));
+            continue;
+        }
+        printf("test_isa_variants isa=%s\n", cpu_isa_name(isa));
+        test_add(67, 45);
+        test_add_broadcast(67, 45);
+        test_reduce_add(67, 45, 2);
+        test_reduce_add(67, 45, 3);
+        test_cross_entropy(5, 1003);
+        test_linear(37, 53, 29);
+        test_optimizers(1003);
+        test_mul(67, 781, 45);
+        test_grad_relu();
+        test_bf16_kernels(37, 531, 45);
+    }
+    cpu_set_isa(host_isa);
 }
 
 void test_reduce_add(u32 rows, u32 cols, u32 dim) {
@@ -125,7 +390,7 @@ void test_reduce_add(u32 rows, u32 cols, u32 dim) {
             usize idx = (dim == 2) ? (j * cols + i) : (i * cols + j);
             acc += t->data[idx];
         }
-        if (fabsf(red->data[i] - acc) > 1e-2f) {
+        if (fabsf(red->data[i] - acc) > 1e-2f + 1e-5f * fabsf(acc)) {
             printf("  FAIL at %u: got %f, expected %f\n", i, red->data[i], acc);
             ok = false;
         }
@@ -136,6 +401,935 @@ void test_reduce_add(u32 rows, u32 cols, u32 dim) {
     arena_destroy(arena);
 }
 
+// every reduction dim of a 4-D tensor against a scalar reference, and serial vs threaded bit equality
+void test_reduce_add_parallel(u32 n_threads) {
+    u32 shape[] = {3, 5, 700, 37};
+    printf("test_reduce_add_parallel [%u x %u x %u x %u] threads=%u\n", shape[0], shape[1], shape[2], shape[3], n_threads);
+
+    arena_allocator* arena = arena_create(GiB(1), MiB(1), 8);
+    Tensor* t = tensor_create(shape, 4, arena);
+    tensor_randomize(t, -1.0f, 1.0f);
+
+    for (usize dim = 0; dim < 4; dim++) {
+        parallel_set_num_threads(1);
+        double start = perf_counter_ns();
+        Tensor* serial = tensor_reduce_add(t, dim, arena);
+        double serial_ms = (perf_counter_ns() - start) / 1e6;
+
+        parallel_set_num_threads(n_threads);
+        start = perf_counter_ns();
+        Tensor* threaded = tensor_reduce_add(t, dim, arena);
+        double parallel_ms = (perf_counter_ns() - start) / 1e6;
+
+        bool ok = memcmp(serial->data, threaded->data, serial->data_len * sizeof(f32)) == 0;
+        // chunk partials are released again, the result is the last thing left on the arena
+        usize result_end = (u8*)&threaded->data[threaded->data_len] - (u8*)arena;
+        result_end = (result_end + arena->alignment - 1) / arena->alignment * arena->alignment;
+        if (arena->alloc_pos != result_end) {
+            printf("  FAIL dim=%zu kept %zu bytes of partials\n", dim, arena->alloc_pos - result_end);
+            ok = false;
+        }
+        for (usize i = 0; i < serial->data_len && ok; i++) {
+            u32 index[4];
+            usize rem = i;
+            for (i32 d = 3; d >= 0; d--) {
+                index[d] = rem % serial->shape[d];
+                rem /= serial->shape[d];
+            }
+            f64 acc = 0.0;
+            for (u32 r = 0; r < shape[dim]; r++) {
+                index[dim] = r;
+                acc += t->data[index[0] * t->stride[0] + index[1] * t->stride[1] + index[2] * t->stride[2] + index[3] * t->stride[3]];
+            }
+            if (fabs(serial->data[i] - acc) > 1e-3) {
+                printf("  FAIL at %zu: got %f, expected %f\n", i, serial->data[i], acc);
+                ok = false;
+            }
+        }
+
+        printf("  %s  dim=%zu serial %.3f ms, parallel %.3f ms\n", ok ? "PASS" : "FAIL", dim, serial_ms, parallel_ms);
+    }
+    parallel_set_num_threads(1);
+
+    arena_destroy(arena);
+}
+
+static void optim_none(GradTensor* gt, void* config) {}
+
+static bool grads_match(const char* label, const Tensor* got, const Tensor* expect) {
+    for (usize i = 0; i < got->data_len; i++) {
+        if (fabsf(got->data[i] - expect->data[i]) > 1e-4f + 1e-4f * fabsf(expect->data[i])) {
+            printf("  FAIL %s grad at %zu: got %f, expected %f\n", label, i, got->data[i], expect->data[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+// fused relu(x * w + b) against mul, add and relu as separate nodes, forward values and all gradients
+void test_linear(u32 m, u32 k, u32 n) {
+    printf("test_linear [%u x %u] * [%u x %u] + bias, relu\n", m, k, k, n);
+
+    arena_allocator* arena = arena_create(GiB(4), MiB(1), 8);
+    gradt_set_arena(arena);
+
+    u32 x_shape[] = {1, 1, m, k};
+    u32 w_shape[] = {1, 1, k, n};
+    u32 b_shape[] = {1, 1, 1, n};
+    GradTensor* x = gradt_create(x_shape, 4);
+    GradTensor* w = gradt_create(w_shape, 4);
+    GradTensor* b = gradt_create(b_shape, 4);
+    tensor_randomize(x->tens, -1.0f, 1.0f);
+    tensor_randomize(w->tens, -1.0f, 1.0f);
+    tensor_randomize(b->tens, -1.0f, 1.0f);
+    u32* labels = malloc(m * sizeof(u32));
+    for (u32 i = 0; i < m; i++) {
+        labels[i] = (i * 7) % n;
+    }
+    GradTensor* truth = gradt_create_from_labels(labels, n, m, false);
+    free(labels);
+
+    double start = perf_counter_ns();
+    GradTensor* fused = gradt_linear(x, w, b, true);
+    double fused_ms = (perf_counter_ns() - start) / 1e6;
+    gradt_backward(gradt_cross_entropy_loss(fused, truth), optim_none, NULL);
+    Tensor* fused_grads[3] = {
+        tensor_create(x_shape, 4, arena), tensor_create(w_shape, 4, arena), tensor_create(b_shape, 4, arena)
+    };
+    memcpy(fused_grads[0]->data, x->grad->data, x->grad->data_len * sizeof(f32));
+    memcpy(fused_grads[1]->data, w->grad->data, w->grad->data_len * sizeof(f32));
+    memcpy(fused_grads[2]->data, b->grad->data, b->grad->data_len * sizeof(f32));
+
+    start = perf_counter_ns();
+    GradTensor* unfused = gradt_relu(gradt_add(gradt_mul(x, w), b));
+    double unfused_ms = (perf_counter_ns() - start) / 1e6;
+    gradt_backward(gradt_cross_entropy_loss(unfused, truth), optim_none, NULL);
+
+    bool ok = verify_data(fused->tens->data, unfused->tens->data, m, n, 1e-4f);
+    ok = ok && grads_match("x", fused_grads[0], x->grad);
+    ok = ok && grads_match("w", fused_grads[1], w->grad);
+    ok = ok && grads_match("b", fused_grads[2], b->grad);
+
+    // without a bias, and an f32 bias is all the epilogue takes
+    GradTensor* no_bias = gradt_linear(x, w, NULL, true);
+    gradt_backward(gradt_cross_entropy_loss(no_bias, truth), optim_none, NULL);
+    memcpy(fused_grads[0]->data, x->grad->data, x->grad->data_len * sizeof(f32));
+    memcpy(fused_grads[1]->data, w->grad->data, w->grad->data_len * sizeof(f32));
+    GradTensor* no_bias_ref = gradt_relu(gradt_mul(x, w));
+    gradt_backward(gradt_cross_entropy_loss(no_bias_ref, truth), optim_none, NULL);
+    ok = ok && verify_data(no_bias->tens->data, no_bias_ref->tens->data, m, n, 1e-4f);
+    ok = ok && grads_match("x, no bias", fused_grads[0], x->grad);
+    ok = ok && grads_match("w, no bias", fused_grads[1], w->grad);
+    Tensor* b16 = tensor_to_dtype(b->tens, TENSOR_BF16, arena);
+    ok = ok && tensor_linear(x->tens, w->tens, b16, true, arena) == NULL;
+
+    printf("  %s  fused %.3f ms, unfused %.3f ms\n", ok ? "PASS" : "FAIL", fused_ms, unfused_ms);
+
+    gradt_destroy_arena();
+}
+
+// x feeds two matmuls and h = x * w both sides of h + relu(h), so x and h collect two contributions
+// each; the gradients must match a hand-written chain rule on every backward pass, not just the first
+void test_shared_grad(u32 m, u32 k, u32 n) {
+    printf("test_shared_grad [%u x %u] * [%u x %u], shared operands\n", m, k, k, n);
+
+    arena_allocator* arena = arena_create(GiB(1), MiB(1), 8);
+    gradt_set_arena(arena);
+
+    u32 x_shape[] = {1, 1, m, k};
+    u32 w_shape[] = {1, 1, k, n};
+    GradTensor* x = gradt_create(x_shape, 4);
+    GradTensor* w = gradt_create(w_shape, 4);
+    GradTensor* w2 = gradt_create(w_shape, 4);
+    tensor_randomize(x->tens, -1.0f, 1.0f);
+    tensor_randomize(w->tens, -1.0f, 1.0f);
+    tensor_randomize(w2->tens, -1.0f, 1.0f);
+    u32* labels = malloc(m * sizeof(u32));
+    for (u32 i = 0; i < m; i++) {
+        labels[i] = (i * 5) % n;
+    }
+    GradTensor* truth = gradt_create_from_labels(labels, n, m, false);
+    free(labels);
+
+    GradTensor* h = gradt_mul(x, w);
+    GradTensor* logits = gradt_add(gradt_add(h, gradt_relu(h)), gradt_mul(x, w2));
+    GradTensor* loss = gradt_cross_entropy_loss(logits, truth);
+
+    // g = dloss / dlogits, gh = g * (1 + [h > 0])
+    Tensor* stats = NULL;
+    tensor_cross_entropy(logits->tens, truth->tens, &stats, arena);
+    Tensor* g = tensor_create(logits->tens->shape, 4, arena);
+    _tensor_kernel_cross_entropy_bwd(logits->tens, truth->tens, stats, NULL, g, false);
+    Tensor* gh = tensor_create(g->shape, 4, arena);
+    for (usize i = 0; i < g->data_len; i++) {
+        gh->data[i] = g->data[i] * (h->tens->data[i] > 0.0f ? 2.0f : 1.0f);
+    }
+    Tensor* x_ref = tensor_add(tensor_mul_tr(gh, w->tens, false, true, arena),
+                               tensor_mul_tr(g, w2->tens, false, true, arena), arena);
+    Tensor* w_ref = tensor_mul_tr(x->tens, gh, true, false, arena);
+    Tensor* w2_ref = tensor_mul_tr(x->tens, g, true, false, arena);
+
+    bool ok = true;
+    double bwd_ms = 0.0;
+    for (u32 pass = 0; pass < 3 && ok; pass++) {
+        double start = perf_counter_ns();
+        gradt_backward(loss, optim_none, NULL);
+        bwd_ms += (perf_counter_ns() - start) / 1e6;
+        ok = grads_match("x", x->grad, x_ref) && grads_match("w", w->grad, w_ref) && grads_match("w2", w2->grad, w2_ref);
+    }
+
+    // w3 only feeds the truth side of a loss, so no backward op writes into its branch: the pass leaves
+    // those grads alone, the optimizer reads w3's through gradt_grad as zeros and keeps w3
+    GradTensor* w3 = gradt_create(w_shape, 4);
+    tensor_randomize(w3->tens, -1.0f, 1.0f);
+    GradTensor* truth3 = gradt_relu(gradt_mul(x, w3));
+    GradTensor* loss3 = gradt_cross_entropy_loss(logits, truth3);
+    Tensor* w3_before = tensor_create(w_shape, 4, arena);
+    _tensor_kernel_copy(w3->tens, w3_before);
+    tensor_set(w3->grad, 7.0f);
+    tensor_set(truth3->grad, 7.0f);
+    SGDConfig sgd = optim_sgd_get_config(0.5f);
+    gradt_backward(loss3, optim_sgd, &sgd);
+    ok = ok && truth3->grad->data[0] == 7.0f;
+    ok = ok && verify_data(w3->tens->data, w3_before->data, k, n, 0.0f);
+    Tensor* w3_grad = gradt_grad(w3);
+    for (usize i = 0; i < w3_grad->data_len && ok; i++) {
+        ok = w3_grad->data[i] == 0.0f;
+    }
+
+    printf("  %s  backward %.3f ms\n", ok ? "PASS" : "FAIL", bwd_ms / 3);
+
+    gradt_destroy_arena();
+}
+
+typedef struct {
+    const char* label;
+    Optimizer optim;
+    void* config;
+} OptimCase;
+
+// f64 reference of one step of every optimizer in test_optimizers, kind indexes its cases
+static void ref_optim_step(u32 kind, f64* p, const f64* g, f64* m, f64* v, u32 t, usize n) {
+    const f64 lr = 1e-2, mu = 0.9, b1 = 0.9, b2 = 0.999, eps = 1e-8, wd = 0.1;
+    for (usize i = 0; i < n; i++) {
+        if (kind == 0) {
+            p[i] -= lr * g[i];
+        } else if (kind <= 2) {
+            m[i] = mu * m[i] + g[i];
+            p[i] -= lr * (kind == 2 ? g[i] + mu * m[i] : m[i]);
+        } else {
+            f64 gi = kind == 3 ? g[i] + wd * p[i] : g[i];
+            m[i] = b1 * m[i] + (1.0 - b1) * gi;
+            v[i] = b2 * v[i] + (1.0 - b2) * gi * gi;
+            f64 m_hat = m[i] / (1.0 - pow(b1, t));
+            f64 v_hat = v[i] / (1.0 - pow(b2, t));
+            p[i] = p[i] * (kind == 4 ? 1.0 - lr * wd : 1.0) - lr * m_hat / (sqrt(v_hat) + eps);
+        }
+    }
+}
+
+// several steps of each optimizer against the f64 reference, arena usage must not grow after the first step
+void test_optimizers(u32 n) {
+    printf("test_optimizers [%u]\n", n);
+
+    arena_allocator* arena = arena_create(GiB(1), MiB(1), 8);
+    gradt_set_arena(arena);
+
+    SGDConfig sgd = optim_sgd_get_config(1e-2);
+    SGDMomentumConfig momentum = optim_sgd_momentum_get_config(1e-2, 0.9);
+    SGDMomentumConfig nesterov = optim_sgd_nesterov_get_config(1e-2, 0.9);
+    AdamConfig adam = optim_adam_get_config(1e-2, 0.9, 0.999, 1e-8, 0.1);
+    AdamConfig adamw = optim_adamw_get_config(1e-2, 0.9, 0.999, 1e-8, 0.1);
+    OptimCase cases[] = {
+        {"sgd", optim_sgd, &sgd},
+        {"momentum", optim_sgd_momentum, &momentum},
+        {"nesterov", optim_sgd_momentum, &nesterov},
+        {"adam", optim_adam, &adam},
+        {"adamw", optim_adam, &adamw},
+    };
+
+    u32 shape[] = {1, 1, 1, n};
+    f64* ref = malloc(4 * n * sizeof(f64));
+    for (u32 kind = 0; kind < sizeof(cases) / sizeof(cases[0]); kind++) {
+        GradTensor* gt = gradt_create(shape, 4);
+        tensor_randomize(gt->tens, -1.0f, 1.0f);
+        f64* p = ref;
+        f64* g = ref + n;
+        f64* m = ref + 2 * n;
+        f64* v = ref + 3 * n;
+        for (u32 i = 0; i < n; i++) {
+            p[i] = gt->tens->data[i];
+            m[i] = 0.0;
+            v[i] = 0.0;
+        }
+
+        bool ok = true;
+        usize arena_pos = 0;
+        double elapsed_ms = 0.0;
+        for (u32 t = 1; t <= 5; t++) {
+            tensor_randomize(gt->grad, -1.0f, 1.0f);
+            for (u32 i = 0; i < n; i++) {
+                g[i] = gt->grad->data[i];
+            }
+            ref_optim_step(kind, p, g, m, v, t, n);
+
+            double start = perf_counter_ns();
+            cases[kind].optim(gt, cases[kind].config);
+            elapsed_ms += (perf_counter_ns() - start) / 1e6;
+            if (t == 1) {
+                arena_pos = arena->alloc_pos;
+            } else if (arena->alloc_pos != arena_pos) {
+                printf("  FAIL %s allocated %zu bytes at step %u\n", cases[kind].label, arena->alloc_pos - arena_pos, t);
+                ok = false;
+            }
+        }
+        for (u32 i = 0; i < n && ok; i++) {
+            if (fabs(gt->tens->data[i] - p[i]) > 1e-5 + 1e-4 * fabs(p[i])) {
+                printf("  FAIL %s at %u: got %f, expected %f\n", cases[kind].label, i, gt->tens->data[i], p[i]);
+                ok = false;
+            }
+        }
+        printf("  %s  %-8s %.3f ms / step\n", ok ? "PASS" : "FAIL", cases[kind].label, elapsed_ms / 5);
+    }
+    free(ref);
+
+    gradt_destroy_arena();
+}
+
+// two layer MLP trained with Adam per tensor and through a ParamSlab must end with the same weights,
+// then a step over many small parameters is timed both ways
+void test_param_slab() {
+    printf("test_param_slab\n");
+
+    arena_allocator* arena = arena_create(GiB(1), MiB(1), 8);
+    gradt_set_arena(arena);
+
+    AdamConfig adam = optim_adam_get_config(1e-2, 0.9, 0.999, 1e-8, 0.0);
+    u32 in_shape[4] = {1, 1, 16, 24};
+    GradTensor* in = gradt_create_nograd(in_shape, 4);
+    tensor_randomize(in->tens, -1.0f, 1.0f);
+    u32 labels[16];
+    for (u32 i = 0; i < 16; i++) {
+        labels[i] = (i * 5) % 10;
+    }
+    GradTensor* truth = gradt_create_from_labels(labels, 10, 16, false);
+
+    LinearLayer layers[2][2];
+    for (usize run = 0; run < 2; run++) {
+        layers[run][0] = nn_linear_create(24, 32);
+        layers[run][1] = nn_linear_create(32, 10);
+    }
+    for (usize l = 0; l < 2; l++) {
+        tensor_randomize(layers[0][l].w->tens, -0.5f, 0.5f);
+        tensor_randomize(layers[0][l].b->tens, -0.5f, 0.5f);
+        memcpy(layers[1][l].w->tens->data, layers[0][l].w->tens->data, layers[0][l].w->tens->data_len * sizeof(f32));
+        memcpy(layers[1][l].b->tens->data, layers[0][l].b->tens->data, layers[0][l].b->tens->data_len * sizeof(f32));
+    }
+    GradTensor* slab_params[4] = {layers[1][0].w, layers[1][0].b, layers[1][1].w, layers[1][1].b};
+    // with grad disabled there is no flat gradient, the params stay where they are
+    bool prev = gradt_set_grad_enabled(false);
+    f32* w_data = slab_params[0]->tens->data;
+    ParamSlab no_grad = param_slab_create(slab_params, 4);
+    param_slab_step(&no_grad, optim_adam, &adam);
+    bool ok = no_grad.flat == NULL && slab_params[0]->tens->data == w_data && slab_params[0]->optim_state[0] == NULL;
+    gradt_set_grad_enabled(prev);
+    // the slabs themselves plus headers, missing grads and state are views rather than buffers of their own
+    usize used = arena_get_stats(arena).used;
+    ParamSlab slab = param_slab_create(slab_params, 4);
+    usize slab_bytes = 4 * tensor_storage_len(slab.flat->tens) * sizeof(f32);
+    ok = ok && arena_get_stats(arena).used - used < slab_bytes + 4096;
+
+    for (u32 step = 0; step < 3; step++) {
+        for (usize run = 0; run < 2; run++) {
+            GradTensor* h = nn_linear_relu_forward(&layers[run][0], in);
+            GradTensor* loss = nn_cross_enropy_loss(nn_linear_forward(&layers[run][1], h), truth);
+            if (run == 0) {
+                gradt_backward(loss, optim_adam, &adam);
+            } else {
+                gradt_backward(loss, NULL, NULL);
+                param_slab_step(&slab, optim_adam, &adam);
+            }
+        }
+    }
+
+    for (usize l = 0; l < 2 && ok; l++) {
+        ok = grads_match("w", layers[1][l].w->tens, layers[0][l].w->tens) && grads_match("b", layers[1][l].b->tens, layers[0][l].b->tens);
+    }
+    printf("  %s  MLP weights per tensor vs slab\n", ok ? "PASS" : "FAIL");
+
+    enum { N_SMALL = 256, SMALL_LEN = 64, ITERS = 100 };
+    GradTensor* small[N_SMALL];
+    u32 small_shape[4] = {1, 1, 1, SMALL_LEN};
+    for (usize i = 0; i < N_SMALL; i++) {
+        small[i] = gradt_create(small_shape, 4);
+        tensor_randomize(small[i]->grad, -1.0f, 1.0f);
+    }
+    double start = perf_counter_ns();
+    for (u32 it = 0; it < ITERS; it++) {
+        for (usize i = 0; i < N_SMALL; i++) {
+            optim_adam(small[i], &adam);
+        }
+    }
+    double per_tensor_us = (perf_counter_ns() - start) / 1e3 / ITERS;
+    ParamSlab small_slab = param_slab_create(small, N_SMALL);
+    start = perf_counter_ns();
+    for (u32 it = 0; it < ITERS; it++) {
+        param_slab_step(&small_slab, optim_adam, &adam);
+    }
+    double slab_us = (perf_counter_ns() - start) / 1e3 / ITERS;
+    printf("  Adam step over %d x %d params: per tensor %.2f us, slab %.2f us\n", N_SMALL, SMALL_LEN, per_tensor_us, slab_us);
+
+    gradt_destroy_arena();
+}
+
+// a captured MLP step replayed against rebuilding the graph every step: same losses and weights,
+// and the plan's arena must stop growing once the optimizer state exists
+void test_grad_plan(u32 batch, u32 in_dim, u32 hidden, u32 classes, u32 steps) {
+    printf("test_grad_plan [%u x %u] -> %u -> %u, %u steps\n", batch, in_dim, hidden, classes, steps);
+
+    // separate arenas, a replayed step rewinds its arena and would drop the eager graph
+    arena_allocator* eager_arena = arena_create(GiB(4), MiB(1), 8);
+    arena_allocator* plan_arena = arena_create(GiB(4), MiB(1), 8);
+    gradt_set_arena(eager_arena);
+
+    AdamConfig adam = optim_adam_get_config(1e-3, 0.9, 0.999, 1e-8, 0.0);
+    u32 in_shape[4] = {1, 1, batch, in_dim};
+    GradTensor* in = gradt_create_nograd(in_shape, 4);
+    tensor_randomize(in->tens, -1.0f, 1.0f);
+    u32* labels = malloc(batch * sizeof(u32));
+    for (u32 i = 0; i < batch; i++) {
+        labels[i] = (i * 7) % classes;
+    }
+    GradTensor* truth = gradt_create_from_labels(labels, classes, batch, false);
+    free(labels);
+
+    LinearLayer eager[2] = {nn_linear_create(in_dim, hidden), nn_linear_create(hidden, classes)};
+    gradt_set_arena(plan_arena);
+    LinearLayer replay[2] = {nn_linear_create(in_dim, hidden), nn_linear_create(hidden, classes)};
+    for (usize l = 0; l < 2; l++) {
+        tensor_randomize(eager[l].w->tens, -0.1f, 0.1f);
+        memcpy(replay[l].w->tens->data, eager[l].w->tens->data, eager[l].w->tens->data_len * sizeof(f32));
+    }
+
+    GradTensor* h = nn_linear_relu_forward(&replay[0], in);
+    GradTensor* plan_loss = nn_cross_enropy_loss(nn_linear_forward(&replay[1], h), truth);
+    GradPlan plan = gradt_plan_capture(plan_loss);
+
+    bool ok = true;
+    double eager_ms = 0.0, plan_ms = 0.0;
+    usize steady_pos = 0;
+    for (u32 step = 0; step < steps; step++) {
+        gradt_set_arena(eager_arena);
+        double start = perf_counter_ns();
+        GradTensor* eager_h = nn_linear_relu_forward(&eager[0], in);
+        GradTensor* eager_loss = nn_cross_enropy_loss(nn_linear_forward(&eager[1], eager_h), truth);
+        gradt_backward(eager_loss, optim_adam, &adam);
+        eager_ms += (perf_counter_ns() - start) / 1e6;
+
+        gradt_set_arena(plan_arena);
+        start = perf_counter_ns();
+        gradt_plan_step(&plan, optim_adam, &adam);
+        plan_ms += (perf_counter_ns() - start) / 1e6;
+
+        if (plan_loss->tens->data[0] != eager_loss->tens->data[0]) {
+            printf("  FAIL step %u: replayed loss %f, eager loss %f\n", step, plan_loss->tens->data[0], eager_loss->tens->data[0]);
+            ok = false;
+        }
+        if (step == 0) {
+            steady_pos = plan_arena->alloc_pos;
+        } else if (plan_arena->alloc_pos != steady_pos) {
+            printf("  FAIL step %u: replay grew the arena by %zu bytes\n", step, plan_arena->alloc_pos - steady_pos);
+            ok = false;
+        }
+    }
+    for (usize l = 0; l < 2 && ok; l++) {
+        ok = grads_match("w", replay[l].w->tens, eager[l].w->tens) && grads_match("b", replay[l].b->tens, eager[l].b->tens);
+    }
+
+    printf("  %s  eager %.3f ms / step, replay %.3f ms / step\n", ok ? "PASS" : "FAIL", eager_ms / steps, plan_ms / steps);
+
+    gradt_destroy_arena();
+    arena_destroy(eager_arena);
+}
+
+// unfused layers with residual adds, so relu / add chains can run in place and h is consumed twice
+static GradTensor* residual_mlp_loss(LinearLayer* layers, u32 n_layers, GradTensor* in, GradTensor* truth) {
+    GradTensor* h = gradt_relu(gradt_add(gradt_mul(in, layers[0].w), layers[0].b));
+    for (u32 l = 1; l + 1 < n_layers; l++) {
+        h = gradt_add(h, gradt_relu(gradt_add(gradt_mul(h, layers[l].w), layers[l].b)));
+    }
+    GradTensor* logits = gradt_add(gradt_mul(h, layers[n_layers - 1].w), layers[n_layers - 1].b);
+    return gradt_cross_entropy_loss(logits, truth);
+}
+
+// replay with planned activation / grad buffers against the same plan with its buffers as built
+void test_mem_plan(u32 batch, u32 in_dim, u32 hidden, u32 classes, u32 n_layers, u32 steps) {
+    printf("test_mem_plan [%u x %u] -> %u x %u -> %u, %u steps\n", batch, in_dim, n_layers - 2, hidden, classes, steps);
+
+    arena_allocator* arena = arena_create(GiB(4), MiB(1), 8);
+    gradt_set_arena(arena);
+
+    AdamConfig adam = optim_adam_get_config(1e-3, 0.9, 0.999, 1e-8, 0.0);
+    u32 in_shape[4] = {1, 1, batch, in_dim};
+    GradTensor* in = gradt_create_nograd(in_shape, 4);
+    tensor_randomize(in->tens, -1.0f, 1.0f);
+    u32* labels = malloc(batch * sizeof(u32));
+    for (u32 i = 0; i < batch; i++) {
+        labels[i] = (i * 7) % classes;
+    }
+    GradTensor* truth = gradt_create_from_labels(labels, classes, batch, false);
+    free(labels);
+
+    LinearLayer* layers[2] = {malloc(n_layers * sizeof(LinearLayer)), malloc(n_layers * sizeof(LinearLayer))};
+    for (u32 l = 0; l < n_layers; l++) {
+        u32 l_in = l == 0 ? in_dim : hidden;
+        u32 l_out = l + 1 == n_layers ? classes : hidden;
+        layers[0][l] = nn_linear_create(l_in, l_out);
+        layers[1][l] = nn_linear_create(l_in, l_out);
+        tensor_randomize(layers[0][l].w->tens, -0.1f, 0.1f);
+        memcpy(layers[1][l].w->tens->data, layers[0][l].w->tens->data, layers[0][l].w->tens->data_len * sizeof(f32));
+    }
+
+    GradPlan plans[2];
+    for (usize v = 0; v < 2; v++) {
+        plans[v] = gradt_plan_capture(residual_mlp_loss(layers[v], n_layers, in, truth));
+    }
+    MemPlanStats mem = mem_plan_apply(&plans[1], arena);
+
+    bool ok = mem.planned_bytes < mem.naive_bytes;
+    double ms[2] = {0.0, 0.0};
+    for (u32 step = 0; step < steps && ok; step++) {
+        for (usize v = 0; v < 2; v++) {
+            double start = perf_counter_ns();
+            gradt_plan_step(&plans[v], optim_adam, &adam);
+            ms[v] += (perf_counter_ns() - start) / 1e6;
+        }
+        if (plans[1].loss->tens->data[0] != plans[0].loss->tens->data[0]) {
+            printf("  FAIL step %u: planned loss %f, unplanned loss %f\n", step, plans[1].loss->tens->data[0], plans[0].loss->tens->data[0]);
+            ok = false;
+        }
+    }
+    for (u32 l = 0; l < n_layers && ok; l++) {
+        ok = grads_match("w", layers[1][l].w->tens, layers[0][l].w->tens) && grads_match("b", layers[1][l].b->tens, layers[0][l].b->tens);
+    }
+
+    printf("  %s  %zu buffers (%zu in place): naive peak %.2f MiB, planned %.2f MiB; %.3f vs %.3f ms / step\n",
+           ok ? "PASS" : "FAIL", mem.n_buffers, mem.n_inplace, mem.naive_bytes / (1024.0 * 1024.0),
+           mem.planned_bytes / (1024.0 * 1024.0), ms[1] / steps, ms[0] / steps);
+
+    free(layers[0]);
+    free(layers[1]);
+    gradt_destroy_arena();
+}
+
+// the same planned residual MLP with packed and with padded rows everywhere (weights, activations,
+// grads, optimizer state): identical losses and weights, plus a gemm on 4 KiB rows vs padded ones
+void test_row_padding(u32 batch, u32 in_dim, u32 hidden, u32 classes, u32 n_layers, u32 steps) {
+    printf("test_row_padding [%u x %u] -> %u x %u -> %u, %u steps\n", batch, in_dim, n_layers - 2, hidden, classes, steps);
+
+    arena_allocator* arena = arena_create(GiB(4), MiB(1), 8);
+    gradt_set_arena(arena);
+
+    bool ok = true;
+    u32 odd_shapes[3][4] = {{1, 1, 3, 5}, {1, 2, 7, 1000}, {1, 1, 3, 1024}};
+    u32 expect_ld[3] = {5, 1008, 1040};
+    for (usize i = 0; i < 3; i++) {
+        arena_alloc(arena, 1, 4 * i + 4); // knock the arena off any alignment
+        Tensor* packed = tensor_create(odd_shapes[i], 4, arena);
+        bool prev = tensor_set_row_padding(true);
+        Tensor* padded = tensor_create(odd_shapes[i], 4, arena);
+        tensor_set_row_padding(prev);
+        ok = ok && (uintptr_t)packed->data % TENSOR_ALIGN == 0 && (uintptr_t)padded->data % TENSOR_ALIGN == 0 &&
+             tensor_row_ld(padded) == expect_ld[i] && tensor_row_ld(packed) == odd_shapes[i][3];
+    }
+    if (!ok) {
+        printf("  FAIL tensor alignment / leading dimensions\n");
+    }
+
+    AdamConfig adam = optim_adam_get_config(1e-3, 0.9, 0.999, 1e-8, 0.0);
+    u32 in_shape[4] = {1, 1, batch, in_dim};
+    GradTensor* in = gradt_create_nograd(in_shape, 4);
+    tensor_randomize(in->tens, -1.0f, 1.0f);
+    u32* labels = malloc(batch * sizeof(u32));
+    for (u32 i = 0; i < batch; i++) {
+        labels[i] = (i * 7) % classes;
+    }
+    GradTensor* truth = gradt_create_from_labels(labels, classes, batch, false);
+    free(labels);
+
+    LinearLayer* layers[2] = {malloc(n_layers * sizeof(LinearLayer)), malloc(n_layers * sizeof(LinearLayer))};
+    GradPlan plans[2];
+    for (usize v = 0; v < 2; v++) {
+        bool prev = tensor_set_row_padding(v == 1);
+        for (u32 l = 0; l < n_layers; l++) {
+            u32 l_in = l == 0 ? in_dim : hidden;
+            u32 l_out = l + 1 == n_layers ? classes : hidden;
+            layers[v][l] = nn_linear_create(l_in, l_out);
+            if (v == 0) {
+                tensor_randomize(layers[0][l].w->tens, -0.1f, 0.1f);
+            } else {
+                _tensor_kernel_copy(layers[0][l].w->tens, layers[1][l].w->tens);
+            }
+        }
+        plans[v] = gradt_plan_capture(residual_mlp_loss(layers[v], n_layers, in, truth));
+        mem_plan_apply(&plans[v], arena);
+        tensor_set_row_padding(prev);
+    }
+    ok = ok && tensor_row_ld(layers[1][0].w->tens) == tensor_padded_ld(hidden) && tensor_row_ld(layers[1][0].w->grad) == tensor_padded_ld(hidden);
+
+    double ms[2] = {0.0, 0.0};
+    for (u32 step = 0; step < steps && ok; step++) {
+        for (usize v = 0; v < 2; v++) {
+            double start = perf_counter_ns();
+            gradt_plan_step(&plans[v], optim_adam, &adam);
+            ms[v] += (perf_counter_ns() - start) / 1e6;
+        }
+        if (plans[1].loss->tens->data[0] != plans[0].loss->tens->data[0]) {
+            printf("  FAIL step %u: padded loss %f, packed loss %f\n", step, plans[1].loss->tens->data[0], plans[0].loss->tens->data[0]);
+            ok = false;
+        }
+    }
+    for (u32 l = 0; l < n_layers && ok; l++) {
+        ok = grads_match("w", tensor_contiguous(layers[1][l].w->tens, arena), layers[0][l].w->tens) &&
+             grads_match("b", tensor_contiguous(layers[1][l].b->tens, arena), layers[0][l].b->tens);
+    }
+    printf("  %s  MLP packed %.3f ms / step, padded %.3f ms / step\n", ok ? "PASS" : "FAIL", ms[0] / steps, ms[1] / steps);
+
+    // 1024 floats per row: every row of a gemm tile lands in the same L1 sets unless padded
+    enum { N = 1024, REPS = 3 };
+    u32 sq_shape[4] = {1, 1, N, N};
+    Tensor* mats[2][3];
+    double gemm_ms[2] = {0.0, 0.0};
+    for (usize v = 0; v < 2; v++) {
+        u32 ld = v == 0 ? N : tensor_padded_ld(N);
+        for (usize i = 0; i < 3; i++) {
+            mats[v][i] = tensor_create_ld(sq_shape, 4, ld, arena);
+        }
+        if (v == 0) {
+            tensor_randomize(mats[0][0], -1.0f, 1.0f);
+            tensor_randomize(mats[0][1], -1.0f, 1.0f);
+        } else {
+            _tensor_kernel_copy(mats[0][0], mats[1][0]);
+            _tensor_kernel_copy(mats[0][1], mats[1][1]);
+        }
+        _tensor_kernel_mul(mats[v][0], mats[v][1], mats[v][2]);
+        double start = perf_counter_ns();
+        for (u32 r = 0; r < REPS; r++) {
+            _tensor_kernel_mul(mats[v][0], mats[v][1], mats[v][2]);
+        }
+        gemm_ms[v] = (perf_counter_ns() - start) / 1e6 / REPS;
+    }
+    Tensor* padded_res = tensor_contiguous(mats[1][2], arena);
+    bool gemm_ok = verify_data(padded_res->data, mats[0][2]->data, N, N, 0.0f);
+    printf("  %s  gemm %dx%dx%d ld %d %.2f ms, ld %u %.2f ms\n", gemm_ok ? "PASS" : "FAIL", N, N, N, N, gemm_ms[0],
+           tensor_padded_ld(N), gemm_ms[1]);
+
+    free(layers[0]);
+    free(layers[1]);
+    gradt_destroy_arena();
+}
+
+// planned replay of a deep MLP with every activation kept against checkpoints every `every` ops
+void test_checkpoint(u32 batch, u32 width, u32 n_layers, u32 every, u32 steps) {
+    printf("test_checkpoint [%u x %u] x %u layers, checkpoint every %u ops, %u steps\n", batch, width, n_layers, every, steps);
+
+    arena_allocator* arena = arena_create(GiB(4), MiB(1), 8);
+    gradt_set_arena(arena);
+
+    AdamConfig adam = optim_adam_get_config(1e-3, 0.9, 0.999, 1e-8, 0.0);
+    u32 in_shape[4] = {1, 1, batch, width};
+    GradTensor* in = gradt_create_nograd(in_shape, 4);
+    tensor_randomize(in->tens, -1.0f, 1.0f);
+    u32* labels = malloc(batch * sizeof(u32));
+    for (u32 i = 0; i < batch; i++) {
+        labels[i] = (i * 7) % 10;
+    }
+    GradTensor* truth = gradt_create_from_labels(labels, 10, batch, false);
+    free(labels);
+
+    LinearLayer* layers[2] = {malloc(n_layers * sizeof(LinearLayer)), malloc(n_layers * sizeof(LinearLayer))};
+    for (u32 l = 0; l < n_layers; l++) {
+        u32 l_out = l + 1 == n_layers ? 10 : width;
+        layers[0][l] = nn_linear_create(width, l_out);
+        layers[1][l] = nn_linear_create(width, l_out);
+        tensor_randomize(layers[0][l].w->tens, -0.1f, 0.1f);
+        memcpy(layers[1][l].w->tens->data, layers[0][l].w->tens->data, layers[0][l].w->tens->data_len * sizeof(f32));
+    }
+
+    GradPlan plans[2];
+    MemPlanStats mem[2];
+    usize recomputed = 0;
+    for (usize v = 0; v < 2; v++) {
+        GradTensor* h = in;
+        for (u32 l = 0; l + 1 < n_layers; l++) {
+            h = gradt_relu(gradt_add(gradt_mul(h, layers[v][l].w), layers[v][l].b));
+        }
+        GradTensor* logits = gradt_add(gradt_mul(h, layers[v][n_layers - 1].w), layers[v][n_layers - 1].b);
+        plans[v] = gradt_plan_capture(gradt_cross_entropy_loss(logits, truth));
+        if (v == 1) {
+            recomputed = mem_plan_checkpoint(&plans[v], every);
+        }
+        mem[v] = mem_plan_apply(&plans[v], arena);
+    }
+
+    bool ok = mem[1].planned_bytes < mem[0].planned_bytes;
+    double ms[2] = {0.0, 0.0};
+    for (u32 step = 0; step < steps && ok; step++) {
+        for (usize v = 0; v < 2; v++) {
+            double start = perf_counter_ns();
+            gradt_plan_step(&plans[v], optim_adam, &adam);
+            ms[v] += (perf_counter_ns() - start) / 1e6;
+        }
+        if (plans[1].loss->tens->data[0] != plans[0].loss->tens->data[0]) {
+            printf("  FAIL step %u: checkpointed loss %f, loss %f\n", step, plans[1].loss->tens->data[0], plans[0].loss->tens->data[0]);
+            ok = false;
+        }
+    }
+    for (u32 l = 0; l < n_layers && ok; l++) {
+        ok = grads_match("w", layers[1][l].w->tens, layers[0][l].w->tens) && grads_match("b", layers[1][l].b->tens, layers[0][l].b->tens);
+    }
+
+    printf("  %s  %zu ops recomputed: peak %.2f MiB -> %.2f MiB, %.3f ms -> %.3f ms / step\n", ok ? "PASS" : "FAIL",
+           recomputed, mem[0].planned_bytes / (1024.0 * 1024.0), mem[1].planned_bytes / (1024.0 * 1024.0),
+           ms[0] / steps, ms[1] / steps);
+
+    free(layers[0]);
+    free(layers[1]);
+    gradt_destroy_arena();
+}
+
+// the same forward with grad enabled and disabled: identical outputs, no grads or graph without
+void test_no_grad(u32 batch, u32 in_dim, u32 hidden, u32 classes) {
+    printf("test_no_grad [%u x %u] -> %u -> %u\n", batch, in_dim, hidden, classes);
+
+    arena_allocator* params = arena_create(GiB(1), MiB(1), 8);
+    arena_allocator* activations = arena_create(GiB(1), MiB(1), 8);
+    gradt_set_arena(params);
+    gradt_set_activation_arena(activations);
+
+    u32 in_shape[4] = {1, 1, batch, in_dim};
+    GradTensor* in = gradt_create_nograd(in_shape, 4);
+    tensor_randomize(in->tens, -1.0f, 1.0f);
+    LinearLayer l1 = nn_linear_create(in_dim, hidden);
+    LinearLayer l2 = nn_linear_create(hidden, classes);
+    tensor_randomize(l1.w->tens, -0.1f, 0.1f);
+    tensor_randomize(l2.w->tens, -0.1f, 0.1f);
+
+    Tensor* outs[2];
+    usize bytes[2];
+    double ms[2];
+    for (usize v = 0; v < 2; v++) {
+        bool prev = gradt_set_grad_enabled(v == 0);
+        usize start_pos = activations->alloc_pos;
+        double start = perf_counter_ns();
+        GradTensor* h = gradt_relu(gradt_add(gradt_mul(in, l1.w), l1.b));
+        GradTensor* out = nn_linear_forward(&l2, h);
+        ms[v] = (perf_counter_ns() - start) / 1e6;
+        bytes[v] = activations->alloc_pos - start_pos;
+        outs[v] = out->tens;
+        gradt_set_grad_enabled(prev);
+
+        if (v == 1 && (out->grad != NULL || h->grad != NULL || out->op.op.mono.src != NULL)) {
+            printf("  FAIL no-grad output still has a grad or an op\n");
+            bytes[1] = bytes[0];
+        }
+    }
+
+    bool ok = gradt_grad_enabled() && bytes[1] < bytes[0];
+    ok = ok && verify_data(outs[1]->data, outs[0]->data, batch, classes, 0.0f);
+
+    printf("  %s  activations %zu B -> %zu B, %.3f ms -> %.3f ms\n", ok ? "PASS" : "FAIL", bytes[0], bytes[1], ms[0], ms[1]);
+
+    gradt_set_activation_arena(NULL);
+    gradt_destroy_arena();
+    arena_destroy(activations);
+}
+
+// parameters, activations and kernel temporaries in separate arenas, each step scoped on the
+// activation arena: after the first step (optimizer state) no arena may grow
+void test_scoped_arenas(u32 steps) {
+    printf("test_scoped_arenas %u steps\n", steps);
+
+    arena_allocator* params = arena_create(GiB(1), MiB(1), 8);
+    arena_allocator* activations = arena_create(GiB(1), MiB(1), 8);
+    arena_allocator* temps = arena_create(GiB(1), MiB(1), 8);
+    gradt_set_arena(params);
+    gradt_set_activation_arena(activations);
+    gradt_set_temp_arena(temps);
+
+    AdamConfig adam = optim_adam_get_config(1e-3, 0.9, 0.999, 1e-8, 0.0);
+    u32 in_shape[4] = {1, 1, 32, 64};
+    GradTensor* in = gradt_create_nograd(in_shape, 4);
+    tensor_randomize(in->tens, -1.0f, 1.0f);
+    u32 labels[32];
+    for (u32 i = 0; i < 32; i++) {
+        labels[i] = i % 10;
+    }
+    GradTensor* truth = gradt_create_from_labels(labels, 10, 32, false);
+    LinearLayer l1 = nn_linear_create(64, 64);
+    LinearLayer l2 = nn_linear_create(64, 10);
+    tensor_randomize(l1.w->tens, -0.1f, 0.1f);
+    tensor_randomize(l2.w->tens, -0.1f, 0.1f);
+
+    bool ok = true;
+    usize pos[3] = {0, 0, 0};
+    for (u32 step = 0; step < steps; step++) {
+        arena_scope scope = arena_scope_begin(activations);
+        GradTensor* h = nn_linear_relu_forward(&l1, in);
+        // unfused second layer so the broadcast bias gradient goes through tensor_reduce_add temporaries
+        GradTensor* logits = gradt_add(gradt_mul(h, l2.w), l2.b);
+        GradTensor* loss = nn_cross_enropy_loss(logits, truth);
+        gradt_backward(loss, optim_adam, &adam);
+        arena_scope_end(scope);
+
+        usize now[3] = {params->alloc_pos, activations->alloc_pos, temps->alloc_pos};
+        if (step > 0 && memcmp(now, pos, sizeof(pos)) != 0) {
+            printf("  FAIL step %u: params %zu -> %zu, activations %zu -> %zu, temps %zu -> %zu\n",
+                   step, pos[0], now[0], pos[1], now[1], pos[2], now[2]);
+            ok = false;
+        }
+        memcpy(pos, now, sizeof(pos));
+    }
+
+    printf("  %s  steady state: params %zu B, activations %zu B, temps %zu B\n", ok ? "PASS" : "FAIL", pos[0], pos[1], pos[2]);
+
+    gradt_set_activation_arena(NULL);
+    gradt_set_temp_arena(NULL);
+    gradt_destroy_arena();
+    arena_destroy(activations);
+    arena_destroy(temps);
+}
+
+typedef struct {
+    const GradTensor* gt;
+    usize index;
+} NodeIndex;
+
+static int cmp_node_index(const void* a, const void* b) {
+    const GradTensor* x = ((const NodeIndex*)a)->gt;
+    const GradTensor* y = ((const NodeIndex*)b)->gt;
+    return x < y ? -1 : x > y;
+}
+
+static usize node_position(const NodeIndex* nodes, usize n, const GradTensor* gt) {
+    NodeIndex key = {.gt = gt};
+    const NodeIndex* found = bsearch(&key, nodes, n, sizeof(NodeIndex), cmp_node_index);
+    return found != NULL ? found->index : n;
+}
+
+// a deep chain of relu / add nodes where every add also reaches back two levels (shared sources),
+// sorted through gradt_plan_capture, every node must come after its sources
+void bench_topo_sort(u32 n_nodes) {
+    printf("bench_topo_sort %u nodes\n", n_nodes);
+
+    arena_allocator* arena = arena_create(GiB(4), MiB(1), 8);
+    gradt_set_arena(arena);
+
+    u32 shape[4] = {1, 1, 1, 4};
+    GradTensor* prev = gradt_create(shape, 4);
+    GradTensor* h = gradt_relu(prev);
+    for (u32 i = 2; i < n_nodes; i++) {
+        GradTensor* next = i % 2 ? gradt_add(h, prev) : gradt_relu(h);
+        prev = h;
+        h = next;
+    }
+
+    double start = perf_counter_ns();
+    GradPlan plan = gradt_plan_capture(h);
+    double first_ms = (perf_counter_ns() - start) / 1e6;
+    start = perf_counter_ns();
+    plan = gradt_plan_capture(h);
+    double second_ms = (perf_counter_ns() - start) / 1e6;
+
+    NodeIndex* nodes = malloc(plan.len * sizeof(NodeIndex));
+    for (usize i = 0; i < plan.len; i++) {
+        nodes[i] = (NodeIndex){.gt = plan.order[i], .index = i};
+    }
+    qsort(nodes, plan.len, sizeof(NodeIndex), cmp_node_index);
+
+    bool ok = plan.len == n_nodes && plan.order[plan.len - 1] == h;
+    for (usize i = 0; i < plan.len && ok; i++) {
+        const Op* op = &plan.order[i]->op;
+        const GradTensor* srcs[2] = {NULL, NULL};
+        if (op->type == Mono) {
+            srcs[0] = op->op.mono.src;
+        } else if (op->type == Binary) {
+            srcs[0] = op->op.bin.src1;
+            srcs[1] = op->op.bin.src2;
+        }
+        for (usize j = 0; j < 2; j++) {
+            if (srcs[j] != NULL && node_position(nodes, plan.len, srcs[j]) >= i) {
+                printf("  FAIL node %zu is sorted before its source\n", i);
+                ok = false;
+            }
+        }
+    }
+    free(nodes);
+
+    printf("  %s  %zu nodes sorted in %.3f ms (first), %.3f ms (warm)\n", ok ? "PASS" : "FAIL", plan.len, first_ms, second_ms);
+
+    gradt_destroy_arena();
+}
+
+// one-hot rows, logits large enough that an unshifted exp would overflow, checked against a double reference
+void test_cross_entropy(u32 rows, u32 classes) {
+    printf("test_cross_entropy [%u x %u]\n", rows, classes);
+
+    arena_allocator* arena = arena_create(GiB(1), MiB(1), 8);
+
+    u32 shape[] = {1, 1, rows, classes};
+    Tensor* logits = tensor_create(shape, 4, arena);
+    Tensor* truth = tensor_create(shape, 4, arena);
+    Tensor* grad = tensor_create(shape, 4, arena);
+    tensor_randomize(logits, -20.0f, 20.0f);
+    tensor_set(truth, 0.0f);
+    for (u32 r = 0; r < rows; r++) {
+        logits->data[r * classes + (r * 7) % classes] = 200.0f + r;
+        truth->data[r * classes + (r * 13) % classes] = 1.0f;
+    }
+
+    Tensor* stats = NULL;
+    tensor_cross_entropy(logits, truth, &stats, arena);
+    _tensor_kernel_cross_entropy_bwd(logits, truth, stats, NULL, grad, false);
+    double start = perf_counter_ns();
+    Tensor* loss = tensor_cross_entropy(logits, truth, &stats, arena);
+    double fwd_ms = (perf_counter_ns() - start) / 1e6;
+    start = perf_counter_ns();
+    _tensor_kernel_cross_entropy_bwd(logits, truth, stats, NULL, grad, false);
+    double bwd_ms = (perf_counter_ns() - start) / 1e6;
+
+    bool ok = true;
+    f64 expect_loss = 0.0;
+    for (u32 r = 0; r < rows && ok; r++) {
+        const f32* x = &logits->data[r * classes];
+        f64 max = x[0];
+        for (u32 i = 1; i < classes; i++) {
+            max = x[i] > max ? x[i] : max;
+        }
+        f64 sum = 0.0;
+        for (u32 i = 0; i < classes; i++) {
+            sum += exp(x[i] - max);
+        }
+        expect_loss += (max + log(sum) - x[(r * 13) % classes]) / rows;
+        for (u32 i = 0; i < classes; i++) {
+            f64 expect = (exp(x[i] - max) / sum - truth->data[r * classes + i]) / rows;
+            if (fabs(grad->data[r * classes + i] - expect) > 1e-6 + 1e-5 * fabs(expect)) {
+                printf("  FAIL grad at (%u, %u): got %g, expected %g\n", r, i, grad->data[r * classes + i], expect);
+                ok = false;
+                break;
+            }
+        }
+    }
+    if (ok && fabs(loss->data[0] - expect_loss) > 1e-5 * fabs(expect_loss)) {
+        printf("  FAIL loss: got %f, expected %f\n", loss->data[0], expect_loss);
+        ok = false;
+    }
+
+    printf("  %s  fwd %.3f ms, bwd %.3f ms\n", ok ? "PASS" : "FAIL", fwd_ms, bwd_ms);
+
+    arena_destroy(arena);
+}
+
 void test_arena(usize reserve, usize commit, usize alloc_size, u32 n_allocs) {
     printf("test_arena  reserve=%zuMiB commit=%zuKiB alloc=%zuKiB x%u\n",
            reserve >> 20, commit >> 10, alloc_size >> 10, n_allocs);
@@ -168,6 +1362,97 @@ void test_arena(usize reserve, usize commit, usize alloc_size, u32 n_allocs) {
     printf("  %s\n", ok ? "PASS" : "FAIL");
 }
 
+// kB of transparent huge pages backing the mapping that contains p, from /proc/self/smaps
+static usize anon_huge_kb(const void* p) {
+    FILE* f = fopen("/proc/self/smaps", "r");
+    if (f == NULL) {
+        return 0;
+    }
+    char line[512];
+    bool inside = false;
+    usize kb = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        unsigned long lo, hi;
+        if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+            inside = (uintptr_t)p >= lo && (uintptr_t)p < hi;
+        } else if (inside && sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return inside ? kb : 0;
+}
+
+// every page / NUMA option: the memory holds data, the arena reports what backs it, the policy is
+// set on the mapping and pages get faulted by the workers. Random reads show the TLB difference.
+void test_arena_options(usize bytes, u32 n_threads) {
+    printf("test_arena_options %zu MiB, %u threads\n", bytes >> 20, n_threads);
+
+    parallel_set_num_threads(n_threads);
+    const char* page_names[] = {"small", "thp", "huge 2M"};
+    for (ArenaPages pages = ARENA_PAGES_SMALL; pages <= ARENA_PAGES_HUGE_2M; pages++) {
+        ArenaOptions opts = {.pages = pages};
+        arena_allocator* arena = arena_create_opts(2 * bytes, MiB(1), 8, &opts);
+        if (arena == NULL) {
+            printf("  FAIL %s: arena_create_opts returned NULL\n", page_names[pages]);
+            continue;
+        }
+        u32* buf = arena_alloc_aligned(arena, 1, bytes, arena->page_size);
+        parallel_first_touch(buf, bytes);
+        usize n = bytes / sizeof(u32);
+        for (usize i = 0; i < n; i++) {
+            buf[i] = (u32)i;
+        }
+
+        // dependent random reads, one TLB lookup each
+        enum { READS = 1 << 22 };
+        double start = perf_counter_ns();
+        u32 idx = 0;
+        u64 sum = 0;
+        for (u32 r = 0; r < READS; r++) {
+            idx = (u32)(((u64)buf[idx] * 2654435761u + r) % n);
+            sum += idx;
+        }
+        double ns = (perf_counter_ns() - start) / READS;
+
+        bool ok = buf[n - 1] == n - 1 && sum != 0;
+        ok = ok && (arena->pages == ARENA_PAGES_SMALL ? arena->page_size == (usize)sysconf(_SC_PAGESIZE)
+                                                      : (uintptr_t)arena % arena->page_size == 0);
+        printf("  %s  %-7s -> %-7s %zu KiB pages, %zu MiB on THP, %.1f ns / random read\n", ok ? "PASS" : "FAIL",
+               page_names[pages], page_names[arena->pages], arena->page_size >> 10, anon_huge_kb(buf) >> 10, ns);
+        arena_destroy(arena);
+    }
+
+    ArenaNuma policies[2] = {ARENA_NUMA_BIND, ARENA_NUMA_INTERLEAVE};
+    int modes[2] = {MPOL_BIND, MPOL_INTERLEAVE};
+    for (usize i = 0; i < 2; i++) {
+        ArenaOptions opts = {.pages = ARENA_PAGES_THP, .numa = policies[i], .node_mask = i == 0 ? 1 : 0};
+        arena_allocator* arena = arena_create_opts(2 * bytes, MiB(1), 8, &opts);
+        bool ok = arena != NULL;
+        int mode = -1, node = -1;
+        if (ok) {
+            u8* buf = arena_alloc(arena, 1, MiB(4));
+            parallel_first_touch(buf, MiB(4));
+            ok = syscall(SYS_get_mempolicy, &mode, NULL, 0, buf, MPOL_F_ADDR) == 0 && mode == modes[i] &&
+                 syscall(SYS_get_mempolicy, &node, NULL, 0, buf, MPOL_F_NODE | MPOL_F_ADDR) == 0 && node >= 0;
+            arena_destroy(arena);
+        }
+        printf("  %s  %s: mapping policy %d, first page on node %d\n", ok ? "PASS" : "FAIL",
+               i == 0 ? "bind node 0" : "interleave", mode, node);
+    }
+
+    // a reservation above the cap must not take hugetlb pages, even when the pool could hold it
+    ArenaOptions huge = {.pages = ARENA_PAGES_HUGE_2M};
+    arena_allocator* big = arena_create_opts(ARENA_HUGETLB_MAX_RESERVE + MiB(2), MiB(1), 8, &huge);
+    bool ok = big != NULL && big->pages == ARENA_PAGES_THP;
+    printf("  %s  huge 2M above the hugetlb cap -> %s\n", ok ? "PASS" : "FAIL",
+           big != NULL ? page_names[big->pages] : "NULL");
+    if (big != NULL) {
+        arena_destroy(big);
+    }
+    parallel_set_num_threads(1);
+}
+
 void test_grad_relu() {
     printf("test_grad_relu [2 x 2]\n");
 
@@ -235,3 +1520,464 @@ void test_grad_bwd() {
     printf("    Destroying gradt arena\n");
     gradt_destroy_arena();
 }
+
+typedef struct {
+    const f32* w1;
+    const f32* w2;
+    const f32* in;
+    const u32* labels;
+    u32 batch, in_dim, hidden, classes, steps;
+    f32 loss;
+    bool ok;
+} ContextJob;
+
+static void fill_rows(Tensor* t, const f32* src, u32 rows, u32 cols) {
+    for (u32 r = 0; r < rows; r++) {
+        memcpy(t->data + (usize)r * t->stride[2], src + (usize)r * cols, cols * sizeof(f32));
+    }
+}
+
+// trains the same MLP from the same start in a context of its own
+static void* context_job_run(void* arg) {
+    ContextJob* job = arg;
+    GradContext* c = gradt_context_create(arena_create(GiB(1), MiB(1), 8));
+    GradContext* prev = gradt_context_set(c);
+
+    u32 in_shape[4] = {1, 1, job->batch, job->in_dim};
+    GradTensor* in = gradt_create_nograd(in_shape, 4);
+    fill_rows(in->tens, job->in, job->batch, job->in_dim);
+    GradTensor* truth = gradt_create_from_labels((u32*)job->labels, job->classes, job->batch, false);
+    LinearLayer l1 = nn_linear_create(job->in_dim, job->hidden);
+    LinearLayer l2 = nn_linear_create(job->hidden, job->classes);
+    fill_rows(l1.w->tens, job->w1, job->in_dim, job->hidden);
+    fill_rows(l2.w->tens, job->w2, job->hidden, job->classes);
+
+    AdamConfig adam = optim_adam_get_config(1e-3, 0.9, 0.999, 1e-8, 0.0);
+    GradTensor* loss = nn_cross_enropy_loss(nn_linear_forward(&l2, nn_linear_relu_forward(&l1, in)), truth);
+    GradPlan plan = gradt_plan_capture(loss);
+    for (u32 s = 0; s < job->steps; s++) {
+        gradt_plan_step(&plan, optim_adam, &adam);
+    }
+    job->loss = loss->tens->data[0];
+    job->ok = plan.ctx == c && gradt_context() == c;
+
+    gradt_context_set(prev);
+    gradt_context_destroy(c);
+    return NULL;
+}
+
+// one context per thread, no locking: every thread must end at the loss a serial run reaches
+void test_grad_contexts(u32 n_threads, u32 steps) {
+    enum { BATCH = 64, IN = 256, HIDDEN = 256, CLASSES = 10, MAX_THREADS = 16 };
+    printf("test_grad_contexts %u threads, %u steps\n", n_threads, steps);
+    if (n_threads > MAX_THREADS) {
+        n_threads = MAX_THREADS;
+    }
+
+    f32* w1 = malloc(IN * HIDDEN * sizeof(f32));
+    f32* w2 = malloc(HIDDEN * CLASSES * sizeof(f32));
+    f32* in = malloc(BATCH * IN * sizeof(f32));
+    u32 labels[BATCH];
+    for (usize i = 0; i < IN * HIDDEN; i++) {
+        w1[i] = ((f32)rand() / RAND_MAX - 0.5f) * 0.2f;
+    }
+    for (usize i = 0; i < HIDDEN * CLASSES; i++) {
+        w2[i] = ((f32)rand() / RAND_MAX - 0.5f) * 0.2f;
+    }
+    for (usize i = 0; i < BATCH * IN; i++) {
+        in[i] = (f32)rand() / RAND_MAX * 2.0f - 1.0f;
+    }
+    for (u32 i = 0; i < BATCH; i++) {
+        labels[i] = i % CLASSES;
+    }
+
+    ContextJob jobs[MAX_THREADS + 1];
+    for (u32 t = 0; t <= n_threads; t++) {
+        jobs[t] = (ContextJob){.w1 = w1, .w2 = w2, .in = in, .labels = labels, .batch = BATCH,
+                               .in_dim = IN, .hidden = HIDDEN, .classes = CLASSES, .steps = steps};
+    }
+
+    // the serial reference runs on this thread, which must come back to its own context
+    GradContext* before = gradt_context();
+    double start = perf_counter_ns();
+    context_job_run(&jobs[n_threads]);
+    double serial_ms = (perf_counter_ns() - start) / 1e6;
+    bool ok = jobs[n_threads].ok && gradt_context() == before;
+
+    pthread_t threads[MAX_THREADS];
+    start = perf_counter_ns();
+    for (u32 t = 0; t < n_threads; t++) {
+        pthread_create(&threads[t], NULL, context_job_run, &jobs[t]);
+    }
+    for (u32 t = 0; t < n_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    double threaded_ms = (perf_counter_ns() - start) / 1e6;
+
+    f32 ref = jobs[n_threads].loss;
+    for (u32 t = 0; t < n_threads; t++) {
+        if (!jobs[t].ok || jobs[t].loss != ref) {
+            printf("  FAIL thread %u: loss %f, serial %f\n", t, jobs[t].loss, ref);
+            ok = false;
+        }
+    }
+    ok = ok && isfinite(ref);
+
+    printf("  %s  loss %f, 1 model %.3f ms, %u models on %u threads %.3f ms\n",
+           ok ? "PASS" : "FAIL", ref, serial_ms, n_threads, n_threads, threaded_ms);
+    free(w1);
+    free(w2);
+    free(in);
+}
+
+// resident pages among those overlapping [p, p + bytes)
+static usize resident_pages(const void* p, usize bytes) {
+    usize page = (usize)sysconf(_SC_PAGESIZE);
+    uintptr_t lo = (uintptr_t)p & ~(uintptr_t)(page - 1);
+    usize n = ((uintptr_t)p + bytes - lo + page - 1) / page;
+    unsigned char* vec = malloc(n);
+    usize res = 0;
+    if (mincore((void*)lo, n * page, vec) == 0) {
+        for (usize i = 0; i < n; i++) {
+            res += vec[i] & 1;
+        }
+    }
+    free(vec);
+    return res;
+}
+
+// a spike within slack keeps its pages, one past it is handed back, the counters follow along
+void test_arena_stats(usize small, usize spike, usize slack) {
+    printf("test_arena_stats spikes %zu MiB / %zu MiB, slack %zu MiB\n", small >> 20, spike >> 20, slack >> 20);
+
+    arena_allocator* arena = arena_create(GiB(1), MiB(1), 8);
+    arena_set_decommit(arena, slack);
+    ArenaStats before = arena_get_stats(arena);
+
+    arena_scope scope = arena_scope_begin(arena);
+    u8* a = arena_alloc(arena, 1, small);
+    memset(a, 1, small);
+    arena_scope_end(scope);
+    ArenaStats after_small = arena_get_stats(arena);
+    bool ok = after_small.n_decommits == 0 && after_small.committed >= small && after_small.used == before.used;
+
+    scope = arena_scope_begin(arena);
+    u8* b = arena_alloc(arena, 1, spike);
+    memset(b, 1, spike);
+    usize resident = resident_pages(b, spike);
+    double start = perf_counter_ns();
+    arena_scope_end(scope);
+    double ms = (perf_counter_ns() - start) / 1e6;
+    ArenaStats after_spike = arena_get_stats(arena);
+    usize left = resident_pages(b, spike);
+
+    ok = ok && after_spike.n_decommits == 1 && after_spike.committed == before.committed;
+    ok = ok && after_spike.peak >= spike && after_spike.n_allocs == 2 && after_spike.n_commits >= 2;
+    // only the initial commit the spike started in stays
+    ok = ok && resident * (usize)sysconf(_SC_PAGESIZE) >= spike && left * (usize)sysconf(_SC_PAGESIZE) <= MiB(1);
+
+    // the pages come back on demand
+    scope = arena_scope_begin(arena);
+    u8* c = arena_alloc(arena, 1, spike);
+    memset(c, 2, spike);
+    ok = ok && c == b && c[spike - 1] == 2;
+    arena_scope_end(scope);
+    arena_reset_peak(arena);
+    ok = ok && arena_get_stats(arena).peak == arena_get_stats(arena).used;
+
+    printf("  %s  committed %zu KiB -> %zu MiB -> %zu KiB, %zu of %zu pages resident after free, decommit %.3f ms\n",
+           ok ? "PASS" : "FAIL", before.committed >> 10, after_small.committed >> 20, after_spike.committed >> 10,
+           left, resident, ms);
+    arena_destroy(arena);
+}
+
+static bool same_bits(const void* a, const void* b, usize bytes, const char* what) {
+    if (memcmp(a, b, bytes) != 0) {
+        printf("  FAIL %s differs from its f32 run\n", what);
+        return false;
+    }
+    return true;
+}
+
+// bf16 operands widen exactly, so every bf16 kernel has to match its f32 run on the rounded values
+// bit for bit (and a bf16 result has to equal the rounded f32 result)
+void test_bf16_kernels(u32 m, u32 k, u32 n) {
+    printf("test_bf16_kernels [%u x %u] * [%u x %u]\n", m, k, k, n);
+    arena_allocator* arena = arena_create(GiB(1), MiB(1), 8);
+
+    u32 a_shape[4] = {1, 1, m, k};
+    u32 b_shape[4] = {1, 1, k, n};
+    u32 bt_shape[4] = {1, 1, n, k};
+    u32 bias_shape[4] = {1, 1, 1, n};
+    Tensor* a = tensor_create(a_shape, 4, arena);
+    Tensor* b = tensor_create(b_shape, 4, arena);
+    Tensor* bt = tensor_create(bt_shape, 4, arena);
+    Tensor* bias = tensor_create(bias_shape, 4, arena);
+    tensor_randomize(a, -1.0f, 1.0f);
+    tensor_randomize(b, -1.0f, 1.0f);
+    tensor_randomize(bt, -1.0f, 1.0f);
+    tensor_randomize(bias, -1.0f, 1.0f);
+    // ties and a NaN for the vector rounding
+    f32 special[4] = {1.00390625f, 1.01171875f, -3.0078125f, NAN};
+    memcpy(a->data, special, sizeof(special));
+
+    Tensor* a16 = tensor_to_dtype(a, TENSOR_BF16, arena);
+    Tensor* b16 = tensor_to_dtype(b, TENSOR_BF16, arena);
+    Tensor* bt16 = tensor_to_dtype(bt, TENSOR_BF16, arena);
+    bool ok = bf16_from_f32(special[0]) == 0x3F80 && bf16_from_f32(special[1]) == 0x3F82 && isnan(bf16_to_f32(a16->data16[3]));
+    for (usize i = 0; i < a->data_len; i++) {
+        ok = ok && a16->data16[i] == bf16_from_f32(a->data[i]);
+    }
+    if (!ok) {
+        printf("  FAIL rounding to bf16\n");
+    }
+    a->data[3] = 0.5f;
+    a16->data16[3] = bf16_from_f32(0.5f);
+    Tensor* ar = tensor_to_dtype(a16, TENSOR_F32, arena);
+    Tensor* br = tensor_to_dtype(b16, TENSOR_F32, arena);
+    Tensor* btr = tensor_to_dtype(bt16, TENSOR_F32, arena);
+
+    // B row-major and transposed, A row-major and transposed
+    Tensor* ref = tensor_mul(ar, br, arena);
+    ok = same_bits(tensor_mul(ar, b16, arena)->data, ref->data, ref->data_len * sizeof(f32), "bf16 B") && ok;
+    Tensor* ref_t = tensor_mul(ar, tensor_transpose(btr, arena), arena);
+    ok = same_bits(tensor_mul(ar, tensor_transpose(bt16, arena), arena)->data, ref_t->data, ref_t->data_len * sizeof(f32), "bf16 B^T") && ok;
+    Tensor* ref16 = tensor_to_dtype(ref, TENSOR_BF16, arena);
+    ok = same_bits(tensor_mul(a16, br, arena)->data16, ref16->data16, ref16->data_len * sizeof(bf16), "bf16 A, bf16 result") && ok;
+    // bf16 results are staged in the scratch arena of the thread running each block, which is empty again afterwards
+    u32 n_threads = parallel_get_num_threads();
+    parallel_set_num_threads(4);
+    ok = same_bits(tensor_mul(a16, br, arena)->data16, ref16->data16, ref16->data_len * sizeof(bf16), "threaded bf16 result") && ok;
+    if (arena_get_stats(parallel_scratch_arena()).used != 0) {
+        printf("  FAIL bf16 result left its tile in the scratch arena\n");
+        ok = false;
+    }
+    parallel_set_num_threads(n_threads);
+    Tensor* at16 = tensor_contiguous(tensor_transpose(a16, arena), arena);
+    ok = same_bits(tensor_mul(tensor_transpose(at16, arena), br, arena)->data16, ref16->data16, ref16->data_len * sizeof(bf16), "bf16 A^T") && ok;
+
+    Tensor* lin = tensor_linear(ar, br, bias, true, arena);
+    ok = same_bits(tensor_linear(ar, b16, bias, true, arena)->data, lin->data, lin->data_len * sizeof(f32), "linear") && ok;
+    Tensor* lin16 = tensor_to_dtype(lin, TENSOR_BF16, arena);
+    ok = same_bits(tensor_linear(a16, b16, bias, true, arena)->data16, lin16->data16, lin16->data_len * sizeof(bf16), "bf16 linear") && ok;
+
+    Tensor* relu = tensor_create(a_shape, 4, arena);
+    Tensor* relu16 = tensor_create_dtype(a_shape, 4, TENSOR_BF16, arena);
+    _tensor_kernel_relu(ar, relu);
+    _tensor_kernel_relu(a16, relu16);
+    ok = same_bits(tensor_to_dtype(relu16, TENSOR_F32, arena)->data, relu->data, relu->data_len * sizeof(f32), "relu") && ok;
+
+    for (usize dim = 2; dim < 4; dim++) {
+        Tensor* red = tensor_reduce_add(ar, dim, arena);
+        ok = same_bits(tensor_reduce_add(a16, dim, arena)->data, red->data, red->data_len * sizeof(f32), "reduce_add") && ok;
+    }
+
+    // elementwise ops widen bf16 the same way: a broadcast add either way round and a transposed copy
+    Tensor* ref16r = tensor_to_dtype(ref16, TENSOR_F32, arena);
+    Tensor* sum16 = tensor_to_dtype(tensor_add(ref16r, bias, arena), TENSOR_BF16, arena);
+    ok = same_bits(tensor_add(ref16, bias, arena)->data16, sum16->data16, sum16->data_len * sizeof(bf16), "bf16 add") && ok;
+    Tensor* bias16 = tensor_to_dtype(bias, TENSOR_BF16, arena);
+    Tensor* sum = tensor_add(ref, tensor_to_dtype(bias16, TENSOR_F32, arena), arena);
+    ok = same_bits(tensor_add(ref, bias16, arena)->data, sum->data, sum->data_len * sizeof(f32), "add of a bf16 row") && ok;
+    Tensor* t16 = tensor_contiguous(tensor_transpose(a16, arena), arena);
+    Tensor* t32 = tensor_contiguous(tensor_transpose(ar, arena), arena);
+    ok = same_bits(tensor_to_dtype(t16, TENSOR_F32, arena)->data, t32->data, t32->data_len * sizeof(f32), "transposed copy") && ok;
+
+    // the optimizer steps round the updated values into the bf16 copy in the same pass
+    Tensor* p = tensor_contiguous(tensor_transpose(t32, arena), arena);
+    Tensor* g = tensor_create(a_shape, 4, arena);
+    Tensor* m1 = tensor_create(a_shape, 4, arena);
+    Tensor* m2 = tensor_create(a_shape, 4, arena);
+    Tensor* p16 = tensor_create_dtype(a_shape, 4, TENSOR_BF16, arena);
+    tensor_randomize(g, -1.0f, 1.0f);
+    tensor_set(m1, 0.0f);
+    tensor_set(m2, 0.0f);
+    AdamStep hp = {.lr = 1e-2f, .beta1 = 0.9f, .beta2 = 0.999f, .eps = 1e-8f, .m_scale = 10.0f, .v_scale = 1000.0f};
+    _tensor_kernel_adam_step(p, g, m1, m2, &hp, p16);
+    ok = same_bits(p16->data16, tensor_to_dtype(p, TENSOR_BF16, arena)->data16, p16->data_len * sizeof(bf16), "adam bf16 copy") && ok;
+    _tensor_kernel_momentum_step(p, g, m1, 1e-2f, 0.9f, true, p16);
+    ok = same_bits(p16->data16, tensor_to_dtype(p, TENSOR_BF16, arena)->data16, p16->data_len * sizeof(bf16), "momentum bf16 copy") && ok;
+
+    // a bf16 activation through a residual style add and the loss, against the same graph in f32
+    f32 losses[2];
+    Tensor* grads[2];
+    u32* labels = malloc(m * sizeof(u32));
+    for (u32 i = 0; i < m; i++) {
+        labels[i] = i % n;
+    }
+    gradt_set_arena(arena_create(GiB(1), MiB(1), 8));
+    for (usize v = 0; v < 2; v++) {
+        GradTensor* x = gradt_create(ref->shape, 4);
+        GradTensor* r = gradt_create(bias_shape, 4);
+        _tensor_kernel_copy(ref16, x->tens);
+        _tensor_kernel_copy(bias, r->tens);
+        GradTensor* y = gradt_add(v == 1 ? gradt_cast(x, TENSOR_BF16) : x, r);
+        GradTensor* loss = y != NULL ? gradt_cross_entropy_loss(y, gradt_create_from_labels(labels, n, m, false)) : NULL;
+        if (loss == NULL || y->tens->dtype != (v == 1 ? TENSOR_BF16 : TENSOR_F32)) {
+            printf("  FAIL %s add / loss\n", v == 1 ? "bf16" : "f32");
+            ok = false;
+            break;
+        }
+        gradt_backward(loss, NULL, NULL);
+        losses[v] = loss->tens->data[0];
+        grads[v] = x->grad;
+    }
+    if (ok) {
+        f32 max_grad = 0.0f, max_diff = 0.0f;
+        for (usize i = 0; i < grads[0]->data_len; i++) {
+            max_grad = fmaxf(max_grad, fabsf(grads[0]->data[i]));
+            max_diff = fmaxf(max_diff, fabsf(grads[1]->data[i] - grads[0]->data[i]));
+        }
+        // y is rounded to bf16, which moves logits of this size by a few hundredths
+        if (fabsf(losses[1] - losses[0]) > 1e-2f * losses[0] || max_diff > 5e-2f * max_grad) {
+            printf("  FAIL bf16 add: loss %f vs %f, grad diff %f of %f\n", losses[1], losses[0], max_diff, max_grad);
+            ok = false;
+        }
+    }
+
+    // a slab keeps its own bf16 copies at the parameters' offsets and rounds them in the same sweep
+    GradTensor* w = gradt_create(b_shape, 4);
+    GradTensor* wb = gradt_create(bias_shape, 4);
+    _tensor_kernel_copy(b, w->tens);
+    gradt_enable_bf16(w);
+    ParamSlab slab = param_slab_create((GradTensor*[]){wb, w}, 2);
+    tensor_randomize(w->grad, -1.0f, 1.0f);
+    AdamConfig adam = optim_adam_get_config(1e-2, 0.9, 0.999, 1e-8, 0.0);
+    param_slab_step(&slab, optim_adam, &adam);
+    Tensor* w_copy = tensor_to_dtype(w->tens16, TENSOR_F32, arena);
+    Tensor* w_round = tensor_to_dtype(tensor_to_dtype(w->tens, TENSOR_BF16, arena), TENSOR_F32, arena);
+    ok = w->tens16->data16 >= slab.flat->tens16->data16 && same_bits(w_copy->data, w_round->data, w_round->data_len * sizeof(f32), "slab bf16 copy") && ok;
+    gradt_destroy_arena();
+    free(labels);
+
+    printf("  %s\n", ok ? "PASS" : "FAIL");
+    arena_destroy(arena);
+}
+
+// estimated bytes one MLP step moves through its matmul operands, relu masks and Adam, w / a = bytes
+// per weight / activation element read by the matmuls (grads, the f32 master and its state stay f32)
+static usize tensor_bytes(const Tensor* t) {
+    return t != NULL ? t->data_len * tensor_elem_size(t) : 0;
+}
+
+// footprint of one replayed step, each buffer counted once although most are read or written more
+// than once per step: what the forward and backward kernels touch (the values they read, i.e. the
+// bf16 copy where there is one, and the grads) and what only the optimizer sweep touches (f32
+// masters behind a bf16 copy, optimizer state)
+static void plan_bytes(const GradPlan* plan, usize* graph, usize* optim) {
+    *graph = 0;
+    *optim = 0;
+    for (usize i = 0; i < plan->len; i++) {
+        const GradTensor* gt = plan->order[i];
+        *graph += tensor_bytes(gradt_value(gt)) + tensor_bytes(gt->grad);
+        *optim += (gt->tens16 != NULL ? tensor_bytes(gt->tens) : 0);
+        *optim += tensor_bytes(gt->optim_state[0]) + tensor_bytes(gt->optim_state[1]);
+    }
+}
+
+// the same MLP in f32 and with bf16 weights (f32 masters) and activations: training steps with Adam
+// and no-grad inference, time and the bytes of the buffers each one touches (see plan_bytes)
+void test_bf16(u32 batch, u32 in_dim, u32 hidden, u32 classes, u32 steps) {
+    printf("test_bf16 [%u x %u] -> %u -> %u, %u steps\n", batch, in_dim, hidden, classes, steps);
+
+    f32* w1 = malloc((usize)in_dim * hidden * sizeof(f32));
+    f32* w2 = malloc((usize)hidden * classes * sizeof(f32));
+    f32* in = malloc((usize)batch * in_dim * sizeof(f32));
+    for (usize i = 0; i < (usize)in_dim * hidden; i++) {
+        w1[i] = random_f32(-0.05f, 0.05f);
+    }
+    for (usize i = 0; i < (usize)hidden * classes; i++) {
+        w2[i] = random_f32(-0.05f, 0.05f);
+    }
+    for (usize i = 0; i < (usize)batch * in_dim; i++) {
+        in[i] = random_f32(-1.0f, 1.0f);
+    }
+    u32* labels = malloc(batch * sizeof(u32));
+    for (u32 i = 0; i < batch; i++) {
+        labels[i] = i % classes;
+    }
+
+    enum { REPS = 20 };
+    f32 first[2], last[2];
+    double step_ms[2], infer_ms[2];
+    usize step_bytes[2], optim_bytes[2], infer_bytes[2];
+    f32* outs[2];
+    for (usize v = 0; v < 2; v++) {
+        bool half = v == 1;
+        gradt_set_arena(arena_create(GiB(4), MiB(1), 8));
+        arena_allocator* arena = _gradt_get_arena();
+        AdamConfig adam = optim_adam_get_config(1e-5, 0.9, 0.999, 1e-8, 0.0);
+        u32 in_shape[4] = {1, 1, batch, in_dim};
+        GradTensor* x = gradt_create_nograd(in_shape, 4);
+        fill_rows(x->tens, in, batch, in_dim);
+        GradTensor* truth = gradt_create_from_labels(labels, classes, batch, false);
+        LinearLayer l1 = nn_linear_create(in_dim, hidden);
+        LinearLayer l2 = nn_linear_create(hidden, classes);
+        fill_rows(l1.w->tens, w1, in_dim, hidden);
+        fill_rows(l2.w->tens, w2, hidden, classes);
+        if (half) {
+            gradt_enable_bf16(l1.w);
+            gradt_enable_bf16(l2.w);
+        }
+
+        GradTensor* xin = half ? gradt_cast(x, TENSOR_BF16) : x;
+        GradTensor* logits = nn_linear_forward(&l2, nn_linear_relu_forward(&l1, xin));
+        GradTensor* loss = nn_cross_enropy_loss(logits, truth);
+        GradPlan plan = gradt_plan_capture(loss);
+        gradt_plan_step(&plan, optim_adam, &adam);
+        first[v] = loss->tens->data[0];
+        double start = perf_counter_ns();
+        for (u32 s = 1; s < steps; s++) {
+            gradt_plan_step(&plan, optim_adam, &adam);
+        }
+        step_ms[v] = (perf_counter_ns() - start) / 1e6 / (steps - 1);
+        last[v] = loss->tens->data[0];
+        plan_bytes(&plan, &step_bytes[v], &optim_bytes[v]);
+
+        // inference on the trained weights, both runs end at the same weights up to rounding
+        bool prev = gradt_set_grad_enabled(false);
+        u32 out_shape[4] = {1, 1, batch, classes};
+        Tensor* out = tensor_create(out_shape, 4, arena);
+        // what the matmuls read plus the activations a forward allocates
+        infer_bytes[v] = tensor_bytes(x->tens) + tensor_bytes(gradt_value(l1.w)) + tensor_bytes(l1.b->tens) +
+                         tensor_bytes(gradt_value(l2.w)) + tensor_bytes(l2.b->tens);
+        start = perf_counter_ns();
+        for (u32 r = 0; r < REPS; r++) {
+            arena_scope scope = arena_scope_begin(arena);
+            GradTensor* xi = half ? gradt_cast(x, TENSOR_BF16) : x;
+            GradTensor* y = nn_linear_forward(&l2, nn_linear_relu_forward(&l1, xi));
+            _tensor_kernel_copy(y->tens, out);
+            if (r == 0) {
+                infer_bytes[v] += arena->alloc_pos - scope.pos;
+            }
+            arena_scope_end(scope);
+        }
+        infer_ms[v] = (perf_counter_ns() - start) / 1e6 / REPS;
+        gradt_set_grad_enabled(prev);
+        outs[v] = malloc(out->data_len * sizeof(f32));
+        memcpy(outs[v], out->data, out->data_len * sizeof(f32));
+        gradt_destroy_arena();
+    }
+
+    f32 max_out = 0.0f, max_diff = 0.0f;
+    for (usize i = 0; i < (usize)batch * classes; i++) {
+        max_out = fmaxf(max_out, fabsf(outs[0][i]));
+        max_diff = fmaxf(max_diff, fabsf(outs[1][i] - outs[0][i]));
+    }
+    bool ok = last[0] < first[0] && last[1] < first[1] && fabsf(last[1] - last[0]) <= 0.05f * last[0] + 1e-3f;
+    ok = ok && isfinite(max_diff) && max_diff <= 0.05f * max_out;
+
+    printf("  %s  loss %f -> %f (f32) / %f -> %f (bf16), inference max diff %.4f of %.4f\n",
+           ok ? "PASS" : "FAIL", first[0], last[0], first[1], last[1], max_diff, max_out);
+    printf("        train  f32 %.3f ms/step, buffers %.1f MB fwd/bwd + %.1f MB optimizer; bf16 %.3f ms/step, "
+           "buffers %.1f MB fwd/bwd + %.1f MB optimizer\n", step_ms[0], step_bytes[0] / 1e6, optim_bytes[0] / 1e6,
+           step_ms[1], step_bytes[1] / 1e6, optim_bytes[1] / 1e6);
+    printf("        infer  f32 %.3f ms, buffers %.1f MB; bf16 %.3f ms, buffers %.1f MB\n", infer_ms[0],
+           infer_bytes[0] / 1e6, infer_ms[1], infer_bytes[1] / 1e6);
+    free(outs[0]);
+    free(outs[1]);
+    free(w1);
+    free(w2);
+    free(in);
+    free(labels);
+}
@@ -26,8 +26,8 @@ DynArray create_dynarr(usize cap) {
 
 void push_dynarr(DynArray* a, void* el){
     if (a->len >= a->cap) {
-        a->cap *= 1.5;
-        a->ptr = realloc(a->ptr, a->cap);
+        a->cap = a->cap < 8 ? 8 : a->cap + a->cap / 2;
+        a->ptr = realloc(a->ptr, a->cap * sizeof(void*));
     }
     a->ptr[a->len] = el;
     a->len++;